@@ -20,7 +20,9 @@
  *
  * @note		These functions are written with code size rather than
  *			speed in mind, which is more important in the loader.
- *			The kernel functions are optimised for speed.
+ *			The exceptions are memcpy() and memset(), which move
+ *			every disk block and module that gets loaded. The
+ *			kernel functions are optimised for speed.
  */
 
 #include <lib/ctype.h>
@@ -29,6 +31,9 @@
 
 #include <memory.h>
 
+/** Word type used by the block functions. */
+typedef unsigned long __attribute__((may_alias)) block_word_t;
+
 /** Copy data in memory.
  *
  * Copies bytes from a source memory area to a destination memory area,
@@ -43,11 +48,44 @@
 void *memcpy(void *__restrict dest, const void *__restrict src, size_t count) {
 	const unsigned char *s = src;
 	unsigned char *d = dest;
+#ifdef CONFIG_ARCH_X86
+	size_t head = (-(ptr_t)d) & 3;
+
+	if(head > count) {
+		head = count;
+	}
+	count -= head;
+
+	/* Align the destination, move dwords, then the remaining bytes. */
+	__asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(head) :: "memory");
+	head = count >> 2;
+	__asm__ volatile("rep movsl" : "+D"(d), "+S"(s), "+c"(head) :: "memory");
+	count &= 3;
+	__asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(count) :: "memory");
+#else
+	const block_word_t *ws;
+	block_word_t *wd;
+
+	/* Move words if both sides can be aligned together. */
+	if(count >= sizeof(*wd) * 2 && !(((ptr_t)d ^ (ptr_t)s) & (sizeof(*wd) - 1))) {
+		for(; (ptr_t)d & (sizeof(*wd) - 1); count--) {
+			*d++ = *s++;
+		}
+
+		ws = (const block_word_t *)s;
+		wd = (block_word_t *)d;
+		for(; count >= sizeof(*wd); count -= sizeof(*wd)) {
+			*wd++ = *ws++;
+		}
+
+		s = (const unsigned char *)ws;
+		d = (unsigned char *)wd;
+	}
 
 	for(; count != 0; count--) {
 		*d++ = *s++;
 	}
-
+#endif
 	return dest;
 }
 
@@ -58,11 +96,40 @@ void *memcpy(void *__restrict dest, const void *__restrict src, size_t count) {
  * @return		Destination location. */
 void *memset(void *dest, int val, size_t count) {
 	unsigned char *d = dest;
+	block_word_t pattern = (unsigned char)val * (~0UL / 0xFF);
+#ifdef CONFIG_ARCH_X86
+	size_t head = (-(ptr_t)d) & 3;
+
+	if(head > count) {
+		head = count;
+	}
+	count -= head;
+
+	__asm__ volatile("rep stosb" : "+D"(d), "+c"(head) : "a"(pattern) : "memory");
+	head = count >> 2;
+	__asm__ volatile("rep stosl" : "+D"(d), "+c"(head) : "a"(pattern) : "memory");
+	count &= 3;
+	__asm__ volatile("rep stosb" : "+D"(d), "+c"(count) : "a"(pattern) : "memory");
+#else
+	block_word_t *wd;
+
+	if(count >= sizeof(*wd) * 2) {
+		for(; (ptr_t)d & (sizeof(*wd) - 1); count--) {
+			*d++ = (unsigned char)val;
+		}
+
+		wd = (block_word_t *)d;
+		for(; count >= sizeof(*wd); count -= sizeof(*wd)) {
+			*wd++ = pattern;
+		}
+
+		d = (unsigned char *)wd;
+	}
 
 	for(; count != 0; count--) {
 		*d++ = (unsigned char)val;
 	}
-
+#endif
 	return dest;
 }
 
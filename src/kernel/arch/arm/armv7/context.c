@@ -21,6 +21,8 @@
 #include <io.h>
 #include <system.h>
 #include <assert.h>
+#include <interrupts.h>
+#include <fpu.h>
 
 #define POOL_STACK_SZ       0x1000
 #define POOL_STACK_COUNT    0x1000
@@ -86,3 +88,33 @@ void destroy_context(context_t *ctx) {
         pool_dealloc_and_free(stackpool, (void *) ctx->stackbase);
     }
 }
+
+/// \todo Lazy VFP/NEON switching. Until then, threads must not use VFP and
+///       kernel_fpu_begin only masks interrupts.
+void fpu_init() {
+}
+
+void fpu_cpuinit() {
+}
+
+void fpu_switch_out(context_t *ctx __unused) {
+}
+
+void fpu_destroy(context_t *ctx __unused) {
+}
+
+int kernel_fpu_begin() {
+    int ints = interrupts_get();
+    interrupts_disable();
+    return ints;
+}
+
+void kernel_fpu_end(int state) {
+    if(state) {
+        interrupts_enable();
+    }
+}
+
+int fpu_simd_available() {
+    return 0;
+}
@@ -19,6 +19,19 @@ typedef struct _arm_ctx {
 } __packed __aligned(8) context_t;
 
 #define __halt __asm__ __volatile__("wfi")
+#define __spin __asm__ __volatile__("yield")
+
+/// Raw CPU cycle count (PMCCNTR), for timing short stretches cheaply. Reads
+/// a constant unless the performance monitors have been enabled.
+static inline uint64_t arch_cycles() {
+    uint32_t c;
+    __asm__ __volatile__("mrc p15, 0, %0, c9, c13, 0" : "=r" (c));
+    return c;
+}
+
+/// Waits for an interrupt, then enables interrupts so it can be taken. WFI
+/// wakes on a pending interrupt even while they are masked.
+#define __idle_halt __asm__ __volatile__("wfi; cpsie i")
 
 #define _CONTEXT_T_DEFINED
 
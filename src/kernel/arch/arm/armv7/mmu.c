@@ -66,6 +66,12 @@ extern int __end;
 #define CACHE_WTHRU         2
 #define CACHE_WBACK         3
 
+#define SECTION_PAGES       (LARGE_PAGE_SIZE / PAGE_SIZE)
+
+/// Sections are only used in the kernel half, where every 1 MB has a page
+/// table preallocated at a fixed location to fall back to.
+#define SECTION_MIN         0x40000000UL
+
 /** Section B3.3 in the ARM Architecture Reference Manual (ARMv7) */
 
 /// First level descriptor - roughly equivalent to a page directory entry on x86
@@ -190,6 +196,82 @@ void arch_vmem_prime(paddr_t p) {
     g_primedpage = p;
 }
 
+/// Points a first-level entry back at its preallocated page table.
+static void restore_pagetable(uint32_t pdir_offset) {
+    struct first_level *pdir = (struct first_level *) PAGEDIR_VIRT;
+    pdir[pdir_offset].descriptor.entry = PAGETABS_PHYS + (pdir_offset * 0x400);
+    pdir[pdir_offset].descriptor.pageTable.type = FIRSTLEVEL_PAGETAB;
+    pdir[pdir_offset].descriptor.pageTable.domain = DOMAIN_KERNEL;
+}
+
+/// Replaces a section with small pages in its preallocated page table, which
+/// maps the same memory with the same attributes.
+static void demote_section(uint32_t pdir_offset) {
+    struct first_level *pdir = (struct first_level *) PAGEDIR_VIRT;
+    if(pdir[pdir_offset].descriptor.fault.type != FIRSTLEVEL_SECTION)
+        return;
+
+    struct first_level sec = pdir[pdir_offset];
+    struct second_level *ptab = (struct second_level *) (PAGETABS_VIRT + (pdir_offset * 0x400));
+    for(size_t i = 0; i < SECTION_PAGES; i++) {
+        ptab[i].descriptor.entry = (sec.descriptor.section.base << 20) + (i * PAGE_SIZE);
+        if(sec.descriptor.section.xn)
+            ptab[i].descriptor.smallpage.type = SECLEVEL_SMALLNX;
+        else
+            ptab[i].descriptor.smallpage.type = SECLEVEL_SMALL;
+        ptab[i].descriptor.smallpage.b = sec.descriptor.section.b;
+        ptab[i].descriptor.smallpage.c = sec.descriptor.section.c;
+        ptab[i].descriptor.smallpage.ap1 = sec.descriptor.section.ap1;
+        ptab[i].descriptor.smallpage.tex = sec.descriptor.section.tex;
+        ptab[i].descriptor.smallpage.ap2 = sec.descriptor.section.ap2;
+        ptab[i].descriptor.smallpage.s = sec.descriptor.section.s;
+        ptab[i].descriptor.smallpage.nG = sec.descriptor.section.nG;
+    }
+
+    __barrier;
+
+    restore_pagetable(pdir_offset);
+    tlb_invalall();
+}
+
+/// Maps a section if v and p are suitably aligned and its page table has
+/// nothing in it. Returns 1 if it did.
+static int map_section(vaddr_t v, paddr_t p, size_t f) {
+    if((v < SECTION_MIN) || ((v | p) & (LARGE_PAGE_SIZE - 1)) || (f & VMEM_DEVICE))
+        return 0;
+
+    uint32_t pdir_offset = v >> 20;
+    struct first_level *pdir = (struct first_level *) PAGEDIR_VIRT;
+    if(pdir[pdir_offset].descriptor.fault.type != FIRSTLEVEL_PAGETAB)
+        return 0;
+
+    struct second_level *ptab = (struct second_level *) (PAGETABS_VIRT + (pdir_offset * 0x400));
+    for(size_t i = 0; i < SECTION_PAGES; i++) {
+        if(ptab[i].descriptor.fault.type)
+            return 0;
+    }
+
+    struct first_level sec;
+    sec.descriptor.entry = (uint32_t) (p & PADDR_MASK);
+    sec.descriptor.section.type = FIRSTLEVEL_SECTION;
+    sec.descriptor.section.domain = DOMAIN_KERNEL;
+    sec.descriptor.section.ap1 = ap1_flags(f);
+    sec.descriptor.section.ap2 = ap2_flags(f);
+    sec.descriptor.section.xn = (f & VMEM_EXEC) ? 0 : 1;
+    if((f & VMEM_GLOBAL) == 0)
+        sec.descriptor.section.nG = 1;
+
+    // Cacheable memory - write through, no write allocate on outer.
+    sec.descriptor.section.tex = TEX_CACHEABLE | CACHE_WTHRU;
+    sec.descriptor.section.c = CACHE_WBACKWALLOC >> 1;
+    sec.descriptor.section.b = CACHE_WBACKWALLOC & 0x1;
+
+    pdir[pdir_offset] = sec;
+    tlb_invalpage(v);
+
+    return 1;
+}
+
 int arch_vmem_map(vaddr_t v, paddr_t p, size_t f) {
     // Determine which range of page tables to use
     unative_t page_tables = 0;
@@ -217,6 +299,9 @@ int arch_vmem_map(vaddr_t v, paddr_t p, size_t f) {
     uint32_t ptab_offset = (vaddr >> 12) & 0xFF;
 
     struct first_level *pdir = (struct first_level *) PAGEDIR_VIRT;
+    if((v >= SECTION_MIN) && (pdir[pdir_offset].descriptor.fault.type == FIRSTLEVEL_SECTION))
+        demote_section(pdir_offset);
+
     if(!pdir[pdir_offset].descriptor.fault.type) {
         // Allocate page table.
         /// \todo implement me!
@@ -272,7 +357,7 @@ void arch_vmem_unmap(vaddr_t v) {
     uint32_t pdir_offset = vaddr >> 20;
     uint32_t ptab_offset = (vaddr >> 12) & 0xFF;
 
-    /// \todo Handle sections/supersections.
+    /// \todo Handle supersections.
     /// \todo Handle large pages.
 
     struct first_level *pdir = (struct first_level *) PAGEDIR_VIRT;
@@ -281,6 +366,9 @@ void arch_vmem_unmap(vaddr_t v) {
         return;
     }
 
+    if((v >= SECTION_MIN) && (pdir[pdir_offset].descriptor.fault.type == FIRSTLEVEL_SECTION))
+        demote_section(pdir_offset);
+
     struct second_level *ptab = (struct second_level *) (page_tables + (pdir_offset * 0x400));
     if(ptab[ptab_offset].descriptor.fault.type) {
         ptab[ptab_offset].descriptor.fault.type = SECLEVEL_FAULT;
@@ -290,6 +378,61 @@ void arch_vmem_unmap(vaddr_t v) {
     tlb_invalpage(vaddr);
 }
 
+/// \todo Batch the invalidations - single CPU only for now, so no IPIs.
+int arch_vmem_map_range(vaddr_t v, paddr_t p, size_t pages, size_t f) {
+    for(size_t i = 0; i < pages; i++) {
+        paddr_t page = (p == (paddr_t) ~0) ? p : p + (i * PAGE_SIZE);
+        if((p != (paddr_t) ~0) && ((pages - i) >= SECTION_PAGES) &&
+           map_section(v + (i * PAGE_SIZE), page, f)) {
+            i += SECTION_PAGES - 1;
+            continue;
+        }
+
+        if(arch_vmem_map(v + (i * PAGE_SIZE), page, f) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+void arch_vmem_unmap_range(vaddr_t v, size_t pages, int release) {
+    struct first_level *pdir = (struct first_level *) PAGEDIR_VIRT;
+    for(size_t i = 0; i < pages; i++, v += PAGE_SIZE) {
+        uint32_t pdir_offset = v >> 20;
+        if((v >= SECTION_MIN) && !(v & (LARGE_PAGE_SIZE - 1)) && ((pages - i) >= SECTION_PAGES) &&
+           (pdir[pdir_offset].descriptor.fault.type == FIRSTLEVEL_SECTION)) {
+            // The whole section goes; its page table is still empty.
+            paddr_t p = (paddr_t) (pdir[pdir_offset].descriptor.section.base << 20);
+            restore_pagetable(pdir_offset);
+            tlb_invalall();
+            if(release)
+                pmem_dealloc_range(p, SECTION_PAGES);
+
+            i += SECTION_PAGES - 1;
+            v += LARGE_PAGE_SIZE - PAGE_SIZE;
+            continue;
+        }
+
+        if(!arch_vmem_ismapped(v))
+            continue;
+
+        paddr_t p = arch_vmem_v2p(v);
+        arch_vmem_unmap(v);
+        if(release)
+            pmem_dealloc(p);
+    }
+}
+
+void arch_vmem_unmap_local(vaddr_t v) {
+    arch_vmem_unmap(v);
+}
+
+void arch_vmem_shootdown_recv() {
+}
+
+void arch_spin_poll() {
+}
+
 int arch_vmem_modify(vaddr_t v __unused, size_t nf __unused) {
 	return -1;
 }
@@ -324,6 +467,9 @@ vaddr_t arch_vmem_create() {
 	return 0;
 }
 
+void arch_vmem_destroy(vaddr_t as __unused) {
+}
+
 void arch_vmem_switch(vaddr_t pd __unused) {
 }
 
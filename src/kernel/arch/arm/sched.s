@@ -32,7 +32,10 @@ switch_context:
     cmp r2, #0
     beq .nolock
 
-    mov r1, #0
+    # Serve the next ticket. Only the lock holder writes this.
+    dmb
+    ldr r1, [r2]
+    add r1, r1, #1
     str r1, [r2]
 
 .nolock:
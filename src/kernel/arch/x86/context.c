@@ -21,17 +21,24 @@
 #include <io.h>
 #include <system.h>
 #include <assert.h>
+#include <fpu.h>
+#include <vmem.h>
 
 #define POOL_STACK_SZ       0x4000
 #define POOL_STACK_COUNT    0x1000
 
+// Each stack sits above an unmapped guard page, so overflows fault.
+#define POOL_STACK_GUARD    PAGE_SIZE
+#define POOL_STACK_SLOT     (POOL_STACK_SZ + POOL_STACK_GUARD)
+
 #define EFLAGS_INT_ENBALE   (1UL << 9)
 
 static void *stackpool = 0;
 
 void init_context() {
-    // Create a pool for stacks - 4096, 4KB stacks = 16 MB maximum pool size.
-    stackpool = create_pool_at(POOL_STACK_SZ, POOL_STACK_COUNT, (STACK_TOP - STACK_SIZE) - (POOL_STACK_SZ * POOL_STACK_COUNT));
+    // Create a pool for stacks - 4096, 16KB stacks = 80 MB of address space
+    // with the guard pages. Stack pages are only committed once touched.
+    stackpool = create_pool_reserved(POOL_STACK_SLOT, POOL_STACK_COUNT, (STACK_TOP - STACK_SIZE) - (POOL_STACK_SLOT * POOL_STACK_COUNT), POOL_STACK_GUARD);
 }
 
 void create_context(context_t *ctx, thread_entry_t start, uintptr_t stack, size_t stacksz, void *param) {
@@ -54,6 +61,24 @@ void create_context(context_t *ctx, thread_entry_t start, uintptr_t stack, size_
 
     assert(stack_ptr != 0);
 
+#ifdef X86_64
+    ctx->rip = (uintptr_t) start;
+    ctx->rdi = (uintptr_t) param;
+    ctx->stackbase = (uintptr_t) stack_ptr;
+    ctx->rflags = EFLAGS_INT_ENBALE;
+
+    // The ABI wants the stack 16-byte aligned at each call, so the return
+    // address sits just below an aligned boundary. restore_thread_context pops
+    // a return address before jumping to the thread, so leave room for one.
+    uintptr_t stack_top = ((((uintptr_t) stack_ptr) + stacksz) & ~0xFUL) - sizeof(unative_t);
+
+    uintptr_t *stackp = (uintptr_t *) stack_top;
+    *stackp = (uintptr_t) thread_return;
+
+    ctx->rsp = (uintptr_t) (stackp - 1);
+
+    dprintf("new x86-64 context %p: rip=%lx, rsp=%lx (stack: %lx-%lx)\n", ctx, ctx->rip, ctx->rsp, ctx->stackbase, stack_top + sizeof(unative_t));
+#else
     ctx->eip = (uint32_t) start;
     ctx->stackbase = (uint32_t) stack_ptr;
     ctx->eflags = EFLAGS_INT_ENBALE;
@@ -69,6 +94,7 @@ void create_context(context_t *ctx, thread_entry_t start, uintptr_t stack, size_
     ctx->esp = (uint32_t) stackp;
 
     dprintf("new x86 context %p: eip=%x, esp=%x, ebp=%x (stack: %x-%x)\n", ctx, ctx->eip, ctx->esp, ctx->ebp, ctx->stackbase, stack_top + sizeof(unative_t));
+#endif
 }
 
 void clone_context(context_t *old, context_t *new) {
@@ -76,10 +102,26 @@ void clone_context(context_t *old, context_t *new) {
     assert(old->stackispool);
 
     void *stack = pool_alloc(stackpool);
-    memcpy(stack, (void *) old->stackbase, POOL_STACK_SZ);
 
-    new->stackbase = (uint32_t) stack;
+    // Pages the old stack never touched hold nothing worth copying, so don't
+    // commit them just to read them.
+    for(size_t off = 0; off < POOL_STACK_SZ; off += PAGE_SIZE) {
+        if(vmem_ismapped(old->stackbase + off))
+            memcpy((char *) stack + off, (void *) (old->stackbase + off), PAGE_SIZE);
+    }
+
+    new->stackbase = (uintptr_t) stack;
+    new->fpu = 0;
 
+#ifdef X86_64
+    unative_t rbp_diff = old->rbp - old->stackbase;
+    unative_t rsp_diff = old->rsp - old->stackbase;
+
+    new->rbp = new->stackbase + rbp_diff;
+    new->rsp = new->stackbase + rsp_diff;
+
+    dprintf("cloned x86-64 context %p -> %p: rip=%lx, rsp=%lx\n", old, new, new->rip, new->rsp);
+#else
     unative_t ebp_diff = old->esp - old->stackbase;
     unative_t esp_diff = old->esp - old->stackbase;
 
@@ -87,11 +129,14 @@ void clone_context(context_t *old, context_t *new) {
     new->esp = new->stackbase + esp_diff;
 
     dprintf("cloned x86 context %p -> %p: eip=%x, esp=%x\n", old, new, new->eip, new->esp);
+#endif
 }
 
 void destroy_context(context_t *ctx) {
     assert(ctx != 0);
 
+    fpu_destroy(ctx);
+
     if(ctx->stackispool)
         pool_dealloc_and_free(stackpool, (void *) ctx->stackbase);
 }
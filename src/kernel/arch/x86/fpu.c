@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <types.h>
+#include <system.h>
+#include <interrupts.h>
+#include <sched.h>
+#include <slab.h>
+#include <fpu.h>
+#include <io.h>
+
+#define CR0_MP              (1UL << 1)
+#define CR0_EM              (1UL << 2)
+#define CR0_TS              (1UL << 3)
+#define CR0_NE              (1UL << 5)
+
+#define CR4_OSFXSR          (1UL << 9)
+#define CR4_OSXMMEXCPT      (1UL << 10)
+
+#define CPUID_EDX_FXSR      (1UL << 24)
+#define CPUID_EDX_SSE       (1UL << 25)
+#define CPUID_EDX_SSE2      (1UL << 26)
+
+#define TRAP_DEVICE_NOT_AVAILABLE   7
+
+/// FXSAVE needs 512 bytes, FNSAVE only 108.
+#define FPU_STATE_SIZE      512
+#define FPU_STATE_ALIGN     16
+
+/// Default MXCSR: all SIMD exceptions masked, round to nearest.
+#define MXCSR_DEFAULT       0x1F80
+
+static int has_fxsr = 0;
+static int has_sse = 0;
+static int has_sse2 = 0;
+
+static struct kmem_cache *fpu_cache = 0;
+
+static unative_t read_cr0() {
+    unative_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+static void set_ts() {
+    __asm__ volatile("mov %0, %%cr0" :: "r" (read_cr0() | CR0_TS));
+}
+
+static unative_t read_cr4() {
+    unative_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r" (cr4));
+    return cr4;
+}
+
+static void clear_ts() {
+    __asm__ volatile("clts");
+}
+
+static void fpu_save(void *state) {
+    if(has_fxsr)
+        __asm__ volatile("fxsave (%0)" :: "r" (state) : "memory");
+    else
+        __asm__ volatile("fnsave (%0)" :: "r" (state) : "memory");
+}
+
+static void fpu_restore(void *state) {
+    if(has_fxsr)
+        __asm__ volatile("fxrstor (%0)" :: "r" (state) : "memory");
+    else
+        __asm__ volatile("frstor (%0)" :: "r" (state) : "memory");
+}
+
+static void fpu_reset() {
+    __asm__ volatile("fninit");
+    if(has_sse) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        __asm__ volatile("ldmxcsr %0" :: "m" (mxcsr));
+    }
+}
+
+/**
+ * #NM handler: the current thread touched the FPU for the first time since it
+ * was switched in. Give it back its state (or a clean FPU if it never had one).
+ */
+static int fpu_trap(struct intr_stack *stack __unused, void *p __unused) {
+    struct thread *t = sched_current_thread();
+    if(!t) {
+        // Early boot, nothing to switch between yet.
+        clear_ts();
+        fpu_reset();
+        return 0;
+    }
+
+    // Allocate before clearing TS: the allocator may use kernel_fpu_begin
+    // itself, which sets TS again when it's done.
+    context_t *ctx = t->ctx;
+    if(!ctx->fpu) {
+        kmem_cache_get(&fpu_cache, "fpu_state", FPU_STATE_SIZE, FPU_STATE_ALIGN, 0);
+        ctx->fpu = kmem_cache_alloc(fpu_cache);
+
+        clear_ts();
+        fpu_reset();
+    } else {
+        clear_ts();
+        fpu_restore(ctx->fpu);
+    }
+
+    return 0;
+}
+
+void fpu_switch_out(context_t *ctx) {
+    // TS is set on every switch, so if it's clear this thread used the FPU
+    // during its time on the CPU and the registers hold its live state.
+    if(read_cr0() & CR0_TS)
+        return;
+
+    if(ctx->fpu)
+        fpu_save(ctx->fpu);
+
+    set_ts();
+}
+
+void fpu_destroy(context_t *ctx) {
+    if(ctx->fpu) {
+        kmem_cache_free(fpu_cache, ctx->fpu);
+        ctx->fpu = 0;
+    }
+}
+
+int kernel_fpu_begin() {
+    int ints = interrupts_get();
+    interrupts_disable();
+
+    // Registers hold live thread state - save it so the thread gets it back
+    // through the usual #NM path.
+    if(!(read_cr0() & CR0_TS)) {
+        struct thread *t = sched_current_thread();
+        if(t && t->ctx->fpu)
+            fpu_save(t->ctx->fpu);
+    }
+
+    clear_ts();
+    return ints;
+}
+
+void kernel_fpu_end(int state) {
+    set_ts();
+
+    if(state)
+        interrupts_enable();
+}
+
+int fpu_simd_available() {
+    // CPUs that haven't run fpu_cpuinit yet can't execute SSE instructions.
+    return has_sse2 && (read_cr4() & CR4_OSFXSR);
+}
+
+void fpu_cpuinit() {
+    unative_t cr0 = read_cr0();
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE;
+    __asm__ volatile("mov %0, %%cr0" :: "r" (cr0));
+
+    if(has_fxsr) {
+        unative_t cr4 = read_cr4();
+        cr4 |= CR4_OSFXSR;
+        if(has_sse)
+            cr4 |= CR4_OSXMMEXCPT;
+        __asm__ volatile("mov %0, %%cr4" :: "r" (cr4));
+    }
+
+    fpu_reset();
+
+    // First use by any thread traps.
+    set_ts();
+}
+
+void fpu_init() {
+    uint32_t a, b, c, d;
+    x86_cpuid(1, &a, &b, &c, &d);
+
+    has_fxsr = (d & CPUID_EDX_FXSR) ? 1 : 0;
+    has_sse = has_fxsr && (d & CPUID_EDX_SSE);
+    has_sse2 = has_sse && (d & CPUID_EDX_SSE2);
+
+    dprintf("fpu: fxsr=%d sse=%d sse2=%d\n", has_fxsr, has_sse, has_sse2);
+
+    interrupts_trap_reg(TRAP_DEVICE_NOT_AVAILABLE, fpu_trap);
+
+    fpu_cpuinit();
+}
@@ -9,6 +9,22 @@
  * always switch within the kernel. An IRET from an interrupt will
  * restore enough state to get back to a user context.
  */
+#ifdef X86_64
+typedef struct _x86_ctx {
+	uint64_t rbx, rbp, r12, r13, r14, r15;
+	uint64_t rsp, rip;
+    uint64_t rflags;
+
+    /// First argument, for threads that haven't run yet.
+    uint64_t rdi;
+
+    uint64_t stackbase;
+    uint64_t stackispool;
+
+    /// FPU/SSE state, allocated the first time the thread uses the FPU.
+    void *fpu;
+} __packed context_t;
+#else
 typedef struct _x86_ctx {
 	uint32_t edi, esi, ebx;
 	uint32_t ebp, esp, eip;
@@ -16,11 +32,25 @@ typedef struct _x86_ctx {
 
     uint32_t stackbase;
     uint32_t stackispool;
+
+    /// FPU/SSE state, allocated the first time the thread uses the FPU.
+    void *fpu;
 } __packed context_t;
+#endif
 
 #define __halt __asm__ __volatile__ ("hlt")
 #define __spin __asm__ __volatile__ ("pause")
 
+/// Raw CPU cycle count, for timing short stretches cheaply (not a clock).
+static inline uint64_t arch_cycles() {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return (((uint64_t) hi) << 32) | lo;
+}
+
+/// Enables interrupts and halts. An interrupt can't sneak in between the two.
+#define __idle_halt __asm__ __volatile__ ("sti; hlt")
+
 #define _CONTEXT_T_DEFINED
 
 #endif
@@ -19,11 +19,20 @@
 
 #include <types.h>
 
+#ifdef X86_64
+struct intr_stack {
+	uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+	uint64_t rdi, rsi, rbp, rbx, rdx, rcx, rax;
+	uint64_t intnum, ecode;
+	uint64_t rip, cs, rflags, rsp, ss;
+} __attribute__((packed));
+#else
 struct intr_stack {
 	uint32_t gs, fs, es, ds;
 	uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
 	uint32_t intnum, ecode;
 	uint32_t eip, cs, eflags, useresp, userss;
 } __attribute__((packed));
+#endif
 
 #endif
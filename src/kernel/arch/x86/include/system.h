@@ -19,6 +19,40 @@
 
 #include <types.h>
 
+#ifdef X86_64
+
+// KBoot loads 64-bit kernels to the first free 2 MB boundary.
+#define PHYS_ADDR		0x200000UL
+
+#define KERNEL_BASE		0xFFFFFFFF80000000UL
+
+/// Mapping for the Local APIC in the address space. Each CPU can access this
+/// address which maps to its Local APIC.
+#define KERNEL_LAPIC    0xFFFFFFFF7FFFF000UL
+
+// Each region gets its own 512 GB PML4 slot.
+#define HEAP_BASE		0xFFFFFC0000000000UL
+#define SLAB_BASE		0xFFFFFC8000000000UL // Heap ends here.
+#define SLAB_LENGTH		0x0000000100000000UL
+#define POOL_BASE       0xFFFFFD0000000000UL
+#define MMIO_BASE       0xFFFFFD8000000000UL
+#define STACK_TOP		0xFFFFFF0000000000UL // Page tables are mapped above here.
+#define STACK_SIZE		0x4000UL // 16 KB
+
+#define MMIO_LENGTH     0x0000008000000000UL
+
+#define PAGE_SIZE		0x1000UL
+
+/// Large page size, and its size as a pmem_alloc_contig order.
+#define LARGE_PAGE_SIZE		0x200000UL
+#define LARGE_PAGE_ORDER	9
+
+/// Mask to be applied against a paddr_t to get a full physical address (the
+/// architectural maximum of 52 bits).
+#define PADDR_MASK      0xFFFFFFFFFFFFFULL
+
+#else
+
 #define PHYS_ADDR		0x400000UL
 
 #define KERNEL_BASE		0xC0000000UL
@@ -28,17 +62,62 @@
 #define KERNEL_LAPIC    0xCFFFF000UL
 
 #define HEAP_BASE		0xD0000000UL
+#define SLAB_BASE		0xD8000000UL // Heap ends here.
+#define SLAB_LENGTH		0x08000000UL
 #define POOL_BASE       0xE0000000UL
 #define MMIO_BASE       0xF0000000UL
+#ifdef X86_PAE
+#define STACK_TOP		0xFF800000UL // Page tables are mapped above here.
+#else
 #define STACK_TOP		0xFFC00000UL
+#endif
 #define STACK_SIZE		0x4000UL // 16 KB
 
 #define MMIO_LENGTH     0xF0000000UL
 
 #define PAGE_SIZE		0x1000UL
 
+#ifdef X86_PAE
+/// PAE large page size, and its size as a pmem_alloc_contig order.
+#define LARGE_PAGE_SIZE		0x200000UL
+#define LARGE_PAGE_ORDER	9
+
+/// Mask to be applied against a paddr_t to get a full physical address. PAE
+/// entries hold more, but 36 bits is what every PAE CPU can address.
+#define PADDR_MASK      0xFFFFFFFFFULL
+#else
+/// PSE page size, and its size as a pmem_alloc_contig order.
+#define LARGE_PAGE_SIZE		0x400000UL
+#define LARGE_PAGE_ORDER	10
+
 /// Mask to be applied against a paddr_t to get a full physical address.
 #define PADDR_MASK      0xFFFFFFFFUL
+#endif
+
+#endif
+
+extern void x86_cpuid(uint32_t code, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d);
+extern void x86_get_msr(uint32_t msr, uint32_t *l, uint32_t *h);
+extern void x86_set_msr(uint32_t msr, uint32_t l, uint32_t h);
+
+/// CR4 and EFER bits any CPU needs set before it can use the kernel's page
+/// tables, eg when an AP starts up or the system wakes from sleep.
+extern void x86_paging_state(uint32_t *cr4, uint32_t *efer);
+
+/// Double faults run on a stack of their own, so that running into a stack's
+/// guard page can still be reported: through this IST slot on 64-bit CPUs,
+/// and on 32-bit ones by switching to the task with this TSS selector.
+#define X86_DF_IST		1
+#define X86_DF_TSS_SEL	0x28
+
+/// Reports a double fault at the given instruction and stack pointers and
+/// panics.
+extern void x86_double_fault(uintptr_t ip, uintptr_t sp);
+
+#ifdef X86_PAE
+/// Rebuilds the boot page tables in PAE form and switches to them.
+extern void x86_pae_init();
+#endif
 
 #define log2phys(x)		(((x) - KERNEL_BASE) + PHYS_ADDR)
 #define phys2log(x)		(((x) - PHYS_ADDR) + KERNEL_BASE)
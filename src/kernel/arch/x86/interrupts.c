@@ -21,11 +21,20 @@
 #include <io.h>
 #include <powerman.h>
 #include <multicpu.h>
+#include <fpu.h>
+#include <vmregion.h>
+#include <system.h>
+#include <panic.h>
 
 extern int interrupt_handlers;
 
+#ifdef X86_64
+// Stubs are aligned to 16 bytes.
+#define INTERRUPT_STUB_LENGTH		16UL
+#else
 // 10 bytes: cli, pushl/nop nop, pushl, jmp (no 8-bit displacement)
 #define INTERRUPT_STUB_LENGTH		10UL
+#endif
 
 static inthandler_t interrupts[256];
 
@@ -35,11 +44,15 @@ static struct idt_entry {
 	uint8_t always0;
 	uint8_t flags;
 	uint16_t base_high;
+#ifdef X86_64
+	uint32_t base_upper;
+	uint32_t reserved;
+#endif
 } __packed __aligned(4) idt[256];
 
 static struct idt_ptr {
 	uint16_t limit;
-	uint32_t base;
+	uintptr_t base;
 } __packed __aligned(4) idtr;
 
 const char* trapnames[] =
@@ -78,33 +91,88 @@ const char* trapnames[] =
 	"Reserved: Interrupt 31"
 };
 
+/// Dumps the machine state for a trap nothing could handle, and halts.
+static void trap_halt(struct intr_stack *stack) {
+	uint32_t n = (uint32_t) stack->intnum;
+
+	kprintf("CPU trap #%d: %s [code %x, cpu %d]\n", n, trapnames[n], (uint32_t) stack->ecode, multicpu_id());
+#ifdef X86_64
+	uint64_t crn = 0;
+	kprintf("RAX: 0x%16lx RBX: 0x%16lx RCX: 0x%16lx\n", stack->rax, stack->rbx, stack->rcx);
+	kprintf("RDX: 0x%16lx RSI: 0x%16lx RDI: 0x%16lx\n", stack->rdx, stack->rsi, stack->rdi);
+	kprintf("R8:  0x%16lx R9:  0x%16lx R10: 0x%16lx\n", stack->r8, stack->r9, stack->r10);
+	kprintf("R11: 0x%16lx R12: 0x%16lx R13: 0x%16lx\n", stack->r11, stack->r12, stack->r13);
+	kprintf("R14: 0x%16lx R15: 0x%16lx RBP: 0x%16lx\n", stack->r14, stack->r15, stack->rbp);
+	kprintf("RSP: 0x%16lx RIP: 0x%16lx RFLAGS: 0x%8lx\n", stack->rsp, stack->rip, stack->rflags);
+	__asm__ volatile("mov %%cr0, %0" : "=r" (crn));
+	kprintf("CR0: 0x%8lx ", crn);
+	__asm__ volatile("mov %%cr2, %0" : "=r" (crn));
+	kprintf("CR2: 0x%16lx ", crn);
+	__asm__ volatile("mov %%cr3, %0" : "=r" (crn));
+	kprintf("CR3: 0x%8lx ", crn);
+	__asm__ volatile("mov %%cr4, %0" : "=r" (crn));
+	kprintf("CR4: 0x%8lx\n", crn);
+#else
+	uint32_t crn = 0;
+	kprintf("EAX: 0x%8x EBX: 0x%8x ECX: 0x%8x EDX: 0x%8x\n", stack->eax, stack->ebx, stack->ecx, stack->edx);
+	kprintf("ESI: 0x%8x EDI: 0x%8x ESP: 0x%8x EBP: 0x%8x\n", stack->esi, stack->edi, stack->esp, stack->ebp);
+	kprintf("EIP: 0x%8x EFLAGS: 0x%8x\n", stack->eip, stack->eflags);
+	__asm__ volatile("mov %%cr0, %0" : "=r" (crn));
+	kprintf("CR0: 0x%8x ", crn);
+	__asm__ volatile("mov %%cr2, %0" : "=r" (crn));
+	kprintf("CR2: 0x%8x ", crn);
+	__asm__ volatile("mov %%cr3, %0" : "=r" (crn));
+	kprintf("CR3: 0x%8x ", crn);
+	__asm__ volatile("mov %%cr4, %0" : "=r" (crn));
+	kprintf("CR4: 0x%8x\n", crn);
+#endif
+
+	kprintf("<system halting>\n");
+	while(1) __asm__ volatile("hlt");
+}
+
+/// Commits reserved pages on first touch. Anything else is fatal.
+static int page_fault(struct intr_stack *stack, void *p __unused) {
+	unative_t cr2;
+	__asm__ volatile("mov %%cr2, %0" : "=r" (cr2));
+
+	// Bit 0 of the error code is set for protection violations, and bit 2
+	// for faults in user mode. Reserved regions are the kernel's, so user
+	// code touching one mustn't commit it.
+	if(!(stack->ecode & 5) && (vmregion_fault((vaddr_t) cr2) == 0))
+		return 0;
+
+	trap_halt(stack);
+	return 0;
+}
+
+void x86_double_fault(uintptr_t ip, uintptr_t sp) {
+	unative_t cr2;
+	__asm__ volatile("mov %%cr2, %0" : "=r" (cr2));
+
+	// A page fault that couldn't be delivered (eg, off the end of a stack
+	// into its guard page) leaves its address in CR2.
+	kprintf("double fault at %p, stack %p, cr2 %p\n", (void *) ip, (void *) sp, (void *) cr2);
+	panic("double fault");
+}
+
+#ifdef X86_64
+static int double_fault(struct intr_stack *stack, void *p __unused) {
+	x86_double_fault(stack->rip, stack->rsp);
+	return 0;
+}
+#endif
+
 int cpu_trap(struct intr_stack *stack) {
 	int ret = 0;
 
-	uint32_t n = stack->intnum;
+	uint32_t n = (uint32_t) stack->intnum;
 	if(interrupts[n] != 0) {
 		ret = interrupts[n](stack, 0);
+	} else if(n < 32) {
+		trap_halt(stack);
 	} else {
-		kprintf("CPU trap #%d", n);
-		if(n < 32) {
-			uint32_t crn = 0;
-			kprintf(": %s [code %x, cpu %d]\n", trapnames[n], stack->ecode, multicpu_id());
-			kprintf("EAX: 0x%8x EBX: 0x%8x ECX: 0x%8x EDX: 0x%8x\n", stack->eax, stack->ebx, stack->ecx, stack->edx);
-			kprintf("ESI: 0x%8x EDI: 0x%8x ESP: 0x%8x EBP: 0x%8x\n", stack->esi, stack->edi, stack->esp, stack->ebp);
-			kprintf("EIP: 0x%8x EFLAGS: 0x%8x\n", stack->eip, stack->eflags);
-			__asm__ volatile("mov %%cr0, %0" : "=r" (crn));
-			kprintf("CR0: 0x%8x ", crn);
-			__asm__ volatile("mov %%cr2, %0" : "=r" (crn));
-			kprintf("CR2: 0x%8x ", crn);
-			__asm__ volatile("mov %%cr3, %0" : "=r" (crn));
-			kprintf("CR3: 0x%8x ", crn);
-			__asm__ volatile("mov %%cr4, %0" : "=r" (crn));
-			kprintf("CR4: 0x%8x\n", crn);
-
-			kprintf("<system halting>\n");
-			while(1) __asm__ volatile("hlt");
-		} else
-			kprintf(" (unhandled)\n");
+		kprintf("CPU trap #%d (unhandled)\n", n);
 	}
 
 	return ret;
@@ -116,6 +184,10 @@ static void set_idt(size_t n, uintptr_t base, uint16_t sel, uint8_t flags) {
 
 	idt[n].base_low = (uint16_t) base & 0xFFFF;
 	idt[n].base_high = (uint16_t) (base >> 16) & 0xFFFF;
+#ifdef X86_64
+	idt[n].base_upper = (uint32_t) (base >> 32);
+	idt[n].reserved = 0;
+#endif
 
 	idt[n].selector = sel;
 	idt[n].always0 = 0;
@@ -126,17 +198,32 @@ void arch_interrupts_init() {
 	size_t i = 0;
 	uintptr_t int_stub_base = (uintptr_t) &interrupt_handlers;
 	memset(interrupts, 0, sizeof interrupts);
+	interrupts[14] = page_fault;
 
 	for(i = 0; i < 256; i++) {
 		set_idt(i, int_stub_base + (i * INTERRUPT_STUB_LENGTH), 0x08, 0x8E);
 	}
 
+	// Double faults switch to a stack of their own.
+#ifdef X86_64
+	interrupts[8] = double_fault;
+	idt[8].always0 = X86_DF_IST;
+#else
+	set_idt(8, 0, X86_DF_TSS_SEL, 0x85);
+	idt[8].flags = 0x85; // Task gate, not reachable with int from user mode.
+#endif
+
 	idtr.limit = (sizeof(struct idt_entry) * 256) - 1;
 	idtr.base = (uintptr_t) idt;
 
 	__barrier;
 
 	__asm__ volatile("lidt %0" :: "m" (idtr));
+
+	// Reserved memory can be committed on demand from here on.
+	vmregion_enable();
+
+	fpu_init();
 }
 
 void arch_interrupts_enable() {
@@ -160,6 +247,8 @@ void arch_interrupts_reg(int n, inthandler_t handler) {
 void ints_multicpu_init() {
 	// Install the IDT on the CPU.
 	__asm__ volatile("lidt %0" :: "m" (idtr));
+
+	fpu_cpuinit();
 }
 
 int ints_powerstate_change(int new_state) {
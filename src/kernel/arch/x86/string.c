@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <types.h>
+#include <system.h>
+#include <util.h>
+#include <fpu.h>
+
+/// Block size for the SSE2 loops.
+#define SSE_BLOCK           64
+
+/// Below this, saving the FPU state costs more than SSE2 saves.
+#define SSE_MIN             512
+
+/// Interrupts are off while the SSE2 registers are borrowed, so big buffers
+/// are done in chunks of at most this many bytes.
+#define SSE_CHUNK           (16 * 1024)
+
+/// Copies of at least this size bypass the cache; they would only evict
+/// everything else to hold data that is unlikely to be read again soon.
+#define STREAM_COPY_MIN     (64 * 1024)
+
+static void rep_movsb(unsigned char **d, const unsigned char **s, size_t n) {
+    __asm__ volatile("rep movsb" : "+D" (*d), "+S" (*s), "+c" (n) :: "memory");
+}
+
+static void rep_stosb(unsigned char **d, uint8_t c, size_t n) {
+    __asm__ volatile("rep stosb" : "+D" (*d), "+c" (n) : "a" (c) : "memory");
+}
+
+/// Copies with an aligned rep movsl, using byte moves for the ragged ends.
+static void rep_copy(unsigned char *d, const unsigned char *s, size_t len) {
+    size_t head = (-(uintptr_t) d) & 3;
+    if(head > len)
+        head = len;
+
+    rep_movsb(&d, &s, head);
+    len -= head;
+
+    size_t dwords = len >> 2;
+    __asm__ volatile("rep movsl" : "+D" (d), "+S" (s), "+c" (dwords) :: "memory");
+
+    rep_movsb(&d, &s, len & 3);
+}
+
+/// Fills with an aligned rep stosl, using byte stores for the ragged ends.
+static void rep_fill(unsigned char *d, uint8_t c, size_t len) {
+    size_t head = (-(uintptr_t) d) & 3;
+    if(head > len)
+        head = len;
+
+    rep_stosb(&d, c, head);
+    len -= head;
+
+    size_t dwords = len >> 2;
+    uint32_t pattern = c * 0x01010101U;
+    __asm__ volatile("rep stosl" : "+D" (d), "+c" (dwords) : "a" (pattern) : "memory");
+
+    rep_stosb(&d, c, len & 3);
+}
+
+#ifdef KERNEL_SSE
+
+/*
+ * The kernel is built with -mno-sse, so the compiler never allocates vector
+ * registers itself and they hold their values between the asm statements.
+ */
+
+/// Copies whole blocks to a 16-byte aligned destination. The source may be
+/// unaligned. Call between kernel_fpu_begin and kernel_fpu_end.
+static void sse2_copy(unsigned char *d, const unsigned char *s, size_t blocks, int stream) {
+    for(; blocks; blocks--, d += SSE_BLOCK, s += SSE_BLOCK) {
+        __asm__ volatile("movdqu (%1), %%xmm0\n"
+                         "movdqu 16(%1), %%xmm1\n"
+                         "movdqu 32(%1), %%xmm2\n"
+                         "movdqu 48(%1), %%xmm3\n"
+                         :: "r" (d), "r" (s) : "memory");
+        if(stream)
+            __asm__ volatile("movntdq %%xmm0, (%0)\n"
+                             "movntdq %%xmm1, 16(%0)\n"
+                             "movntdq %%xmm2, 32(%0)\n"
+                             "movntdq %%xmm3, 48(%0)\n"
+                             :: "r" (d) : "memory");
+        else
+            __asm__ volatile("movdqa %%xmm0, (%0)\n"
+                             "movdqa %%xmm1, 16(%0)\n"
+                             "movdqa %%xmm2, 32(%0)\n"
+                             "movdqa %%xmm3, 48(%0)\n"
+                             :: "r" (d) : "memory");
+    }
+
+    // Non-temporal stores are weakly ordered.
+    if(stream)
+        __asm__ volatile("sfence" ::: "memory");
+}
+
+/// Fills whole blocks at a 16-byte aligned destination. Call between
+/// kernel_fpu_begin and kernel_fpu_end.
+static void sse2_fill(unsigned char *d, uint8_t c, size_t blocks, int stream) {
+    uint32_t pattern = c * 0x01010101U;
+    __asm__ volatile("movd %0, %%xmm0\n"
+                     "pshufd $0, %%xmm0, %%xmm0\n"
+                     :: "r" (pattern));
+
+    for(; blocks; blocks--, d += SSE_BLOCK) {
+        if(stream)
+            __asm__ volatile("movntdq %%xmm0, (%0)\n"
+                             "movntdq %%xmm0, 16(%0)\n"
+                             "movntdq %%xmm0, 32(%0)\n"
+                             "movntdq %%xmm0, 48(%0)\n"
+                             :: "r" (d) : "memory");
+        else
+            __asm__ volatile("movdqa %%xmm0, (%0)\n"
+                             "movdqa %%xmm0, 16(%0)\n"
+                             "movdqa %%xmm0, 32(%0)\n"
+                             "movdqa %%xmm0, 48(%0)\n"
+                             :: "r" (d) : "memory");
+    }
+
+    if(stream)
+        __asm__ volatile("sfence" ::: "memory");
+}
+
+#endif
+
+void *arch_memcpy(void *dest, const void *src, size_t len) {
+    unsigned char *d = (unsigned char *) dest;
+    const unsigned char *s = (const unsigned char *) src;
+
+#ifdef KERNEL_SSE
+    if(len >= SSE_MIN && fpu_simd_available()) {
+        size_t head = (-(uintptr_t) d) & 15;
+        rep_movsb(&d, &s, head);
+        len -= head;
+
+        int stream = len >= STREAM_COPY_MIN;
+        while(len >= SSE_BLOCK) {
+            size_t chunk = len & ~((size_t) SSE_BLOCK - 1);
+            if(chunk > SSE_CHUNK)
+                chunk = SSE_CHUNK;
+
+            int state = kernel_fpu_begin();
+            sse2_copy(d, s, chunk / SSE_BLOCK, stream);
+            kernel_fpu_end(state);
+
+            d += chunk;
+            s += chunk;
+            len -= chunk;
+        }
+    }
+#endif
+
+    rep_copy(d, s, len);
+    return dest;
+}
+
+/// Fills are only streamed when the caller says so: a buffer being filled is
+/// usually about to be used.
+static void *fill(void *dest, int c, size_t len, int stream __unused) {
+    unsigned char *d = (unsigned char *) dest;
+
+#ifdef KERNEL_SSE
+    if(len >= SSE_MIN && fpu_simd_available()) {
+        size_t head = (-(uintptr_t) d) & 15;
+        rep_stosb(&d, (uint8_t) c, head);
+        len -= head;
+
+        while(len >= SSE_BLOCK) {
+            size_t chunk = len & ~((size_t) SSE_BLOCK - 1);
+            if(chunk > SSE_CHUNK)
+                chunk = SSE_CHUNK;
+
+            int state = kernel_fpu_begin();
+            sse2_fill(d, (uint8_t) c, chunk / SSE_BLOCK, stream);
+            kernel_fpu_end(state);
+
+            d += chunk;
+            len -= chunk;
+        }
+    }
+#endif
+
+    rep_fill(d, (uint8_t) c, len);
+    return dest;
+}
+
+void *arch_memset(void *dest, int c, size_t len) {
+    return fill(dest, c, len, 0);
+}
+
+void *arch_memset_stream(void *dest, int c, size_t len) {
+    return fill(dest, c, len, 1);
+}
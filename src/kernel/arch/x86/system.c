@@ -2,7 +2,7 @@
 #include <types.h>
 #include <system.h>
 
-void x86_cpuid(int code, uint32_t *a, uint32_t *b, uint32_t * c, uint32_t *d) {
+void x86_cpuid(uint32_t code, uint32_t *a, uint32_t *b, uint32_t * c, uint32_t *d) {
     __asm__ volatile("cpuid" : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d) : "a" (code));
 }
 
@@ -22,6 +22,12 @@
 #include <util.h>
 #include <io.h>
 #include <powerman.h>
+#include <multicpu.h>
+#include <interrupts.h>
+#include <spinlock.h>
+#include <mmiopool.h>
+#include <assert.h>
+#include <malloc.h>
 
 // #define VMEM_VERBOSE
 
@@ -38,7 +44,21 @@ struct gdt_entry {
 	uint8_t		gran;
 	uint8_t		base_high;
 } __packed __aligned(4);
-static struct gdt_entry gdt[16];
+
+#define DF_STACK_SIZE		0x1000
+
+/// Each CPU's TSS descriptor follows the fixed segments. 64-bit descriptors
+/// take two entries; 32-bit kernels also have the double fault task's at 5.
+#ifdef X86_64
+#define GDT_TSS_FIRST		6
+#define GDT_ENTRIES			(GDT_TSS_FIRST + (MULTICPU_MAX_CPUS * 2))
+#else
+#define GDT_DF_TSS			(X86_DF_TSS_SEL / 8)
+#define GDT_TSS_FIRST		6
+#define GDT_ENTRIES			(GDT_TSS_FIRST + MULTICPU_MAX_CPUS)
+#endif
+
+static struct gdt_entry gdt[GDT_ENTRIES];
 
 struct gdt_ptr {
 	uint16_t	limit;
@@ -46,46 +66,598 @@ struct gdt_ptr {
 } __packed __aligned(4);
 static struct gdt_ptr gdtr;
 
+#ifdef X86_64
+struct tss {
+	uint32_t	reserved0;
+	uint64_t	rsp[3];
+	uint64_t	reserved1;
+	uint64_t	ist[7];
+	uint64_t	reserved2;
+	uint16_t	reserved3;
+	uint16_t	iomap_base;
+} __packed;
+
+static char df_stacks[MULTICPU_MAX_CPUS][DF_STACK_SIZE] __aligned(16);
+#else
+struct tss {
+	uint32_t	prev;
+	uint32_t	esp0, ss0, esp1, ss1, esp2, ss2;
+	uint32_t	cr3, eip, eflags;
+	uint32_t	eax, ecx, edx, ebx, esp, ebp, esi, edi;
+	uint32_t	es, cs, ss, ds, fs, gs;
+	uint32_t	ldt;
+	uint16_t	trap;
+	uint16_t	iomap_base;
+} __packed;
+
+/// There is one double fault task, as a task that is already running can't
+/// be switched to. A second CPU to double fault meanwhile resets the system.
+static struct tss df_tss;
+static char df_stack[DF_STACK_SIZE] __aligned(16);
+#endif
+
+static struct tss tss[MULTICPU_MAX_CPUS];
+static volatile size_t ntss = 0;
+
 #define FLAGS_PRESENT		0x01
 #define FLAGS_WRITEABLE		0x02
 #define FLAGS_USER			0x04
+#define FLAGS_LARGE			0x80
 #define FLAGS_GLOBAL		0x100
 
+#if defined(X86_PAE) || defined(X86_64)
+#define FLAGS_NX			(1ULL << 63)
+#else
+#define FLAGS_NX			0
+#endif
+
+/// Software bit: unmapped by vmem_unmap_range, frame to be released once
+/// every CPU has dropped the old translation.
+#define FLAGS_RELEASE		0x200
+
+#define CR4_PSE				(1UL << 4)
+#define CR4_PAE				(1UL << 5)
+#define CR4_PGE				(1UL << 7)
+#define CR4_PCIDE			(1UL << 17)
+
+/// Loading CR3 with this set keeps the new PCID's TLB entries.
+#define CR3_NOFLUSH			(1UL << 63)
+#define PCID_COUNT			4096
+
+#define MSR_EFER			0xC0000080
+#define MSR_STAR			0xC0000081
+#define EFER_LME			(1UL << 8)
+#define EFER_NXE			(1UL << 11)
+
+/// Shootdowns covering more pages than this flush the whole TLB instead.
+#define TLB_FLUSH_ALL_PAGES	32
+
+/// Ranges a CPU's shootdown queue holds before it falls back to a full flush.
+#define TLB_QUEUE_RANGES	8
+
+#if defined(X86_64)
+typedef uint64_t pte_t;
+
+/// PML4 slot 510 points at the PML4 itself, so the page tables show up at
+/// 0xFFFFFF0000000000, followed by the page directories, PDPTs, and the PML4.
+#define PDIR_BASE			0xFFFFFF0000000000UL
+#define PDIR_VIRT			0xFFFFFF7F80000000UL
+#define PDPT_VIRT			0xFFFFFF7FBFC00000UL
+#define PML4_VIRT			0xFFFFFF7FBFDFE000UL
+#define PML4_OFFSET(a)		(((a) >> 39) & 0x1FFUL)
+#define PDPT_OFFSET(a)		(((a) >> 30) & 0x3FFFFUL)
+#define PDIR_OFFSET(a)		(((a) >> 21) & 0x7FFFFFFUL)
+#define PTAB_OFFSET(a)		(((a) >> 12) & 0x1FFUL)
+#define PTAB_ENTRIES		512
+#define FRAME_MASK			((pte_t) PADDR_MASK & ~0xFFFULL)
+#elif defined(X86_PAE)
+typedef uint64_t pte_t;
+
+/// The four page directories are mapped into the last one, so every page
+/// table shows up in the top 8 MB and the directories, back to back, in its
+/// last 16 KB.
+#define PDIR_VIRT			0xFFFFC000
+#define PDIR_BASE			0xFF800000
+#define PDIR_OFFSET(a)		(((a) >> 21) & 0x7FFUL)
+#define PTAB_OFFSET(a)		(((a) >> 12) & 0x1FFUL)
+#define PTAB_ENTRIES		512
+#define FRAME_MASK			((pte_t) PADDR_MASK & ~0xFFFULL)
+#else
+typedef uint32_t pte_t;
+
 #define PDIR_VIRT			0xFFFFF000
 #define PDIR_BASE			0xFFC00000
 #define PDIR_OFFSET(a)		(((a) >> 22) & 0x3FFUL)
 #define PTAB_OFFSET(a)		(((a) >> 12) & 0x3FFUL)
+#define PTAB_ENTRIES		1024
+#define FRAME_MASK			((pte_t) ~0xFFFUL)
+#endif
+
+/// Addresses from here up belong to the kernel, and are the same in every
+/// address space.
+#ifdef X86_64
+#define KERNEL_SPLIT		0xFFFF800000000000UL
+#else
+#define KERNEL_SPLIT		KERNEL_BASE
+#endif
+
+/// Each address space has TOP_PAGES top-level tables, back to back. The last
+/// holds the kernel half's entries from SHARED_FIRST on (copied into every
+/// address space), and the recursive entries mapping the top-level tables.
+#if defined(X86_64)
+#define TOP_PAGES			1
+#define TOP_ORDER			0
+#define SHARED_TABLE		PML4_VIRT
+#define SHARED_FIRST		PML4_OFFSET(KERNEL_SPLIT)
+#define RECURSIVE_SLOT		510
+#elif defined(X86_PAE)
+#define TOP_PAGES			4
+#define TOP_ORDER			2
+#define SHARED_TABLE		(PDIR_VIRT + (3 * PAGE_SIZE))
+#define SHARED_FIRST		0
+#define RECURSIVE_SLOT		(PTAB_ENTRIES - 4)
+#else
+#define TOP_PAGES			1
+#define TOP_ORDER			0
+#define SHARED_TABLE		PDIR_VIRT
+#define SHARED_FIRST		PDIR_OFFSET(KERNEL_SPLIT)
+#define RECURSIVE_SLOT		(PTAB_ENTRIES - 1)
+#endif
+
+#ifdef X86_64
+#define REG_SP				"%%rsp"
+#define REG_BP				"%%rbp"
+#else
+#define REG_SP				"%%esp"
+#define REG_BP				"%%ebp"
+#endif
+
 #define PTAB_FROM_VADDR(a)	(PDIR_BASE + (PDIR_OFFSET(a) << 12))
 
-// From start-x86.s
+/// start-x86.s (and start-x64.s) maps this much of the kernel image, and identity-maps as much
+/// low memory.
+#define BOOT_MAP_SIZE		0x400000UL
+
+#define LARGE_PAGE_PAGES	(LARGE_PAGE_SIZE / PAGE_SIZE)
+#define LARGE_FRAME_MASK	(FRAME_MASK & ~((pte_t) LARGE_PAGE_SIZE - 1))
+
+// From start-x86.s or start-x64.s
 extern int init, init_end;
 extern int tmpstack_base;
 
 static paddr_t g_primedpage = 0;
 
+/// FLAGS_NX once EFER.NXE is on, applied to mappings without VMEM_EXEC.
+static pte_t nx_flags = 0;
+
+struct tlb_range {
+	vaddr_t base;
+	size_t pages;
+};
+
+/// Invalidations other CPUs have queued for one CPU. Senders queue a range
+/// and take a ticket from `requested`; the CPU handles everything queued up
+/// to a snapshot of `requested`, then publishes it in `completed`.
+struct tlb_queue {
+	uint32_t cpu;
+	int online;
+
+	struct tlb_range ranges[TLB_QUEUE_RANGES];
+	size_t count;
+	int flush_all;
+
+	volatile uint32_t requested;
+	volatile uint32_t completed;
+
+	/// Set while the CPU is serving the queue. Lock spinners poll it, and
+	/// that includes the spin on `lock` below.
+	int serving;
+
+	/// Address space the CPU is in.
+	struct vmem_space *space;
+
+	spinlock_t lock;
+	char lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+};
+
+static struct tlb_queue tlb_queues[MULTICPU_MAX_CPUS];
+static volatile size_t ntlb_queues = 0;
+
+/// Shootdowns waiting on other CPUs, so spinners can skip their queue check.
+static volatile size_t tlb_inflight = 0;
+
+/// An address space. The top-level table holding the kernel half stays mapped
+/// so changes to the kernel half can be copied into it.
+struct vmem_space {
+	/// What gets loaded into CR3 (less the PCID).
+	paddr_t root;
+
+	pte_t *shared;
+
+	/// PCID, or zero if switching to this address space flushes the TLB.
+	uint32_t pcid;
+
+	/// CPUs (by TLB queue) that may still hold stale translations tagged with
+	/// this PCID, and so must flush them when they next switch to it.
+	volatile uint32_t stale;
+
+	struct vmem_space *next;
+};
+
+/// The address space set up at boot, which kernel threads run in.
+static struct vmem_space kernel_space;
+
+/// Every other address space.
+static struct vmem_space *spaces = 0;
+static spinlock_t space_lock = 0;
+static char space_lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+
+static int pcid_enabled = 0;
+static uint32_t next_pcid = 1;
+
+/// PCIDs given back by destroyed address spaces. Guarded by space_lock.
+static uint16_t free_pcids[PCID_COUNT];
+static size_t nfree_pcids = 0;
+
+#ifdef X86_PAE
+/// PDPTs for new address spaces. CR3 only holds a 32-bit address with PAE, so
+/// these come from the kernel image rather than the physical allocator. Slots
+/// from destroyed address spaces are reused first.
+#define PAE_MAX_SPACES		256
+static pte_t pae_space_pdpts[PAE_MAX_SPACES][4] __aligned(32);
+static size_t pae_nspaces = 0;
+static uint16_t pae_free_slots[PAE_MAX_SPACES];
+static size_t pae_nfree = 0;
+#endif
+
+/// Levels of paging structures below a user entry of the top-level tables.
+#ifdef X86_64
+#define USER_TABLE_LEVELS	3
+#else
+#define USER_TABLE_LEVELS	1
+#endif
+
+/// Where demote() builds page tables before installing them.
+static vaddr_t demote_window = 0;
+static spinlock_t demote_lock = 0;
+static char demote_lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+
 void invlpg(char *p) {
 	__asm__ volatile("invlpg %0" : : "m" (*p));
 }
 
 /// Translate input flags to x86 MMU flags.
-size_t flags_to_x86(size_t f) {
-	size_t flags = FLAGS_PRESENT;
+pte_t flags_to_x86(size_t f) {
+	pte_t flags = FLAGS_PRESENT;
 	if(f & VMEM_READWRITE)
 		flags |= FLAGS_WRITEABLE;
 	if(f & VMEM_USERMODE)
 		flags |= FLAGS_USER;
 	if(f & VMEM_GLOBAL)
 		flags |= FLAGS_GLOBAL;
+	if(!(f & VMEM_EXEC))
+		flags |= nx_flags;
 	return flags;
 }
 
+/// Kernel mappings are global, so switching address spaces keeps them.
+static pte_t kernel_global(vaddr_t v) {
+	return (v >= KERNEL_SPLIT) ? FLAGS_GLOBAL : 0;
+}
+
 void arch_vmem_prime(paddr_t p) {
     dprintf("vmem_prime: primed with %x\n", p);
     g_primedpage = p;
 }
 
-int arch_vmem_map(vaddr_t v, paddr_t p, size_t f) {
-	uint32_t flags = flags_to_x86(f);
+/// Reloads CR3, which invalidates every TLB entry but global ones.
+static void reload_cr3() {
+	unative_t cr3;
+	__asm__ volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r" (cr3) :: "memory");
+}
+
+/// Invalidates this CPU's whole TLB, including global entries.
+static void tlb_flush_all() {
+	unative_t cr4;
+	__asm__ volatile("mov %%cr4, %0" : "=r" (cr4));
+	if(cr4 & CR4_PGE) {
+		__asm__ volatile("mov %0, %%cr4" :: "r" (cr4 & ~CR4_PGE) : "memory");
+		__asm__ volatile("mov %0, %%cr4" :: "r" (cr4) : "memory");
+	} else {
+		reload_cr3();
+	}
+}
+
+/// Invalidates a range of pages on this CPU only.
+static void tlb_invalidate(vaddr_t v, size_t pages) {
+	if(pages > TLB_FLUSH_ALL_PAGES) {
+		tlb_flush_all();
+		return;
+	}
+
+	for(; pages; pages--, v += PAGE_SIZE)
+		invlpg((char *) v);
+}
+
+static struct tlb_queue *get_tlb_queue() {
+	struct tlb_queue **p = (struct tlb_queue **) multicpu_percpu_at(MULTICPU_PERCPU_TLB);
+	return p ? *p : 0;
+}
+
+/// Registers the current CPU for shootdowns. Needs per-CPU data.
+static void tlb_register() {
+	struct tlb_queue **p = (struct tlb_queue **) multicpu_percpu_at(MULTICPU_PERCPU_TLB);
+	if(!p || *p)
+		return;
+
+	size_t idx = multicpu_slot_claim(&ntlb_queues, MULTICPU_MAX_CPUS);
+	if(idx >= MULTICPU_MAX_CPUS) {
+		dprintf("vmem: too many CPUs for TLB shootdown\n");
+		return;
+	}
+
+	struct tlb_queue *q = &tlb_queues[idx];
+	q->cpu = multicpu_id();
+	q->space = &kernel_space;
+	q->lock = create_spinlock_at(q->lock_region, sizeof(q->lock_region));
+	*p = q;
+
+	__barrier;
+	q->online = 1;
+}
+
+void arch_vmem_shootdown_recv() {
+	struct tlb_queue *q = get_tlb_queue();
+	struct tlb_range ranges[TLB_QUEUE_RANGES];
+
+	// Make the common case cheap. A request missed here comes with an IPI or
+	// is seen on the next poll.
+	if(!q || q->serving || (q->completed == q->requested))
+		return;
+
+	// With interrupts on, the IPI could land between taking a snapshot and
+	// publishing it, and return early without serving what it came for.
+	int wasints = interrupts_get();
+	interrupts_disable();
+	q->serving = 1;
+
+	spinlock_acquire(q->lock);
+	uint32_t ticket = q->requested;
+	size_t i, count = q->count;
+	int all = q->flush_all;
+	for(i = 0; i < count; i++)
+		ranges[i] = q->ranges[i];
+	q->count = 0;
+	q->flush_all = 0;
+	spinlock_release(q->lock);
+
+	if(all) {
+		tlb_flush_all();
+	} else {
+		for(i = 0; i < count; i++)
+			tlb_invalidate(ranges[i].base, ranges[i].pages);
+	}
+
+	__barrier;
+	q->completed = ticket;
+
+	q->serving = 0;
+	if(wasints)
+		interrupts_enable();
+}
+
+/**
+ * Invalidates a range on every CPU, returning once they have all done so.
+ * Each other CPU gets the range on its queue and at most one IPI per batch:
+ * a CPU whose queue is already non-empty has an IPI on the way.
+ */
+static void tlb_shootdown(vaddr_t v, size_t pages) {
+	uint32_t tickets[MULTICPU_MAX_CPUS];
+	size_t i, n = ntlb_queues;
+
+	tlb_invalidate(v, pages);
+	if(n < 2)
+		return;
+
+	struct tlb_queue *self = get_tlb_queue();
+
+	// Other CPUs invalidate in whatever address space they are in, which only
+	// reaches translations for this one if it's the one they are in. The rest
+	// must flush its PCID when they next switch to it.
+	if(pcid_enabled && (v < KERNEL_SPLIT) && self && self->space->pcid)
+		__sync_fetch_and_or(&self->space->stale, ~(1U << (self - tlb_queues)));
+
+	__sync_fetch_and_add(&tlb_inflight, 1);
+	for(i = 0; i < n; i++) {
+		struct tlb_queue *q = &tlb_queues[i];
+		if((q == self) || !q->online)
+			continue;
+
+		spinlock_acquire(q->lock);
+		int idle = !q->count && !q->flush_all;
+		if((pages > TLB_FLUSH_ALL_PAGES) || (q->count == TLB_QUEUE_RANGES)) {
+			q->flush_all = 1;
+		} else {
+			q->ranges[q->count].base = v;
+			q->ranges[q->count].pages = pages;
+			q->count++;
+		}
+		tickets[i] = ++q->requested;
+		spinlock_release(q->lock);
+
+		if(idle)
+			multicpu_tlb_flush(q->cpu);
+	}
+
+	for(i = 0; i < n; i++) {
+		struct tlb_queue *q = &tlb_queues[i];
+		if((q == self) || !q->online)
+			continue;
+
+		// Keep serving our own queue, or two CPUs shooting down at each
+		// other with interrupts disabled would wait forever.
+		while((int32_t) (q->completed - tickets[i]) < 0) {
+			arch_vmem_shootdown_recv();
+			__asm__ volatile("pause");
+		}
+	}
+
+	__sync_fetch_and_sub(&tlb_inflight, 1);
+}
+
+/// A CPU spinning with interrupts disabled can't take the shootdown IPI, and
+/// the CPU waiting on it may be the one it is waiting for, so serve it here.
+/// Only looks at this CPU's queue while some shootdown is outstanding.
+void arch_spin_poll() {
+	if(tlb_inflight)
+		arch_vmem_shootdown_recv();
+}
+
+/// Writes a paging structure entry. Entries for the kernel half of the
+/// top-level table are written into every address space.
+static void set_entry(pte_t *entry, pte_t value) {
+	uintptr_t off = (uintptr_t) entry - (SHARED_TABLE + (SHARED_FIRST * sizeof(pte_t)));
+
+	*entry = value;
+
+	if((off >= ((PTAB_ENTRIES - SHARED_FIRST) * sizeof(pte_t))) || !space_lock)
+		return;
+
+	size_t i = SHARED_FIRST + (off / sizeof(pte_t));
+	if((i >= RECURSIVE_SLOT) && (i < (RECURSIVE_SLOT + TOP_PAGES)))
+		return;
+
+	spinlock_acquire(space_lock);
+	kernel_space.shared[i] = value;
+
+	struct vmem_space *sp;
+	for(sp = spaces; sp; sp = sp->next)
+		sp->shared[i] = value;
+	spinlock_release(space_lock);
+}
+
+/// Points a paging structure entry at a new, zeroed table, which shows up at
+/// `table` through the recursive mapping. Returns -1 if none could be had.
+static int alloc_table(pte_t *entry, void *table) {
+	int zeroed = 0;
+	paddr_t p = g_primedpage;
+	if(p == 0) {
+	    p = pmem_alloc_zeroed(&zeroed);
+	} else
+	    g_primedpage = 0;
+	if(p == 0)
+	    return -1;
+	set_entry(entry, ((pte_t) p) | FLAGS_PRESENT | FLAGS_WRITEABLE); // Non-user, Present
+
+	// Invalidate the TLB cache for this table
+	invlpg((char *) table);
+
+	if(!zeroed)
+		memset(table, 0, PAGE_SIZE);
+
+	return 0;
+}
+
+/// Page directory entry for a virtual address, or null if the tables above
+/// the page directory aren't there.
+static pte_t *get_pde(vaddr_t v) {
+#ifdef X86_64
+	if(!(((pte_t *) PML4_VIRT)[PML4_OFFSET(v)] & FLAGS_PRESENT))
+		return 0;
+	if(!(((pte_t *) PDPT_VIRT)[PDPT_OFFSET(v)] & FLAGS_PRESENT))
+		return 0;
+#endif
+
+	return &((pte_t *) PDIR_VIRT)[PDIR_OFFSET(v)];
+}
+
+/// As get_pde, but allocates any missing tables above the page directory.
+static pte_t *get_pde_alloc(vaddr_t v) {
+#ifdef X86_64
+	pte_t *pml4e = &((pte_t *) PML4_VIRT)[PML4_OFFSET(v)];
+	if(!(*pml4e & FLAGS_PRESENT) &&
+	   (alloc_table(pml4e, (void *) (PDPT_VIRT + (PML4_OFFSET(v) << 12))) < 0))
+		return 0;
+
+	pte_t *pdpte = &((pte_t *) PDPT_VIRT)[PDPT_OFFSET(v)];
+	if(!(*pdpte & FLAGS_PRESENT) &&
+	   (alloc_table(pdpte, (void *) (PDIR_VIRT + (PDPT_OFFSET(v) << 12))) < 0))
+		return 0;
+#endif
+
+	return &((pte_t *) PDIR_VIRT)[PDIR_OFFSET(v)];
+}
+
+/// Page table entry for a virtual address, or null if it has no page table
+/// (including when it's covered by a large page).
+static pte_t *get_pte(vaddr_t v) {
+	pte_t *pde = get_pde(v);
+	if(!pde || ((*pde & (FLAGS_PRESENT | FLAGS_LARGE)) != FLAGS_PRESENT))
+		return 0;
+
+	pte_t *ptab = (pte_t *) PTAB_FROM_VADDR(v);
+	return &ptab[PTAB_OFFSET(v)];
+}
+
+/**
+ * Replaces the large page covering v with a page table mapping the same
+ * frames, so part of it can be remapped or released. The table is filled in
+ * through a window before it's installed, as the large page may well be
+ * mapping the code doing this. Returns -1 if no table could be allocated.
+ */
+static int demote(vaddr_t v) {
+	pte_t *pde = get_pde(v);
+	if(!pde || !(*pde & FLAGS_LARGE))
+		return 0;
+
+	if(!demote_window)
+		return -1;
+
+	paddr_t ptab_phys = pmem_alloc();
+	if(ptab_phys == 0)
+		return -1;
+
+	spinlock_acquire(demote_lock);
+
+	pte_t large = *pde;
+	if(!(large & FLAGS_LARGE)) {
+		// Someone else got here first.
+		spinlock_release(demote_lock);
+		pmem_dealloc(ptab_phys);
+		return 0;
+	}
+
+	pte_t *ptab = (pte_t *) demote_window;
+	pte_t base = large & LARGE_FRAME_MASK;
+	pte_t flags = large & (FLAGS_PRESENT | FLAGS_WRITEABLE | FLAGS_USER | FLAGS_GLOBAL | FLAGS_NX);
+	size_t i;
+
+	// The window's page table exists already; invalidate in case this CPU
+	// still holds a translation from a previous use.
+	*get_pte(demote_window) = ((pte_t) ptab_phys) | FLAGS_PRESENT | FLAGS_WRITEABLE;
+	invlpg((char *) ptab);
+
+	for(i = 0; i < LARGE_PAGE_PAGES; i++)
+		ptab[i] = (base + (i * PAGE_SIZE)) | flags;
+
+	arch_vmem_unmap_local(demote_window);
+
+	set_entry(pde, ((pte_t) ptab_phys) | FLAGS_PRESENT | FLAGS_WRITEABLE | (large & FLAGS_USER));
+
+	spinlock_release(demote_lock);
+
+	// Drop the old large translation and any stale view of the new table.
+	invlpg((char *) PTAB_FROM_VADDR(v));
+	tlb_shootdown(v & ~(LARGE_PAGE_SIZE - 1), LARGE_PAGE_PAGES);
+
+	return 0;
+}
+
+/// Maps a page without invalidating it. Returns 1 if a present mapping was
+/// replaced (so the old translation may still be cached), 0 if not, or -1
+/// if a page table could not be allocated.
+static int map_page(vaddr_t v, paddr_t p, size_t f) {
+	pte_t flags = flags_to_x86(f) | kernel_global(v);
 	if(p == (paddr_t) ~0) {
 		p = g_primedpage;
 		if(p == 0) {
@@ -101,53 +673,153 @@ int arch_vmem_map(vaddr_t v, paddr_t p, size_t f) {
 
 	dprintf("vmem: map(%x -> %x)\n", v, p);
 
-	// Load the page directory so we can figure out if a page table is present.
-	uint32_t *pdir = (uint32_t *) PDIR_VIRT;
+	// Find the page directory entry, creating any tables above it.
+	pte_t *pde = get_pde_alloc(v);
+	if(!pde)
+		return -1;
+
+	// Mapping a single page inside a large page splits it up.
+	if((*pde & FLAGS_LARGE) && (demote(v) < 0))
+		return -1;
 
 	// Is there an entry for the page table?
-	vaddr_t entry = pdir[PDIR_OFFSET(v)] & (vaddr_t) ~0xFFF;
-	uint32_t *ptab = (uint32_t *) PTAB_FROM_VADDR(v);
-	if(entry == 0) {
+	pte_t entry = *pde & FRAME_MASK;
+	pte_t *ptab = (pte_t *) PTAB_FROM_VADDR(v);
+	if((entry == 0) || !(*pde & FLAGS_PRESENT)) {
 		// No page table yet - allocate one.
-		paddr_t ptab_phys = g_primedpage;
-		if(ptab_phys == 0) {
-		    ptab_phys = pmem_alloc();
-		} else
-		    g_primedpage = 0;
-		if(ptab_phys == 0)
-		    return -1;
-		pdir[PDIR_OFFSET(v)] = ((vaddr_t) ptab_phys) | FLAGS_PRESENT | FLAGS_WRITEABLE; // Non-user, Present
-
-		dprintf("vmem: allocated a new page table for %x at %x\n", v, ptab_phys);
-
-	    // Invalidate the TLB cache for this page table
-	    invlpg((char *) ptab);
+		if(alloc_table(pde, ptab) < 0)
+			return -1;
 
-		memset(ptab, 0, PAGE_SIZE - 1);
+		dprintf("vmem: allocated a new page table for %x\n", v);
 	}
 
 	// Complete the mapping.
-	ptab[PTAB_OFFSET(v)] = ((unative_t) (p & PADDR_MASK)) | flags;
+	int replaced = (ptab[PTAB_OFFSET(v)] & FLAGS_PRESENT) ? 1 : 0;
+	ptab[PTAB_OFFSET(v)] = ((pte_t) (p & PADDR_MASK)) | flags;
+
+	return replaced;
+}
+
+int arch_vmem_map(vaddr_t v, paddr_t p, size_t f) {
+	int r = map_page(v, p, f);
+	if(r < 0)
+		return -1;
 
-	// Invalidate the TLB cache for this newly mapped page
-	invlpg((char *) v);
+	if(r)
+		tlb_shootdown(v, 1);
+	else
+		invlpg((char *) v);
 
 	return 0;
 }
 
-void arch_vmem_unmap(vaddr_t v) {
-	if(vmem_ismapped(v) == 0) {
-		return;
+/// Maps a whole large page, if v and p are suitably aligned and nothing in
+/// the large page's range is mapped yet. Returns 1 if it did.
+static int map_large(vaddr_t v, paddr_t p, size_t f) {
+	if((v | p) & (LARGE_PAGE_SIZE - 1))
+		return 0;
+
+	pte_t *pde = get_pde_alloc(v);
+	if(!pde || (*pde & FLAGS_PRESENT))
+		return 0;
+
+	// Nothing was present, so nothing can be cached.
+	set_entry(pde, ((pte_t) (p & PADDR_MASK)) | flags_to_x86(f) | kernel_global(v) | FLAGS_LARGE);
+	return 1;
+}
+
+int arch_vmem_map_range(vaddr_t v, paddr_t p, size_t pages, size_t f) {
+	size_t i, replaced = 0;
+	for(i = 0; i < pages; i++) {
+		paddr_t page = (p == (paddr_t) ~0) ? p : p + (i * PAGE_SIZE);
+		if((p != (paddr_t) ~0) && ((pages - i) >= LARGE_PAGE_PAGES) &&
+		   map_large(v + (i * PAGE_SIZE), page, f)) {
+			i += LARGE_PAGE_PAGES - 1;
+			continue;
+		}
+
+		int r = map_page(v + (i * PAGE_SIZE), page, f);
+		if(r < 0)
+			break;
+
+		replaced += (size_t) r;
 	}
 
-	dprintf("vmem: unmap(%x)\n", v);
+	// Entries that weren't present can't be cached by any CPU.
+	if(replaced)
+		tlb_shootdown(v, i);
 
-	// Unmap the page by marking it not present
-	uint32_t *ptab = (uint32_t *) PTAB_FROM_VADDR(v);
-	ptab[PTAB_OFFSET(v)] &= (uint32_t) ~FLAGS_PRESENT;
+	return (i == pages) ? 0 : -1;
+}
+
+void arch_vmem_unmap_range(vaddr_t v, size_t pages, int release) {
+	size_t i, unmapped = 0, large = 0;
+
+	dprintf("vmem: unmap_range(%x, %d)\n", v, pages);
+
+	for(i = 0; i < pages; i++) {
+		vaddr_t a = v + (i * PAGE_SIZE);
+		pte_t *pde = get_pde(a);
+		if(pde && ((*pde & (FLAGS_PRESENT | FLAGS_LARGE)) == (FLAGS_PRESENT | FLAGS_LARGE))) {
+			if(!(a & (LARGE_PAGE_SIZE - 1)) && ((pages - i) >= LARGE_PAGE_PAGES)) {
+				// The whole large page goes.
+				set_entry(pde, (*pde & (pte_t) ~FLAGS_PRESENT) | (release ? FLAGS_RELEASE : 0));
+				i += LARGE_PAGE_PAGES - 1;
+				unmapped++;
+				large++;
+				continue;
+			}
+
+			if(demote(a) < 0)
+				panic("vmem: no memory to split a large page");
+		}
+
+		pte_t *pte = get_pte(a);
+		if(pte && (*pte & FLAGS_PRESENT)) {
+			*pte &= (pte_t) ~FLAGS_PRESENT;
+			if(release)
+				*pte |= FLAGS_RELEASE;
+			unmapped++;
+		}
+	}
+
+	if(!unmapped)
+		return;
 
-	// Invalidate the TLB cache for this page
-	invlpg((char *) v);
+	tlb_shootdown(v, pages);
+
+	// No CPU can reach the old frames any more.
+	if(release || large) {
+		for(i = 0; i < pages; i++) {
+			vaddr_t a = v + (i * PAGE_SIZE);
+			pte_t *pde = get_pde(a);
+			if(pde && ((*pde & (FLAGS_PRESENT | FLAGS_LARGE)) == FLAGS_LARGE)) {
+				if(*pde & FLAGS_RELEASE)
+					pmem_dealloc_range(*pde & LARGE_FRAME_MASK, LARGE_PAGE_PAGES);
+				set_entry(pde, 0);
+				i += LARGE_PAGE_PAGES - 1;
+				continue;
+			}
+
+			pte_t *pte = get_pte(a);
+			if(pte && (*pte & FLAGS_RELEASE)) {
+				pmem_dealloc(*pte & FRAME_MASK);
+				*pte = 0;
+			}
+		}
+	}
+}
+
+void arch_vmem_unmap(vaddr_t v) {
+	arch_vmem_unmap_range(v, 1, 0);
+}
+
+void arch_vmem_unmap_local(vaddr_t v) {
+	pte_t *pte = get_pte(v);
+	if(pte && (*pte & FLAGS_PRESENT)) {
+		*pte &= (pte_t) ~FLAGS_PRESENT;
+		invlpg((char *) v);
+	}
 }
 
 int arch_vmem_modify(vaddr_t v, size_t nf) {
@@ -155,13 +827,15 @@ int arch_vmem_modify(vaddr_t v, size_t nf) {
 		return -1;
 	}
 
+	if(demote(v) < 0)
+		return -1;
+
 	// Unmap the page by marking it not present
-	uint32_t *ptab = (uint32_t *) PTAB_FROM_VADDR(v);
-	ptab[PTAB_OFFSET(v)] &= (uint32_t) ~0xFFF;
+	pte_t *ptab = (pte_t *) PTAB_FROM_VADDR(v);
+	ptab[PTAB_OFFSET(v)] &= FRAME_MASK;
 	ptab[PTAB_OFFSET(v)] |= flags_to_x86(nf);
 
-	// Invalidate the TLB cache for this page
-	invlpg((char *) v);
+	tlb_shootdown(v, 1);
 
 	return 0;
 }
@@ -169,14 +843,16 @@ int arch_vmem_modify(vaddr_t v, size_t nf) {
 int arch_vmem_ismapped(vaddr_t v) {
 	dprintf("vmem: is %x mapped?\n", v);
 
-	// Load the page directory so we can figure out if a page table is present.
-	uint32_t *pdir = (uint32_t *) PDIR_VIRT;
-
-	// Is there an entry for the page table?
-	vaddr_t entry = pdir[v >> 22] & (paddr_t) ~0xFFF;
-	if(entry != 0) {
+	// Find the page directory entry so we can figure out if a page table is
+	// present.
+	pte_t *pdep = get_pde(v);
+	pte_t pde = pdep ? *pdep : 0;
+	if((pde & (FLAGS_PRESENT | FLAGS_LARGE)) == (FLAGS_PRESENT | FLAGS_LARGE)) {
+		dprintf("vmem: %x is mapped by a large page\n", v);
+		return 1;
+	} else if(pde & FLAGS_PRESENT) {
 		// Complete the mapping.
-		uint32_t *ptab = (uint32_t *) PTAB_FROM_VADDR(v);
+		pte_t *ptab = (pte_t *) PTAB_FROM_VADDR(v);
 		if((ptab[PTAB_OFFSET(v)] & FLAGS_PRESENT) != 0) {
 			dprintf("vmem: %x is mapped\n", v);
 			return 1;
@@ -191,23 +867,188 @@ int arch_vmem_ismapped(vaddr_t v) {
 paddr_t arch_vmem_v2p(vaddr_t v) {
 	dprintf("vmem: v2p %x\n", v);
 
-	uint32_t *ptab = (uint32_t *) PTAB_FROM_VADDR(v);
+	pte_t *pdep = get_pde(v);
+	pte_t pde = pdep ? *pdep : 0;
+	if(!(pde & FLAGS_PRESENT))
+		return 0;
+	else if(pde & FLAGS_LARGE)
+		return (pde & LARGE_FRAME_MASK) | (v & (LARGE_PAGE_SIZE - 1));
+
+	pte_t *ptab = (pte_t *) PTAB_FROM_VADDR(v);
 	if(ptab[PTAB_OFFSET(v)] & FLAGS_PRESENT) {
-		return (ptab[PTAB_OFFSET(v)] & (paddr_t) ~0xFFF) | (v & 0xFFF);
+		return (ptab[PTAB_OFFSET(v)] & FRAME_MASK) | (v & 0xFFF);
 	}
 
 	return 0;
 }
 
 vaddr_t arch_vmem_create() {
-	return 0;
+	struct vmem_space *sp = (struct vmem_space *) malloc(sizeof(*sp));
+	if(!sp)
+		return 0;
+	memset(sp, 0, sizeof(*sp));
+
+	paddr_t top = pmem_alloc_contig(TOP_ORDER);
+	if(!top) {
+		free(sp);
+		return 0;
+	}
+
+	pte_t *tables = (pte_t *) mmiopool_alloc(TOP_PAGES * PAGE_SIZE, top);
+	if(!tables) {
+		pmem_dealloc_contig(top, TOP_ORDER);
+		free(sp);
+		return 0;
+	}
+
+	// Nothing in the user half yet.
+	memset(tables, 0, TOP_PAGES * PAGE_SIZE);
+
+	size_t i;
+	sp->shared = &tables[(TOP_PAGES - 1) * PTAB_ENTRIES];
+	for(i = 0; i < TOP_PAGES; i++)
+		sp->shared[RECURSIVE_SLOT + i] = ((pte_t) (top + (i * PAGE_SIZE))) | FLAGS_PRESENT | FLAGS_WRITEABLE;
+
+	spinlock_acquire(space_lock);
+
+#ifdef X86_PAE
+	if(!pae_nfree && (pae_nspaces == PAE_MAX_SPACES)) {
+		spinlock_release(space_lock);
+		mmiopool_dealloc(tables);
+		pmem_dealloc_contig(top, TOP_ORDER);
+		free(sp);
+		return 0;
+	}
+
+	pte_t *pdpt = pae_space_pdpts[pae_nfree ? pae_free_slots[--pae_nfree] : pae_nspaces++];
+	for(i = 0; i < 4; i++)
+		pdpt[i] = ((pte_t) (top + (i * PAGE_SIZE))) | FLAGS_PRESENT;
+	sp->root = log2phys((uintptr_t) pdpt);
+#else
+	sp->root = top;
+#endif
+
+	// Once the PCIDs run out, address spaces just flush on every switch. A
+	// reused one may still tag the old address space's translations in any
+	// TLB, so every CPU flushes it the first time it switches here.
+	if(pcid_enabled && nfree_pcids) {
+		sp->pcid = free_pcids[--nfree_pcids];
+		sp->stale = ~0U;
+	} else if(pcid_enabled && (next_pcid < PCID_COUNT)) {
+		sp->pcid = next_pcid++;
+	}
+
+	for(i = SHARED_FIRST; i < PTAB_ENTRIES; i++) {
+		if((i < RECURSIVE_SLOT) || (i >= (RECURSIVE_SLOT + TOP_PAGES)))
+			sp->shared[i] = kernel_space.shared[i];
+	}
+
+	sp->next = spaces;
+	spaces = sp;
+
+	spinlock_release(space_lock);
+
+	dprintf("vmem: new address space %p, root %llx pcid %d\n", sp, (uint64_t) sp->root, sp->pcid);
+
+	return (vaddr_t) sp;
 }
 
-void arch_vmem_switch(vaddr_t pd __unused) {
+/// Frees a paging structure and those below it, down `levels` levels. The
+/// frames at the bottom belong to whoever mapped them.
+static void free_tables(pte_t entry, int levels) {
+	paddr_t p = (paddr_t) (entry & FRAME_MASK);
+
+	if(levels > 1) {
+		pte_t *t = (pte_t *) mmiopool_alloc(PAGE_SIZE, p);
+		if(!t)
+			return; // Leaks, but only what can't be reached anyway.
+
+		size_t i;
+		for(i = 0; i < PTAB_ENTRIES; i++) {
+			if((t[i] & (FLAGS_PRESENT | FLAGS_LARGE)) == FLAGS_PRESENT)
+				free_tables(t[i], levels - 1);
+		}
+
+		mmiopool_dealloc(t);
+	}
+
+	pmem_dealloc(p);
+}
+
+void arch_vmem_destroy(vaddr_t as) {
+	struct vmem_space *sp = (struct vmem_space *) as;
+	if(!sp || (sp == &kernel_space))
+		return;
+
+	size_t i;
+	for(i = 0; i < ntlb_queues; i++)
+		assert(tlb_queues[i].space != sp);
+
+	spinlock_acquire(space_lock);
+
+	struct vmem_space **pp;
+	for(pp = &spaces; *pp; pp = &(*pp)->next) {
+		if(*pp == sp) {
+			*pp = sp->next;
+			break;
+		}
+	}
+
+	if(sp->pcid)
+		free_pcids[nfree_pcids++] = (uint16_t) sp->pcid;
+
+#ifdef X86_PAE
+	pte_t *pdpt = (pte_t *) phys2log((uintptr_t) sp->root);
+	pae_free_slots[pae_nfree++] = (uint16_t) ((pdpt - pae_space_pdpts[0]) / 4);
+#endif
+
+	spinlock_release(space_lock);
+
+	// Nothing can switch to it any more, so its user half can go.
+	pte_t *tables = sp->shared - ((TOP_PAGES - 1) * PTAB_ENTRIES);
+	for(i = 0; i < (((TOP_PAGES - 1) * PTAB_ENTRIES) + SHARED_FIRST); i++) {
+		if((tables[i] & (FLAGS_PRESENT | FLAGS_LARGE)) == FLAGS_PRESENT)
+			free_tables(tables[i], USER_TABLE_LEVELS);
+	}
+
+	paddr_t top = (paddr_t) (sp->shared[RECURSIVE_SLOT] & FRAME_MASK);
+	mmiopool_dealloc(tables);
+	pmem_dealloc_contig(top, TOP_ORDER);
+
+	dprintf("vmem: destroyed address space %p\n", sp);
+
+	free(sp);
+}
+
+void arch_vmem_switch(vaddr_t as) {
+	struct vmem_space *sp = as ? (struct vmem_space *) as : &kernel_space;
+	struct tlb_queue *q = get_tlb_queue();
+	unative_t cr3 = (unative_t) sp->root;
+
+	if(q) {
+		if(q->space == sp)
+			return;
+		q->space = sp;
+	}
+
+#ifdef X86_64
+	if(sp->pcid) {
+		uint32_t self = q ? (1U << (q - tlb_queues)) : ~0U;
+
+		// Keep what the TLB has for this PCID, unless it may be stale.
+		cr3 |= sp->pcid;
+		if(q && !(sp->stale & self))
+			cr3 |= CR3_NOFLUSH;
+		else
+			__sync_fetch_and_and(&sp->stale, ~self);
+	}
+#endif
+
+	__asm__ volatile("mov %0, %%cr3" :: "r" (cr3) : "memory");
 }
 
 void gdt_set(int n, uintptr_t base, uint32_t limit, uint8_t access, uint8_t gran) {
-	if(n > 16)
+	if(n >= GDT_ENTRIES)
 		return;
 
 	gdt[n].base_low = base & 0xFFFF;
@@ -220,6 +1061,26 @@ void gdt_set(int n, uintptr_t base, uint32_t limit, uint8_t access, uint8_t gran
 	gdt[n].access = access;
 }
 
+#ifdef X86_64
+static __noinline void reload_gdt() {
+	__asm__ volatile("lgdt %0\n"
+					 "pushq $0x08\n"
+					 "leaq 1f(%%rip), %%rax\n"
+					 "pushq %%rax\n"
+					 "lretq\n"
+					 "1:\n"
+					 "movw $0x10, %%ax\n"
+					 "movw %%ax, %%ds\n"
+					 "movw %%ax, %%es\n"
+					 "movw %%ax, %%fs\n"
+					 "movw %%ax, %%gs\n"
+					 "movw %%ax, %%ss" :: "m" (gdtr) : "rax", "memory");
+
+	// Selectors for syscall/sysret: kernel CS/SS at 0x08/0x10, and a base of
+	// 0x18 for returns, giving user SS 0x20 and 64-bit user CS 0x28.
+	x86_set_msr(MSR_STAR, 0, 0x08 | ((0x18 | 3) << 16));
+}
+#else
 static __noinline void reload_gdt() {
 	__asm__ volatile("lgdt %0; \
 					  jmp $0x08, $.flush;\n \
@@ -231,18 +1092,119 @@ static __noinline void reload_gdt() {
 					  movw %%ax, %%gs; \
 					  movw %%ax, %%ss" :: "m" (gdtr) : "eax");
 }
+#endif
 
-void arch_vmem_init() {
-	// We can clear out the .init section, freeing some pages.
-	uintptr_t init_start_phys = log2phys((uintptr_t) &init);
-	uintptr_t c = 0, n = 0;
-	for(c = (uintptr_t) &init; c < (uintptr_t) &init_end; c += PAGE_SIZE) {
-		vmem_unmap(c);
+#ifndef X86_64
+/// Entry point of the double fault task. The CPU links back to the TSS of the
+/// task that faulted, which holds where it was.
+static void df_task() {
+	size_t idx = (df_tss.prev / sizeof(struct gdt_entry)) - GDT_TSS_FIRST;
+	if(idx < MULTICPU_MAX_CPUS)
+		x86_double_fault(tss[idx].eip, tss[idx].esp);
+	else
+		x86_double_fault(0, 0);
+
+	while(1) __asm__ volatile("cli; hlt");
+}
+
+static void df_task_init() {
+	unative_t cr3;
+	__asm__ volatile("mov %%cr3, %0" : "=r" (cr3));
+
+	df_tss.cr3 = cr3;
+	df_tss.eip = (uintptr_t) df_task;
+	df_tss.eflags = 0x2;
+	df_tss.esp = (uintptr_t) &df_stack[DF_STACK_SIZE];
+	df_tss.cs = 0x08;
+	df_tss.ss = df_tss.ds = df_tss.es = df_tss.fs = df_tss.gs = 0x10;
+	df_tss.iomap_base = sizeof(struct tss);
+
+	gdt_set(GDT_DF_TSS, (uintptr_t) &df_tss, sizeof(struct tss) - 1, 0x89, 0);
+}
+#endif
+
+/// Gives this CPU a TSS, which is where its double fault stack comes from.
+/// Needs the GDT loaded.
+static void tss_load() {
+	size_t idx = multicpu_slot_claim(&ntss, MULTICPU_MAX_CPUS);
+	if(idx >= MULTICPU_MAX_CPUS) {
+		dprintf("vmem: too many CPUs for a TSS each\n");
+		return;
+	}
 
-		pmem_dealloc(init_start_phys);
-		init_start_phys += 0x1000;
-		n++;
+	struct tss *t = &tss[idx];
+	uintptr_t base = (uintptr_t) t;
+	t->iomap_base = sizeof(struct tss);
+
+#ifdef X86_64
+	t->ist[X86_DF_IST - 1] = (uintptr_t) &df_stacks[idx][DF_STACK_SIZE];
+
+	// The upper half of the base goes in the entry after.
+	size_t n = GDT_TSS_FIRST + (idx * 2);
+	gdt_set((int) n, base, sizeof(struct tss) - 1, 0x89, 0);
+	uint32_t *upper = (uint32_t *) &gdt[n + 1];
+	upper[0] = (uint32_t) (base >> 32);
+	upper[1] = 0;
+#else
+	// Only somewhere to save the state of the task that double faults.
+	size_t n = GDT_TSS_FIRST + idx;
+	gdt_set((int) n, base, sizeof(struct tss) - 1, 0x89, 0);
+#endif
+
+	__barrier;
+	__asm__ volatile("ltr %w0" :: "r" ((uint16_t) (n * sizeof(struct gdt_entry))));
+}
+
+#if defined(X86_PAE) || defined(X86_64)
+/// Turns on EFER.NXE if the CPU has it, so mappings can be no-execute.
+static void nx_enable() {
+	uint32_t a, b, c, d;
+
+	x86_cpuid(0x80000000, &a, &b, &c, &d);
+	if(a < 0x80000001)
+		return;
+
+	x86_cpuid(0x80000001, &a, &b, &c, &d);
+	if(d & (1 << 20)) {
+		x86_get_msr(MSR_EFER, &a, &b);
+		x86_set_msr(MSR_EFER, a | EFER_NXE, b);
+		nx_flags = FLAGS_NX;
 	}
+}
+#endif
+
+/// Turns on global pages, and PCIDs where the CPU has them (these need long
+/// mode).
+static void tlb_features_enable() {
+	uint32_t a, b, c, d;
+	unative_t cr4;
+
+	x86_cpuid(1, &a, &b, &c, &d);
+	__asm__ volatile("mov %%cr4, %0" : "=r" (cr4));
+
+	if(d & (1 << 13))
+		cr4 |= CR4_PGE;
+#ifdef X86_64
+	if(c & (1 << 17)) {
+		cr4 |= CR4_PCIDE;
+		pcid_enabled = 1;
+	}
+#endif
+
+	__asm__ volatile("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
+
+void arch_vmem_init() {
+#ifdef X86_64
+	// 32-bit kernels do this as part of switching to PAE.
+	nx_enable();
+#endif
+
+	tlb_features_enable();
+
+	// We can clear out the .init section, freeing some pages.
+	uintptr_t c = 0, n = ((uintptr_t) &init_end - (uintptr_t) &init + PAGE_SIZE - 1) / PAGE_SIZE;
+	vmem_unmap_range((uintptr_t) &init, n, 1);
 
 	kprintf("vmem: cleared %d KB of RAM used by kernel init\n", (n * PAGE_SIZE) / 1024);
 
@@ -257,8 +1219,8 @@ void arch_vmem_init() {
 	// We need to copy the existing KBoot stack, and then we need to switch stacks.
 	// Because I'm masochistic, I'm doing this in C.
 
-	uint32_t esp = 0;
-	__asm__ volatile("mov %%esp, %0" : "=r" (esp));
+	unative_t esp = 0;
+	__asm__ volatile("mov " REG_SP ", %0" : "=r" (esp));
 
 	dprintf("current stack is %x, moving to base %x\n", esp, stack_base);
 
@@ -270,8 +1232,8 @@ void arch_vmem_init() {
 
 	// This is tricky. Update the stack pointer, live.
 	uintptr_t ebp = 0;
-	__asm__ volatile("mov %%ebp, %0" : "=r" (ebp));
-	__asm__ volatile("mov %0, %%esp" :: "r" (STACK_TOP - stacksz));
+	__asm__ volatile("mov " REG_BP ", %0" : "=r" (ebp));
+	__asm__ volatile("mov %0, " REG_SP :: "r" (STACK_TOP - stacksz));
 
 	// Just moved the stack, a barrier is definitely necessary.
 	__barrier;
@@ -281,14 +1243,15 @@ void arch_vmem_init() {
 	// By now, things like KBoot tags should be used and ACPI stuff should be
 	// mapped in, or about to be mapped in.
 	/// \todo move kboot tags to high memory.
-	uint32_t *pdir = (uint32_t *) PDIR_VIRT;
-	pdir[0] = 0;
+	pte_t *pdir = (pte_t *) PDIR_VIRT;
+	for(c = 0; c < PDIR_OFFSET(BOOT_MAP_SIZE); c++)
+		pdir[c] = 0;
 
 	/// \todo massive hack
 	vmem_map(0xB8000, 0xB8000, VMEM_SUPERVISOR | VMEM_GLOBAL | VMEM_READWRITE);
 
 	// Just completely flush the TLB.
-	__asm__ volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" ::: "eax", "memory");
+	reload_cr3();
 
 	dprintf("stack is now at %x ebp is %x\n", (STACK_TOP - stacksz), ebp);
 
@@ -298,6 +1261,18 @@ void arch_vmem_init() {
 	// Null GDT entry
 	gdt_set(0, 0, 0, 0, 0);
 
+#ifdef X86_64
+	// Kernel CS/DS (0x08/0x10)
+	gdt_set(1, 0, 0xFFFFFFFF, 0x98, 0xAF);
+	gdt_set(2, 0, 0xFFFFFFFF, 0x92, 0xCF);
+
+	// User 32-bit CS, DS, and 64-bit CS (0x18/0x20/0x28), in the order sysret
+	// expects.
+	gdt_set(3, 0, 0xFFFFFFFF, 0xF8, 0xCF);
+	gdt_set(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+	gdt_set(5, 0, 0xFFFFFFFF, 0xF8, 0xAF);
+
+#else
 	// Kernel CS/DS (0x08/0x10)
 	gdt_set(1, 0, 0xFFFFFFFF, 0x98, 0xCF);
 	gdt_set(2, 0, 0xFFFFFFFF, 0x92, 0xCF);
@@ -306,8 +1281,11 @@ void arch_vmem_init() {
 	gdt_set(3, 0, 0xFFFFFFFF, 0xF8, 0xCF);
 	gdt_set(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
 
-	// Set up the GDTR
-	gdtr.limit = (sizeof(struct gdt_entry) * 5) - 1;
+	df_task_init();
+#endif
+
+	// Set up the GDTR, with room for a TSS per CPU.
+	gdtr.limit = sizeof(gdt) - 1;
 	gdtr.base = (uintptr_t) gdt;
 
 	// Make sure GCC doesn't attempt to reorder instructions here
@@ -315,26 +1293,204 @@ void arch_vmem_init() {
 
 	// Flush the GDT
 	reload_gdt();
+	tss_load();
 
 	dprintf("gdtr limit: %x, base: %x\n", gdtr.limit, gdtr.base);
 }
 
+/**
+ * Swaps the boot page tables mapping the kernel image for large pages, where
+ * the image is still mapped linearly. A large page also covers the free
+ * frames after the image; that alias is supervisor-only and write-back like
+ * every other mapping of RAM, so it's harmless.
+ */
+static void promote_kernel() {
+	pte_t *pdir = (pte_t *) PDIR_VIRT;
+	vaddr_t v;
+	size_t i;
+
+	for(v = KERNEL_BASE; v < (KERNEL_BASE + BOOT_MAP_SIZE); v += LARGE_PAGE_SIZE) {
+		if((pdir[PDIR_OFFSET(v)] & (FLAGS_PRESENT | FLAGS_LARGE)) != FLAGS_PRESENT)
+			continue;
+
+		pte_t *ptab = (pte_t *) PTAB_FROM_VADDR(v);
+		pte_t p = (pte_t) log2phys(v);
+		for(i = 0; i < LARGE_PAGE_PAGES; i++) {
+			if(!(ptab[i] & FLAGS_PRESENT))
+				continue;
+
+			if(((ptab[i] & FRAME_MASK) != (p + (i * PAGE_SIZE))) || (ptab[i] & FLAGS_USER))
+				break;
+		}
+
+		if(i < LARGE_PAGE_PAGES)
+			continue;
+
+		set_entry(&pdir[PDIR_OFFSET(v)], p | FLAGS_PRESENT | FLAGS_WRITEABLE | FLAGS_GLOBAL | FLAGS_LARGE);
+		tlb_shootdown(v, LARGE_PAGE_PAGES);
+
+		dprintf("vmem: kernel image at %x now mapped with a large page\n", v);
+	}
+}
+
 void arch_vmem_final_init() {
+	pte_t *shared = (pte_t *) SHARED_TABLE;
+	unative_t cr3;
+
+	// The boot tables are the kernel's address space. They live in the kernel
+	// image, so the table with the kernel half is mapped there already.
+	__asm__ volatile("mov %%cr3, %0" : "=r" (cr3));
+#ifdef X86_PAE
+	kernel_space.root = cr3 & ~0x1FUL; // The PDPT is only 32-byte aligned.
+#else
+	kernel_space.root = cr3 & FRAME_MASK;
+#endif
+	kernel_space.shared = (pte_t *) phys2log((uintptr_t) (shared[RECURSIVE_SLOT + TOP_PAGES - 1] & FRAME_MASK));
+	space_lock = create_spinlock_at(space_lock_region, sizeof(space_lock_region));
+
+	// Per-CPU data is up by now.
+	tlb_register();
+
+	// Reserve the window for splitting large pages. Mapping it once creates
+	// its page table, so demote() never needs to allocate one.
+	demote_lock = create_spinlock_at(demote_lock_region, sizeof(demote_lock_region));
+	paddr_t page = pmem_alloc();
+	if(page) {
+		vaddr_t window = (vaddr_t) mmiopool_alloc(PAGE_SIZE, page);
+		if(window)
+			vmem_unmap(window);
+		pmem_dealloc(page);
+
+		demote_window = window;
+	}
+
+	if(demote_window)
+		promote_kernel();
 
 	// Full TLB flush.
-	__asm__ volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" ::: "eax", "memory");
+	reload_cr3();
 }
 
 void vmem_multicpu_init() {
-	// Same GDT for all CPUs.
+	// Same GDT for all CPUs, but each needs a TSS of its own.
 	reload_gdt();
+	tss_load();
+
+	// The startup code can't turn PCIDs on, as they need long mode.
+	tlb_features_enable();
+
+	tlb_register();
+}
+
+void x86_paging_state(uint32_t *cr4, uint32_t *efer) {
+	unative_t c;
+	__asm__ volatile("mov %%cr4, %0" : "=r" (c));
+
+	if(cr4)
+		*cr4 = c & (CR4_PSE | CR4_PAE | CR4_PGE);
+	if(efer) {
+		*efer = nx_flags ? EFER_NXE : 0;
+#ifdef X86_64
+		*efer |= EFER_LME;
+#endif
+	}
+}
+
+#ifdef X86_PAE
+
+/// Page tables x86_pae_init can convert: the kernel image's and the heap's.
+#define PAE_BOOT_PTABS		4
+
+static pte_t pae_pdpt[4] __aligned(32);
+static pte_t pae_pdirs[4][PTAB_ENTRIES] __aligned(PAGE_SIZE);
+static pte_t pae_ptabs[PAE_BOOT_PTABS][PTAB_ENTRIES] __aligned(PAGE_SIZE);
+
+/// Turns paging off, enables PAE with the given PDPT, and turns it back on.
+/// Runs from the kernel's identity mapping while paging is off.
+static void pae_switch(uint32_t pdpt) {
+	__asm__ volatile("mov $1f - %c1, %%eax\n"
+					 "jmp *%%eax\n"
+					 "1: mov %%cr0, %%eax\n"
+					 "and $0x7FFFFFFF, %%eax\n"
+					 "mov %%eax, %%cr0\n"
+					 "mov %%cr4, %%eax\n"
+					 "or %2, %%eax\n"
+					 "mov %%eax, %%cr4\n"
+					 "mov %0, %%cr3\n"
+					 "mov %%cr0, %%eax\n"
+					 "or $0x80000000, %%eax\n"
+					 "mov %%eax, %%cr0\n"
+					 "mov $2f, %%eax\n"
+					 "jmp *%%eax\n"
+					 "2:\n"
+					 :: "r" (pdpt), "i" (KERNEL_BASE - PHYS_ADDR), "i" (CR4_PAE) : "eax", "memory");
 }
 
+void x86_pae_init() {
+	uint32_t *old_pdir = (uint32_t *) 0xFFFFF000;
+	pte_t *new_pdir = (pte_t *) pae_pdirs;
+	uint32_t a, b, c, d;
+	size_t i, j, k, n = 0;
+
+	x86_cpuid(1, &a, &b, &c, &d);
+	if(!(d & (1 << 6)))
+		panic("This kernel needs a CPU with PAE.");
+
+	// Identity-map the kernel so the switch can run with paging off.
+	old_pdir[PHYS_ADDR >> 22] = PHYS_ADDR | FLAGS_PRESENT | FLAGS_WRITEABLE | FLAGS_LARGE;
+
+	// Each 4 MB entry of the old directory becomes two 2 MB entries. The last
+	// two are the old and new recursive mappings.
+	for(i = 0; i < 1022; i++) {
+		uint32_t pde = old_pdir[i];
+		if(!(pde & FLAGS_PRESENT))
+			continue;
+
+		if(pde & FLAGS_LARGE) {
+			new_pdir[i * 2] = (pde & 0xFFC00000) | (pde & 0xFFF);
+			new_pdir[(i * 2) + 1] = new_pdir[i * 2] + LARGE_PAGE_SIZE;
+			continue;
+		}
+
+		uint32_t *old_ptab = (uint32_t *) (0xFFC00000 + (i << 12));
+		for(j = 0; j < 2; j++) {
+			if(n == PAE_BOOT_PTABS)
+				panic("pae: too many boot page tables to convert");
+
+			pte_t *ptab = pae_ptabs[n++];
+			for(k = 0; k < PTAB_ENTRIES; k++)
+				ptab[k] = old_ptab[(j * PTAB_ENTRIES) + k];
+
+			new_pdir[(i * 2) + j] = ((pte_t) log2phys((uintptr_t) ptab)) | (pde & 0xFFF);
+		}
+	}
+
+	for(i = 0; i < 4; i++) {
+		pte_t phys = (pte_t) log2phys((uintptr_t) pae_pdirs[i]);
+		pae_pdpt[i] = phys | FLAGS_PRESENT;
+		pae_pdirs[3][PTAB_ENTRIES - 4 + i] = phys | FLAGS_PRESENT | FLAGS_WRITEABLE;
+	}
+
+	// No-execute needs EFER.NXE, which only means anything with PAE.
+	nx_enable();
+
+	pae_switch((uint32_t) log2phys((uintptr_t) pae_pdpt));
+
+	// Done with the identity mapping of the kernel.
+	for(i = PDIR_OFFSET(PHYS_ADDR); i < PDIR_OFFSET(PHYS_ADDR + BOOT_MAP_SIZE); i++)
+		new_pdir[i] = 0;
+	reload_cr3();
+}
+
+#endif
+
 extern void *pc_acpi_gdt;
 
 int vmem_powerstate_change(int new_state) {
-	uint32_t *pdir = (uint32_t *) PDIR_VIRT;
-	static uint32_t persist_pdir = 0;
+	pte_t *pdir = (pte_t *) PDIR_VIRT;
+	static pte_t persist_pdir[PDIR_OFFSET(BOOT_MAP_SIZE)];
+	static struct vmem_space *persist_space = 0;
+	size_t i;
 
 	if(new_state == POWERMAN_STATE_WORKING) {
 		// Handle return to working state by reloading GDTR.
@@ -342,16 +1498,30 @@ int vmem_powerstate_change(int new_state) {
 		reload_gdt();
 
 		// Restore the old 0 - 4 MB page table.
-		pdir[0] = persist_pdir;
+		for(i = 0; i < PDIR_OFFSET(BOOT_MAP_SIZE); i++)
+			pdir[i] = persist_pdir[i];
+
+		if(persist_space) {
+			arch_vmem_switch((vaddr_t) persist_space);
+			persist_space = 0;
+		}
 	} else if(new_state < POWERMAN_STATE_OFF) {
+		// Only the kernel's address space has the low memory the wakeup code
+		// runs from.
+		struct tlb_queue *q = get_tlb_queue();
+		persist_space = q ? q->space : 0;
+		arch_vmem_switch(0);
+
 		// Copy our current kernel code/data segments so the wakeup code can
 		// load a GDT with minimal effort.
 		dprintf("pc: copying gdt for wakeup to %p\n", &pc_acpi_gdt);
 		memcpy(&pc_acpi_gdt, gdt, sizeof(gdt[0]) * 3);
 
-		// Map in the first 4 MB with a large page again.
-		persist_pdir = pdir[0];
-		pdir[0] = 0x83;
+		// Map in the first 4 MB with large pages again.
+		for(i = 0; i < PDIR_OFFSET(BOOT_MAP_SIZE); i++) {
+			persist_pdir[i] = pdir[i];
+			pdir[i] = (i * LARGE_PAGE_SIZE) | FLAGS_PRESENT | FLAGS_WRITEABLE | FLAGS_LARGE;
+		}
 	}
 
 	return 0;
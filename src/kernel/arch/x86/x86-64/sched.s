@@ -0,0 +1,79 @@
+# Copyright (c) 2011 Matthew Iselin, Rich Edelman
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+.globl save_thread_context
+.globl restore_thread_context
+
+# Only the registers the SysV ABI has callees preserve are saved: a context is
+# always saved from a call into save_thread_context.
+
+save_thread_context:
+	# Grab current context
+	mov %rbx, (%rdi)
+	mov %rbp, 8(%rdi)
+	mov %r12, 16(%rdi)
+	mov %r13, 24(%rdi)
+	mov %r14, 32(%rdi)
+	mov %r15, 40(%rdi)
+	mov %rsp, 48(%rdi)
+	mov (%rsp), %rcx
+	mov %rcx, 56(%rdi)  # rip
+
+	pushfq
+	pop %rcx
+	mov %rcx, 64(%rdi)  # rflags
+
+	# restoring this context will return zero to indicate context switch return
+	mov $1, %eax
+	ret
+
+restore_thread_context:
+	# load context (lock is in rsi, the old thread's oncpu flag in rdx)
+	mov %rdi, %rax
+
+	mov (%rax), %rbx
+	mov 8(%rax), %rbp
+	mov 16(%rax), %r12
+	mov 24(%rax), %r13
+	mov 32(%rax), %r14
+	mov 40(%rax), %r15
+	mov 48(%rax), %rsp
+	add $8, %rsp
+
+	test %rsi, %rsi
+	je .nolock
+
+	lock incl (%rsi)
+
+.nolock:
+
+	# Off the old thread's stack now, so another CPU may run it.
+	test %rdx, %rdx
+	je .nooncpu
+
+	movl $0, (%rdx)
+
+.nooncpu:
+
+	# RFLAGS.
+	pushq 64(%rax)
+	popfq
+
+	# New threads take their parameter in rdi.
+	mov 72(%rax), %rdi
+
+	# Return 0 - we're restoring context
+	mov 56(%rax), %rcx
+	mov $0, %eax
+	jmp *%rcx
@@ -13,7 +13,7 @@
 # OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 .global pc_ap_entry
-.global pc_ap_pdir
+.global pc_ap_pdir, pc_ap_cr4, pc_ap_efer
 .extern ap_startup
 
 .section .lowmem
@@ -93,6 +93,28 @@ pc_ap_entry:
     movl %cs:(%esi), %esi
     mov %esi, %cr3
 
+    # Paging features the BSP runs with (PSE, PAE) must be on before paging.
+    mov $pc_ap_cr4, %esi
+    andl $0xFFF, %esi
+    movl %cs:(%esi), %eax
+    mov %eax, %cr4
+
+    # As must EFER.NXE if the page tables use the NX bit.
+    mov $pc_ap_efer, %esi
+    andl $0xFFF, %esi
+    movl %cs:(%esi), %ebx
+    test %ebx, %ebx
+    jz .noefer
+
+    push %edx
+    mov $0xC0000080, %ecx
+    rdmsr
+    or %ebx, %eax
+    wrmsr
+    pop %edx
+
+.noefer:
+
     # Load the 32-bit entry point.
     mov $pc_ap_entry_32, %ecx
     andl $0xFFF, %ecx
@@ -179,6 +201,12 @@ pc_ap_gdtr:
 pc_ap_pdir:
     .fill 4, 1, 0
 
+pc_ap_cr4:
+    .fill 4, 1, 0
+
+pc_ap_efer:
+    .fill 4, 1, 0
+
 stack:
     .fill 1024, 1, 0
 end_stack:
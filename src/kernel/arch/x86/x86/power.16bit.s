@@ -114,6 +114,20 @@ pc_acpi_wakeup:
     movl %ds:16(%esi), %eax
     movl %eax, %cr4
 
+    # Restore EFER bits the page tables depend on (NX), if there are any.
+    movl %ds:72(%esi), %ebx
+    test %ebx, %ebx
+    jz .noefer
+
+    push %edx
+    mov $0xC0000080, %ecx
+    rdmsr
+    or %ebx, %eax
+    wrmsr
+    pop %edx
+
+.noefer:
+
     # Restore old code segment.
     movl %ds:20(%esi), %ebx
 
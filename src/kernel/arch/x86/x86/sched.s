@@ -39,8 +39,9 @@ save_thread_context:
 	ret
 
 restore_thread_context:
-	# lock
+	# lock, and the old thread's oncpu flag
 	mov 8(%esp), %ecx
+	mov 12(%esp), %edx
 
 	# load context
 	mov 4(%esp), %eax
@@ -55,10 +56,18 @@ restore_thread_context:
 	test %ecx, %ecx
 	je .nolock
 
-	lock decl (%ecx)
+	lock incl (%ecx)
 
 .nolock:
 
+	# Off the old thread's stack now, so another CPU may run it.
+	test %edx, %edx
+	je .nooncpu
+
+	movl $0, (%edx)
+
+.nooncpu:
+
 	# EFLAGS.
 	mov 24(%eax), %ecx
 	push %ecx
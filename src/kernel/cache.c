@@ -122,11 +122,9 @@ void *cache_startblock(void *cache, unative_t offset) {
         blockdata = (struct block *) malloc(sizeof(struct block));
         memset(blockdata, 0, sizeof(*blockdata));
 
-        blockdata->addr = pool_alloc(meta->pool);
+        blockdata->addr = pool_alloc_zeroed(meta->pool);
         blockdata->offset = offset;
 
-        memset(blockdata->addr, 0, 0x1000);
-
         tree_insert(meta->blockdata, (void *) offset, blockdata);
     }
 
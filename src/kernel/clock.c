@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <types.h>
+#include <clock.h>
+#include <timer.h>
+#include <io.h>
+#include <seqlock.h>
+
+extern int __begin_clocksource_table, __end_clocksource_table;
+
+#define GET_CLOCKSOURCE(n)	(((struct clocksource_table_entry *) &__begin_clocksource_table)[(n)].cs)
+#define CLOCKSOURCE_COUNT	((((uintptr_t) &__end_clocksource_table) - ((uintptr_t) &__begin_clocksource_table)) / sizeof(struct clocksource_table_entry))
+
+/// Longest gap between reads of the counter that the ns conversion must survive
+/// without overflowing. The base is refreshed far more often than this.
+#define CLOCK_MAX_GAP_SECONDS	10
+
+/// How often the base is refreshed (and so counter wraps are caught).
+#define CLOCK_UPDATE_MS			500
+
+/// Clocksource in use.
+static struct clocksource *clock = 0;
+
+/// Counter to nanoseconds: ns = (delta * clock_mult) >> clock_shift.
+static uint64_t clock_mult = 0;
+static uint32_t clock_shift = 0;
+
+/// Counter value and time at the last refresh of the base.
+static volatile uint64_t base_count = 0;
+static volatile uint64_t base_ns = 0;
+
+/// Lets readers of the base retry torn reads.
+static seqlock_t base_seq;
+
+static uint64_t tick_clock_read() {
+	return timer_monotonic_ns();
+}
+
+/// Fallback: the system timer's tick count. Always usable, but coarse.
+static struct clocksource tick_clock = {
+	"System timer ticks",
+	1,
+	1000000000ULL,
+	(uint64_t) ~0ULL,
+	0,
+	tick_clock_read
+};
+
+EXPORT_CLOCKSOURCE(tick, tick_clock);
+
+static uint64_t clock_delta_ns(uint64_t count, uint64_t base) {
+	uint64_t delta = (count - base) & clock->mask;
+
+	// Counter read on another CPU slightly behind the one that refreshed the
+	// base - don't let time go backwards (or wrap).
+	if(delta > (clock->mask >> 1))
+		delta = 0;
+	return (delta * clock_mult) >> clock_shift;
+}
+
+uint64_t clock_now_ns() {
+	if(!clock)
+		return 0;
+
+	uint32_t seq;
+	uint64_t count, ns;
+	do {
+		seq = seqlock_read_begin(&base_seq);
+		count = base_count;
+		ns = base_ns;
+	} while(seqlock_read_retry(&base_seq, seq));
+
+	return ns + clock_delta_ns(clock->read(), count);
+}
+
+static int clock_update(uint64_t ticks __unused) {
+	seqlock_write_begin(&base_seq);
+
+	uint64_t now = clock->read();
+	base_ns += clock_delta_ns(now, base_count);
+	base_count = now;
+
+	seqlock_write_end(&base_seq);
+
+	return 0;
+}
+
+void clock_init() {
+	size_t i;
+	dprintf("clock_init: %d clocksources\n", CLOCKSOURCE_COUNT);
+
+	seqlock_init(&base_seq);
+	for(i = 0; i < CLOCKSOURCE_COUNT; i++) {
+		struct clocksource *cs = GET_CLOCKSOURCE(i);
+		if(clock && (cs->rating <= clock->rating))
+			continue;
+
+		if(cs->init && cs->init(cs)) {
+			dprintf("clocksource %s is not usable\n", cs->name);
+			continue;
+		}
+
+		if(!cs->freq)
+			continue;
+
+		clock = cs;
+	}
+
+	// The tick clock is always usable, so there's always a clock.
+	kprintf("clock: using %s (%d kHz)\n", clock->name, (uint32_t) (clock->freq / 1000));
+
+	// Pick the most precise conversion that can't overflow over the longest
+	// expected gap between refreshes of the base.
+	uint64_t max_delta = clock->freq * CLOCK_MAX_GAP_SECONDS;
+	if(max_delta > clock->mask)
+		max_delta = clock->mask;
+
+	clock_shift = 32;
+	while(clock_shift) {
+		clock_mult = (1000000000ULL << clock_shift) / clock->freq;
+		if(clock_mult <= ((((uint64_t) ~0ULL) >> 1) / max_delta))
+			break;
+
+		clock_shift--;
+	}
+
+	base_ns = 0;
+	base_count = clock->read();
+
+	install_timer(clock_update, ((CLOCK_UPDATE_MS << TIMERRES_SHIFT) | TIMERRES_MILLI), TIMERFEAT_PERIODIC);
+}
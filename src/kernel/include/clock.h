@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <types.h>
+#include <compiler.h>
+
+/// Defines a free-running counter that can be used to tell the time.
+struct clocksource {
+	const char *name;
+
+	/// Preference for this clocksource - the highest rated usable one is used.
+	uint32_t rating;
+
+	/// Frequency of the counter, in Hz. May be filled in by init.
+	uint64_t freq;
+
+	/// Mask of the valid bits in the counter (it wraps past this value).
+	uint64_t mask;
+
+	/// Probes and calibrates the counter.
+	/// \return -1 if hardware not present, or not usable. 0 otherwise.
+	int (*init)(struct clocksource *cs);
+
+	/// Reads the counter. Must be safe to call on any CPU at any time.
+	uint64_t (*read)();
+};
+
+/// Type for the table of available clocksources in the system.
+struct clocksource_table_entry {
+	struct clocksource *cs;
+};
+
+/// Exports a clocksource in the clocksource table.
+#define EXPORT_CLOCKSOURCE(name, ent) \
+	struct clocksource_table_entry _cs_##name __section(".table.clocksources") __used = {&ent}
+
+/**
+ * \brief Selects and calibrates the best available clocksource.
+ *
+ * Must be called after timers_init, as the fallback clocksource is driven by
+ * the system timer.
+ */
+extern void clock_init();
+
+/**
+ * \brief Gets the number of nanoseconds since clock_init.
+ *
+ * Lock-free and monotonic. Returns zero before clock_init has been called.
+ */
+extern uint64_t clock_now_ns();
+
+#endif
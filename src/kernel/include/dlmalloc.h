@@ -23,7 +23,9 @@
 #define ABORT					dlmalloc_abort(__FILE__, __LINE__)
 #define MORECORE				dlmalloc_sbrk
 #define HAVE_MORECORE			1
-// #define MORECORE_CANNOT_TRIM	1
+// Giving memory back unmaps it, and waits for the other CPUs to drop it from
+// their TLBs, from inside free() with the allocator lock held.
+#define MORECORE_CANNOT_TRIM	1
 #define MORECORE_CONTIGUOUS		1
 #define HAVE_MMAP				0
 #define MALLOC_FAILURE_ACTION
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _FPU_H
+#define _FPU_H
+
+#include <types.h>
+#include <sched.h>
+
+/// Set up lazy FPU switching on the boot CPU.
+extern void fpu_init();
+
+/// Set up FPU control state on the current CPU.
+extern void fpu_cpuinit();
+
+/// Called when switching away from a context, to save its FPU state if it has
+/// used the FPU since it was switched in.
+extern void fpu_switch_out(context_t *ctx);
+
+/// Release the FPU state of a context being destroyed.
+extern void fpu_destroy(context_t *ctx);
+
+/**
+ * Allows kernel code to use FPU/SIMD registers until kernel_fpu_end, saving
+ * the current thread's state first. Interrupts are disabled in between, so
+ * keep the section short. Returns a value to pass to kernel_fpu_end.
+ */
+extern int kernel_fpu_begin();
+
+/// Ends a section started with kernel_fpu_begin.
+extern void kernel_fpu_end(int state);
+
+/// Whether SSE2 can be used between kernel_fpu_begin and kernel_fpu_end.
+extern int fpu_simd_available();
+
+#endif
@@ -24,6 +24,16 @@ typedef int (*crosscpu_func_t)(void *p);
 #define MULTICPU_PERCPU_CURRTHREAD      0
 #define MULTICPU_PERCPU_IDLETHREAD      1
 #define MULTICPU_PERCPU_CPUTIMER        2
+#define MULTICPU_PERCPU_RUNQUEUE        3
+#define MULTICPU_PERCPU_SLEEPQ          4
+#define MULTICPU_PERCPU_PAGECACHE       5
+#define MULTICPU_PERCPU_SLAB            6
+#define MULTICPU_PERCPU_TLB             7
+#define MULTICPU_PERCPU_RWLOCK          8
+#define MULTICPU_PERCPU_RCU             9
+
+/// Most CPUs the kernel's per-CPU tables have room for.
+#define MULTICPU_MAX_CPUS               32
 
 /**
  * \brief Initialise multi-CPU support in the system.
@@ -71,8 +81,8 @@ extern void multicpu_cpuinit();
  * is not on the current CPU. For example, a timer handler may need to run, but
  * it was installed on a different core to the currently executing CPU.
  *
- * This function will block until the receiving CPU begins executing the given
- * code.
+ * The call is queued for the receiving CPU, so this function only waits if
+ * that CPU has a backlog. The parameter must remain valid until the call runs.
  *
  * \param cpu Machine-specific CPU ID.
  */
@@ -89,6 +99,26 @@ extern void multicpu_call(uint32_t cpu, crosscpu_func_t func, void *param);
  */
 extern void multicpu_doresched();
 
+/**
+ * \brief Request the given CPU to reschedule as soon as possible.
+ *
+ * Unlike multicpu_call, this does not block. It is used to tell a CPU that
+ * work has been queued for it, which may be halted waiting for an interrupt.
+ * Does nothing if the given CPU is the current CPU.
+ *
+ * \param cpu Machine-specific CPU ID.
+ */
+extern void multicpu_resched(uint32_t cpu);
+
+/**
+ * \brief Interrupt the given CPU so it handles its queued TLB invalidations.
+ *
+ * Does not wait. The machine layer calls vmem_shootdown_recv on the target.
+ *
+ * \param cpu Machine-specific CPU ID.
+ */
+extern void multicpu_tlb_flush(uint32_t cpu);
+
 /**
  * Get the machine-specific ID of the currently executing processor.
  */
@@ -120,5 +150,16 @@ extern uint32_t multicpu_count();
  */
 extern void *multicpu_percpu_at(size_t n);
 
+/**
+ * \brief Claims the next free slot in a table of per-CPU entries.
+ *
+ * Modules that keep an array of per-CPU entries (eg, so one CPU can look at
+ * another's) use this to give each CPU its own index. The counter holds the
+ * number of slots handed out, and never goes past max.
+ *
+ * \return the claimed index, or max if the table is full
+ */
+extern size_t multicpu_slot_claim(volatile size_t *counter, size_t max);
+
 #endif
 
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _MUTEX_H
+#define _MUTEX_H
+
+#include "annotate.h"
+#include <types.h>
+#include <waitqueue.h>
+
+/**
+ * Sleeping mutex. A thread that finds it held spins while the holder is
+ * running on another CPU - short critical sections finish before a sleep and
+ * wakeup would - and sleeps otherwise. Unlocking hands the mutex straight to
+ * the highest priority waiter, and a holder runs at the priority of the most
+ * important thread waiting on any of the mutexes it holds.
+ *
+ * Inheritance is one level deep: a holder that is itself asleep on another
+ * mutex does not pass the boost on to that mutex's holder, so a chain of
+ * three or more threads can still be held up by a low priority thread at the
+ * end of it. Following the chain would mean taking each mutex's wait queue
+ * lock in turn, in whatever order the chain happens to run.
+ */
+typedef struct CAPABILITY("mutex") mutex {
+    /// Holding thread, with MUTEX_WAITERS set while any are asleep.
+    volatile uintptr_t owner;
+
+    /// Priority of the most important sleeper.
+    uint32_t top_priority;
+
+    /// Holder whose pi_held list this is on, and the link in that list.
+    struct thread *pi_holder;
+    struct mutex *pi_next;
+
+    /// Sleeping waiters. Its lock also guards top_priority.
+    wait_queue_t waiters;
+} mutex_t;
+
+/// Initialise a mutex (no memory allocation is required).
+extern void mutex_init(mutex_t *m);
+
+/// Allocate and initialise a mutex.
+extern mutex_t *create_mutex();
+
+/// Free a mutex from create_mutex. It must not be held.
+extern void delete_mutex(mutex_t *m);
+
+/// Acquire the mutex. Not for use with interrupts disabled.
+extern void mutex_lock(mutex_t *m) ACQUIRE(m) NO_THREAD_SAFETY_ANALYSIS;
+
+/// Acquire the mutex if that can be done without waiting. Returns nonzero if
+/// it was acquired.
+extern int mutex_trylock(mutex_t *m) TRY_ACQUIRE(1, m) NO_THREAD_SAFETY_ANALYSIS;
+
+/// Release the mutex. Only the holder may do this.
+extern void mutex_unlock(mutex_t *m) RELEASE(m) NO_THREAD_SAFETY_ANALYSIS;
+
+struct thread;
+
+/// Moves a thread's own priority a step towards target, keeping any priority
+/// it has inherited. For the scheduler's dynamic priority adjustment.
+extern void mutex_pi_decay(struct thread *thr, uint32_t target);
+
+#endif
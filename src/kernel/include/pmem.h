@@ -22,6 +22,8 @@
 #define PMEM_SPECIAL_STANDARD       0
 #define PMEM_SPECIAL_FIRMWARE       1 // eg, < 1 MB on x86
 
+#define PMEM_ZONE_COUNT             2
+
 /// Initialise the physical memory allocator
 #define pmem_init		mach_phys_init
 
@@ -31,8 +33,18 @@
 /// Allocate a single page from the physical allocator.
 extern paddr_t	pmem_alloc();
 
-/// Allocate a page from a special region. Must be implemented by an
-/// architecture or machine - simply return pmem_alloc if no special regions.
+/// Allocate a single page, preferring one cleared in advance by the zeroing
+/// thread. *zeroed is set if the page is known to be zero-filled; otherwise
+/// the caller must clear it, usually through the mapping it's about to create
+/// anyway. Returns zero on failure.
+extern paddr_t	pmem_alloc_zeroed(int *zeroed);
+
+/// Allocate 2^order physically contiguous pages, aligned to their size
+/// relative to the base of the standard zone. Returns zero on failure.
+extern paddr_t	pmem_alloc_contig(size_t order);
+
+/// Allocate a page from a special region. Returns zero if the machine did not
+/// set up the region or it is exhausted.
 extern paddr_t pmem_alloc_special(size_t how);
 
 /// Deallocate a page from a special region.
@@ -41,6 +53,29 @@ extern void pmem_dealloc_special(size_t how, paddr_t p);
 /// Deallocate a single page, returning it to the physical allocator.
 extern void		pmem_dealloc(paddr_t p);
 
+/// Deallocate a run of pages allocated with pmem_alloc_contig.
+extern void		pmem_dealloc_contig(paddr_t p, size_t order);
+
+/// Return a range of pages to the physical allocator in one go.
+extern void		pmem_dealloc_range(paddr_t p, size_t pages);
+
+/// Bytes of metadata needed for a zone covering the given number of pages.
+extern size_t	pmem_zone_metasize(size_t pages);
+
+/// Set up a zone (PMEM_SPECIAL_*) covering [base, base + pages * PAGE_SIZE).
+/// The metadata must be mapped, pmem_zone_metasize(pages) bytes long, and
+/// stay in place forever. All pages in the zone begin allocated - the
+/// machine frees usable memory with pmem_dealloc_range/pmem_dealloc_special.
+extern void		pmem_zone_init(size_t how, paddr_t base, size_t pages, void *meta);
+
+/// Thread that keeps a pool of zero-filled pages for pmem_alloc_zeroed. Runs
+/// at low priority so pages are cleared in idle time.
+extern void		pmem_zero_thread(void *p);
+
+/// Clear a page that isn't mapped anywhere, through a window of this CPU's.
+/// Returns -1 if that can't be done yet (before pmem_zero_thread starts).
+extern int		pmem_zero_page(paddr_t p);
+
 /// Pin a particular physical page, making it impossible to allocate.
 extern void		pmem_pin(paddr_t p);
 
@@ -54,9 +89,4 @@ extern paddr_t	pmem_size();
 // Free physical memory, available to be allocated in KiB.
 extern paddr_t	pmem_freek();
 
-/// Structure defining a physical address.
-struct phys_page {
-    paddr_t addr;
-};
-
 #endif
@@ -30,9 +30,19 @@ extern void *create_pool(size_t buffsz, size_t buffcnt);
  */
 extern void *create_pool_at(size_t buffsz, size_t buffcnt, uintptr_t addr);
 
+/**
+ * Creates a new memory pool at a particular memory address, whose buffers are
+ * only committed as they're touched. The first guard bytes of each buffer are
+ * never mapped, and allocations return the address just above them.
+ */
+extern void *create_pool_reserved(size_t buffsz, size_t buffcnt, uintptr_t addr, size_t guard);
+
 /** Allocates a buffer from a pool. */
 extern void *pool_alloc(void *pool);
 
+/** Allocates a zero-filled buffer from a pool. */
+extern void *pool_alloc_zeroed(void *pool);
+
 /** Returns a given buffer to a pool. */
 extern void pool_dealloc(void *pool, void *p);
 
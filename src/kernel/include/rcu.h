@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _RCU_H
+#define _RCU_H
+
+#include <types.h>
+
+struct rcu_head;
+
+typedef void (*rcu_callback_t)(struct rcu_head *h);
+
+/**
+ * Embedded in an object whose freeing is deferred with call_rcu. Kept apart
+ * from the fields readers follow, which must stay intact until the callback.
+ */
+struct rcu_head {
+    struct rcu_head *next;
+    rcu_callback_t func;
+
+    /// Epoch at the time the object was retired.
+    uint32_t epoch;
+};
+
+/**
+ * Enter a read-side critical section. Objects reached inside it are not freed
+ * until it ends. Disables interrupts (so pre-emption) as a side-effect, so
+ * keep it short and never sleep inside. May be nested.
+ */
+extern void rcu_read_lock();
+
+/**
+ * Leave a read-side critical section.
+ */
+extern void rcu_read_unlock();
+
+/**
+ * Run func once every CPU has passed through a quiescent state, at which
+ * point no reader can still hold a reference to the object. The object must
+ * already be unreachable for new readers. Callbacks run with interrupts
+ * disabled from the scheduler on the CPU which queued them.
+ */
+extern void call_rcu(struct rcu_head *h, rcu_callback_t func);
+
+/**
+ * Report a quiescent state for this CPU (ie, it holds no references from a
+ * read-side critical section), and run any callbacks that are now safe.
+ * Called from the scheduler on every reschedule, with interrupts disabled.
+ */
+extern void rcu_quiescent();
+
+/**
+ * Register the current CPU with RCU. Called as each CPU comes alive.
+ */
+extern void rcu_cpu_init();
+
+#endif
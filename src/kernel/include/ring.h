@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _RING_H
+#define _RING_H
+
+#ifndef _UNIT_TESTING
+#include <types.h>
+#endif
+
+/// Only one CPU (or thread) ever pushes to the ring.
+#define RING_SP         1
+
+/// Only one CPU (or thread) ever pops from the ring.
+#define RING_SC         2
+
+#define RING_MPMC       0
+#define RING_MPSC       RING_SC
+#define RING_SPSC       (RING_SP | RING_SC)
+
+/**
+ * Create a bounded ring of fixed-size elements. The capacity is rounded up to
+ * a power of two. Pushing and popping never allocate or take locks, so they
+ * are safe in interrupt handlers - except on a single-producer (or consumer)
+ * ring that is also pushed to (or popped from) by an interrupt handler on the
+ * same CPU.
+ */
+extern void *create_ring(size_t capacity, size_t elemsz, uint32_t flags);
+
+/// Destroy a ring. Nothing may be using it.
+extern void delete_ring(void *ring);
+
+/// Copy an element into the ring. Returns zero on success, or -1 if full.
+extern int ring_push(void *ring, const void *elem);
+
+/// Copy the oldest element out of the ring. Returns zero on success, or -1 if
+/// the ring is empty.
+extern int ring_pop(void *ring, void *elem);
+
+/// Push up to n consecutive elements, as one contiguous run. Returns how many
+/// fit.
+extern size_t ring_push_batch(void *ring, const void *elems, size_t n);
+
+/// Pop up to n elements. Returns how many were popped.
+extern size_t ring_pop_batch(void *ring, void *elems, size_t n);
+
+/// Number of elements in the ring. Only a hint if it is in use elsewhere.
+extern size_t ring_count(void *ring);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _RWLOCK_H
+#define _RWLOCK_H
+
+#include "annotate.h"
+#include <types.h>
+
+typedef void *rwlock_t CAPABILITY("rwlock");
+
+/// Spins, with interrupts disabled, like a spinlock.
+#define RWLOCK_SPIN         0
+
+/// Sleeps on contention. Not for use with interrupts disabled.
+#define RWLOCK_SLEEP        1
+
+/**
+ * Create a reader-writer lock. Readers count themselves in per-CPU slots, so
+ * they don't contend with each other on a single cache line. Writers are
+ * preferred: once one is waiting, new readers hold off until it's done. Read
+ * locks are not recursive.
+ */
+extern rwlock_t create_rwlock(int how);
+
+/**
+ * Destroy a reader-writer lock.
+ */
+extern void delete_rwlock(rwlock_t l);
+
+/**
+ * Acquire the lock for reading. Blocks while a writer holds or is waiting for
+ * it. Spinning locks disable interrupts as a side-effect.
+ */
+extern void rwlock_read_acquire(rwlock_t l) ACQUIRE_SHARED(l) NO_THREAD_SAFETY_ANALYSIS;
+
+/**
+ * Release a read lock.
+ */
+extern void rwlock_read_release(rwlock_t l) RELEASE_SHARED(l) NO_THREAD_SAFETY_ANALYSIS;
+
+/**
+ * Acquire the lock for writing, once every reader has left.
+ */
+extern void rwlock_write_acquire(rwlock_t l) ACQUIRE(l) NO_THREAD_SAFETY_ANALYSIS;
+
+/**
+ * Release a write lock.
+ */
+extern void rwlock_write_release(rwlock_t l) RELEASE(l) NO_THREAD_SAFETY_ANALYSIS;
+
+#endif
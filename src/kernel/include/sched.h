@@ -52,6 +52,9 @@ typedef void context_t;
 
 typedef void (*thread_entry_t)(void*);
 
+/// Per-CPU run queue (opaque outside of the scheduler).
+struct runqueue;
+
 struct thread {
     context_t *ctx;
 
@@ -72,20 +75,67 @@ struct thread {
     /// Is this the idle thread?
     uint8_t isidle;
 
+    /**
+     * Set while a CPU is running on the thread's stack. The thread is queued
+     * before its context is saved, so this is only cleared once the CPU that
+     * switched away from it has moved onto the next thread's stack.
+     */
+    volatile int oncpu;
+
+    /**
+     * Run queue of the CPU this thread last ran on. Used as a hint when the
+     * thread is woken so it can return to a CPU with a warm cache.
+     */
+    struct runqueue *rq;
+
+    /// Run queue the thread is waiting on while ready, and the priority level
+    /// it was queued at, so its priority can be changed in place.
+    struct runqueue *queued_rq;
+    uint32_t queued_level;
+
+    /// Links for the run queue or wait queue the thread is on (at most one).
+    struct thread *qnext, *qprev;
+
+    /// Mutexes held that have sleepers, whose waiters lend the thread their
+    /// priority, and the priority it goes back to once none outrank it
+    /// (valid while pi_boosted). Guarded by the mutex code.
+    struct mutex *pi_held;
+    uint32_t pi_base;
+    int pi_boosted;
+
     struct process *parent;
 };
 
+/**
+ * FIFO of threads, linked through the threads themselves so queueing never
+ * allocates. Not synchronised - the owner provides locking.
+ */
+struct thread_list {
+    struct thread *head;
+    struct thread *tail;
+};
+
+#define THREAD_LIST_INIT        {0, 0}
+
+#define thread_list_empty(l)    ((l)->head == 0)
+
 /** A process. */
 struct process {
     char name[PROCESS_NAME_MAX];
 
     struct process *next;
 
+    /// Parent process, or zero for the root process.
+    struct process *parent;
+
     void *child_list;
     void *thread_list;
 
     /// Process ID.
     size_t pid;
+
+    /// Address space, from vmem_create. Zero is the kernel's own.
+    vaddr_t vmem;
 };
 
 /** Creates a process and returns a pointer to it. */
@@ -103,8 +153,11 @@ extern void switch_context(context_t *oldctx, context_t *newctx, unative_t wasin
 /** Saves the given thread's context. Returns zero when restored from the saved context. */
 extern __returns_twice int save_thread_context(context_t *ctx);
 
-/** Restores the given thread's context. */
-extern __noreturn int restore_thread_context(context_t *ctx, void *lock);
+/**
+ * Restores the given thread's context. Once off the old stack, the lock atom is
+ * released and the old thread's oncpu flag is cleared (either may be NULL).
+ */
+extern __noreturn int restore_thread_context(context_t *ctx, void *lock, volatile int *oncpu);
 
 /** Creates a new context (archictecture-specific). */
 extern void create_context(context_t *ctx, thread_entry_t start, uintptr_t stack, size_t stacksz, void *param);
@@ -124,12 +177,36 @@ extern void thread_kill() __noreturn;
 /** Puts the current thread to sleep (MUST be woken, no time for this one). */
 extern void thread_sleep();
 
+/**
+ * Adds the current thread to the given list in the given state and switches
+ * away from it. The caller holds the lock protecting the list, which is only
+ * released once the thread is switched out - so it can't be woken (or freed)
+ * before its context has been saved. Returns with the lock released and the
+ * interrupt state from before the lock was acquired.
+ */
+extern void thread_block(struct thread_list *list, uint32_t state, void *lock);
+
+/** Appends a thread to a thread list. */
+extern void thread_list_push(struct thread_list *list, struct thread *thr);
+
+/** Removes and returns the first thread in a thread list, or NULL. */
+extern struct thread *thread_list_pop(struct thread_list *list);
+
+/** Removes the given thread from a thread list it is on. */
+extern void thread_list_remove(struct thread_list *list, struct thread *thr);
+
 /** Wakes up a thread (threads begin in the SLEEPING state). */
 extern void thread_wake(struct thread *thr);
 
 /** Reads the current priority of a thread. Pass NULL for the current thread. */
 extern uint32_t thread_priority(struct thread *prio);
 
+/**
+ * Changes the current priority of a thread, moving it within its run queue if
+ * it is waiting to run. Used for priority inheritance.
+ */
+extern void thread_set_priority(struct thread *thr, uint32_t prio);
+
 /** Performs a reschedule. */
 extern void reschedule();
 
@@ -145,6 +222,12 @@ extern struct thread *sched_current_thread();
 /** Yields the current timeslice immediately. */
 extern void sched_yield();
 
+/**
+ * Halts the calling CPU until there may be something for it to do, stopping
+ * its periodic tick if nothing is runnable. Only for use by the idle thread.
+ */
+extern void sched_idle();
+
 /** Defines the thread which is the 'idle' thread in the system. */
 extern void sched_setidle(struct thread *t);
 
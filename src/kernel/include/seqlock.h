@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _SEQLOCK_H
+#define _SEQLOCK_H
+
+#include "annotate.h"
+#include <types.h>
+#include <compiler.h>
+#include <spinlock.h>
+
+/**
+ * Sequence lock, for small, frequently read data. Readers take no lock at
+ * all: they read the data, then retry if a writer was active meanwhile. Data
+ * readers can see half-written must not be followed through pointers.
+ */
+typedef struct CAPABILITY("seqlock") seqlock {
+    /// Odd while a write is in progress.
+    volatile uint32_t seq;
+
+    /// Serialises writers.
+    spinlock_t lock;
+    char lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+} seqlock_t;
+
+/// Initialise a sequence lock (no memory allocation is required).
+extern void seqlock_init(seqlock_t *s);
+
+/// Begin a write. Disables interrupts as a side-effect.
+extern void seqlock_write_begin(seqlock_t *s) ACQUIRE(s) NO_THREAD_SAFETY_ANALYSIS;
+
+/// End a write.
+extern void seqlock_write_end(seqlock_t *s) RELEASE(s) NO_THREAD_SAFETY_ANALYSIS;
+
+/// Begin a read. Waits for any write in progress to finish.
+static inline uint32_t seqlock_read_begin(const seqlock_t *s) {
+    uint32_t seq;
+    while((seq = s->seq) & 1)
+        ;
+
+    __barrier;
+    return seq;
+}
+
+/// Returns nonzero if the data read since seqlock_read_begin may be torn, and
+/// the read must be retried.
+static inline int seqlock_read_retry(const seqlock_t *s, uint32_t seq) {
+    __barrier;
+    return s->seq != seq;
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <types.h>
+#include <system.h>
+
+/// Largest allocation served by the slab allocator - bigger requests go to
+/// dlmalloc.
+#define SLAB_MAX_OBJECT     1024
+
+/// Maximum number of object caches, including the malloc size classes.
+#define KMEM_MAX_CACHES     32
+
+#define KMEM_NAME_MAX       24
+
+/// Alignment to ask for to keep objects on their own cache lines.
+#define KMEM_CACHE_LINE     64
+
+struct kmem_cache;
+
+/// Called once for each object when its slab is created. Objects must be in
+/// their constructed state when freed back to the cache.
+typedef void (*kmem_ctor_t)(void *obj);
+
+struct kmem_cache_stats {
+    const char *name;
+    size_t size;
+    size_t stride;
+    size_t perslab;
+
+    size_t allocs;
+    size_t frees;
+
+    /// Free objects held in per-CPU magazines.
+    size_t cached;
+    size_t slabs;
+};
+
+/// Whether the given pointer was handed out by the slab allocator.
+#define slab_owns(p)        ((((uintptr_t) (p)) >= SLAB_BASE) && \
+                             (((uintptr_t) (p)) < (SLAB_BASE + SLAB_LENGTH)))
+
+/// Create a cache of objects of the given size. An alignment of zero means
+/// pointer alignment. Returns null if there are no free cache slots.
+extern struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, kmem_ctor_t ctor);
+
+/// Destroy a cache. It must never have had objects allocated from it.
+extern void kmem_cache_destroy(struct kmem_cache *c);
+
+/// Get the cache in *cachep, creating it on first use. Safe for callers that
+/// race to create the same cache.
+extern struct kmem_cache *kmem_cache_get(struct kmem_cache **cachep, const char *name, size_t size, size_t align, kmem_ctor_t ctor);
+
+/// Allocate an object from the cache, or null if memory is exhausted.
+extern void *kmem_cache_alloc(struct kmem_cache *c);
+
+/// Return an object to the cache it came from. free() also works.
+extern void kmem_cache_free(struct kmem_cache *c, void *p);
+
+/// Get a snapshot of a cache's statistics.
+extern void kmem_cache_stats(struct kmem_cache *c, struct kmem_cache_stats *st);
+
+/// Print statistics for every cache.
+extern void kmem_cache_dump();
+
+/// Enable the slab allocator. Until this is called, slab_alloc fails.
+extern void slab_init();
+
+/// Allocate a small object. Returns null if the size is too large, the
+/// allocator isn't ready yet, or memory is exhausted.
+extern void *slab_alloc(size_t sz);
+
+/// Free an object allocated by slab_alloc.
+extern void slab_free(void *p);
+
+/// Usable size of an object allocated by slab_alloc.
+extern size_t slab_size(void *p);
+
+#endif
@@ -22,6 +22,12 @@
 /// Sleep for the given number of milliseconds.
 extern void sleep_ms(uint32_t ms);
 
+/// Sleep for the given number of nanoseconds (at least microsecond granularity).
+extern void sleep_ns(uint64_t ns);
+
+/// Sleep until clock_now_ns() reaches the given deadline.
+extern void sleep_until(uint64_t deadline);
+
 /// Delay for the given number of microseconds. Machine layer implements this.
 extern void sleep_micro(uint32_t micro);
 
@@ -18,16 +18,70 @@
 #define _SPINLOCK_H
 
 #include "annotate.h"
+#include <types.h>
 
 typedef void *spinlock_t CAPABILITY("mutex");
 
+// Debug builds keep contention statistics for every lock.
+#ifdef DEBUG
+#define SPINLOCK_STATS
+#endif
+
+/// Locks get a cache line to themselves, so that spinning on one doesn't
+/// bounce whatever data happens to sit next to it.
+#define SPINLOCK_ALIGN      64
+
+/// Space create_spinlock_at needs.
+#ifdef SPINLOCK_STATS
+#define SPINLOCK_SIZE       (SPINLOCK_ALIGN * 2)
+#else
+#define SPINLOCK_SIZE       SPINLOCK_ALIGN
+#endif
+
+/// Contention statistics for one lock.
+struct lockstat {
+    const char *name;
+
+    uint64_t acquisitions;
+
+    /// Acquisitions that had to wait, and the polls they made while waiting.
+    uint64_t contended;
+    uint64_t spins;
+
+    /// Longest hold, in raw CPU cycles.
+    uint64_t max_hold_cycles;
+
+    struct lockstat *next;
+};
+
+/**
+ * A queued (MCS) lock. Waiters queue up and each spins on its own node, so a
+ * handoff costs one cache line transfer however many CPUs are waiting. For
+ * heavily contended locks that are released by the CPU that took them.
+ */
+struct mcs_node {
+    struct mcs_node *next;
+    uint32_t locked;
+    uint8_t wasints;
+};
+
+struct mcs_lock {
+    struct mcs_node *tail;
+#ifdef SPINLOCK_STATS
+    uint64_t acquired_at;
+    struct lockstat stats;
+#endif
+} __aligned(SPINLOCK_ALIGN);
+
 /**
  * Create a spinlock.
  */
 extern spinlock_t create_spinlock();
 
 /**
- * Create a spinlock in the given buffer. Useful if memory allocation is not yet available.
+ * Create a spinlock in the given buffer, which must be at least SPINLOCK_SIZE
+ * bytes (and ideally SPINLOCK_ALIGN-aligned). Useful if memory allocation is
+ * not yet available.
  */
 extern spinlock_t create_spinlock_at(void *static_region, size_t static_region_size);
 
@@ -37,7 +91,8 @@ extern spinlock_t create_spinlock_at(void *static_region, size_t static_region_s
 extern void delete_spinlock(spinlock_t s);
 
 /**
- * Get a pointer to the spinlock's atomic state (ie, the 'locked'/'unlocked' state.
+ * Get a pointer to the spinlock's atomic state. Incrementing it releases the
+ * lock, which is how a context switch drops a lock on the new thread's stack.
  */
 extern void *spinlock_getatom(spinlock_t s);
 
@@ -59,4 +114,51 @@ extern void spinlock_acquire(spinlock_t s) ACQUIRE(s) NO_THREAD_SAFETY_ANALYSIS;
  */
 extern void spinlock_release(spinlock_t s) RELEASE(s) NO_THREAD_SAFETY_ANALYSIS;
 
+/**
+ * Releases the lock, leaving interrupts as they are.
+ */
+extern void spinlock_release_atom(spinlock_t s) RELEASE(s) NO_THREAD_SAFETY_ANALYSIS;
+
+/**
+ * Acquire a queued lock, using the given node (which must stay valid until the
+ * lock is released, so usually lives on the stack). Disables interrupts.
+ */
+extern void mcs_acquire(struct mcs_lock *l, struct mcs_node *node) NO_THREAD_SAFETY_ANALYSIS;
+
+/**
+ * Releases a queued lock, passing it to the next waiter if there is one.
+ */
+extern void mcs_release(struct mcs_lock *l, struct mcs_node *node) NO_THREAD_SAFETY_ANALYSIS;
+
+/**
+ * One poll of a spin loop. Gives the architecture a look in through
+ * arch_spin_poll, as the spinner may have interrupts disabled.
+ */
+extern void spinlock_poll();
+
+/**
+ * Architecture work for a spinning CPU that may have interrupts disabled (on
+ * x86, serving TLB shootdowns whose IPI can't get in). Must be cheap when
+ * there is nothing to do.
+ */
+extern void arch_spin_poll();
+
+/**
+ * Names a lock and adds it to the list spinlock_report prints. Does nothing
+ * unless SPINLOCK_STATS is defined.
+ */
+extern void spinlock_track(spinlock_t s, const char *name);
+extern void mcs_track(struct mcs_lock *l, const char *name);
+
+/**
+ * Gets a copy of the statistics for a lock. Returns -1 if statistics aren't
+ * kept in this build.
+ */
+extern int spinlock_stats(spinlock_t s, struct lockstat *out);
+
+/**
+ * Prints statistics for every tracked lock to the debug log.
+ */
+extern void spinlock_report();
+
 #endif
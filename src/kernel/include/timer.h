@@ -52,6 +52,13 @@ struct timer_table_entry {
 #define TIMERFEAT_COUNTS		0x8 // counts ticks
 #define TIMERFEAT_PERCPU		0x10
 
+/// Handler feature only: the handler need not fire while its CPU is idle, so
+/// it is ignored when choosing how long an idle CPU may go without ticks.
+#define TIMERFEAT_DEFERRABLE	0x20
+
+/// Returned by timer_next_deadline when there is nothing pending.
+#define TIMER_NO_DEADLINE		((uint64_t) ~0ULL)
+
 // Defines a timer.
 struct timer {
 	uint32_t timer_res;
@@ -76,6 +83,18 @@ struct timer {
 
 	/// Resume the timer.
 	void (*resume)();
+
+	/// Optional, for tickless idle: stops periodic ticks and arms the timer to
+	/// fire once, @ns nanoseconds from now. Returns the number of nanoseconds
+	/// actually programmed, as hardware limits may shorten the interval.
+	uint64_t (*oneshot)(uint64_t ns);
+
+	/// Optional, for tickless idle: cancels a oneshot() and resumes periodic
+	/// ticks, reporting the time spent without ticks via timer_ticked.
+	void (*periodic)();
+
+	/// Handlers installed on this timer. Set by the API automatically.
+	void *wheel;
 };
 
 /**
@@ -133,4 +152,39 @@ extern int install_timer(timer_handler th, uint32_t ticks, uint32_t feat);
  */
 extern void remove_timer(timer_handler th);
 
+/**
+ * \brief Gets a monotonic count of nanoseconds since timers were initialised.
+ *
+ * Advanced by the first global periodic timer registered, so this is only as
+ * precise as that timer's resolution. Safe to call from any CPU.
+ */
+extern uint64_t timer_monotonic_ns();
+
+/**
+ * \brief Gets the time until the next handler on the given timer must run.
+ *
+ * Handlers installed with TIMERFEAT_DEFERRABLE are ignored.
+ *
+ * \return nanoseconds until the nearest deadline, or TIMER_NO_DEADLINE.
+ */
+extern uint64_t timer_next_deadline(struct timer *tim);
+
+/**
+ * \brief Stops the periodic tick of the calling CPU's timer.
+ *
+ * The timer is instead armed to fire once, at the nearest deadline returned
+ * by timer_next_deadline. Must be called with interrupts disabled.
+ *
+ * \return zero if this CPU's timer cannot run tickless, non-zero otherwise.
+ */
+extern int timer_tick_stop();
+
+/**
+ * \brief Restarts the periodic tick of the calling CPU's timer.
+ *
+ * Does nothing if the tick was not stopped by timer_tick_stop. Must be called
+ * with interrupts disabled.
+ */
+extern void timer_tick_restart();
+
 #endif
@@ -31,10 +31,20 @@ typedef int (*tree_comparer)(void *, void *);
 #define memset __builtin_memset
 #define memcpy __builtin_memcpy
 #else
-extern void memset(void *p, int c, size_t len);
+extern void *memset(void *p, int c, size_t len);
 extern void *memcpy(void *dst, void *src, size_t len);
 #endif
 
+#ifdef X86
+/// Architecture fill and copy for larger buffers, used by memset and memcpy.
+extern void *arch_memset(void *dst, int c, size_t len);
+extern void *arch_memcpy(void *dst, const void *src, size_t len);
+
+/// Fill that bypasses the cache where it can, for memory that won't be read
+/// again soon (eg, pages zeroed ahead of time).
+extern void *arch_memset_stream(void *dst, int c, size_t len);
+#endif
+
 extern int memcmp(const void *a, const void *b, size_t len);
 
 extern void *create_stack();
@@ -39,6 +39,22 @@
 /// Unmaps a single page.
 #define vmem_unmap		arch_vmem_unmap
 
+/// Maps a run of pages, to consecutive physical pages or (if the physical
+/// address is ~0) to newly allocated ones. Invalidates at most once.
+#define vmem_map_range	arch_vmem_map_range
+
+/// Unmaps a run of pages with a single TLB shootdown, optionally returning
+/// the physical pages to the allocator once no CPU can reach them.
+#define vmem_unmap_range	arch_vmem_unmap_range
+
+/// Unmaps a page, invalidating only this CPU's TLB. Only for mappings that
+/// are used by one CPU at a time, with interrupts disabled throughout.
+#define vmem_unmap_local	arch_vmem_unmap_local
+
+/// Handles TLB invalidations queued for this CPU by others. Called from the
+/// machine's shootdown IPI handler.
+#define vmem_shootdown_recv	arch_vmem_shootdown_recv
+
 /// Gets a physical address from a virtual address in the current address space.
 #define vmem_v2p        arch_vmem_v2p
 
@@ -51,6 +67,10 @@
 /// Creates a new address space context.
 #define vmem_create		arch_vmem_create
 
+/// Frees an address space from vmem_create, and the paging structures in its
+/// user half. No CPU may be in it.
+#define vmem_destroy	arch_vmem_destroy
+
 /// Switches to a new address space.
 #define vmem_switch		arch_vmem_switch
 
@@ -70,10 +90,15 @@
 
 extern int arch_vmem_map(vaddr_t, paddr_t, size_t);
 extern void arch_vmem_unmap(vaddr_t);
+extern int arch_vmem_map_range(vaddr_t, paddr_t, size_t, size_t);
+extern void arch_vmem_unmap_range(vaddr_t, size_t, int);
+extern void arch_vmem_unmap_local(vaddr_t);
+extern void arch_vmem_shootdown_recv();
 extern int arch_vmem_modify(vaddr_t, size_t);
 extern int arch_vmem_ismapped(vaddr_t);
 extern paddr_t arch_vmem_v2p(vaddr_t);
 extern vaddr_t arch_vmem_create();
+extern void arch_vmem_destroy(vaddr_t);
 extern void arch_vmem_switch(vaddr_t);
 extern void arch_vmem_init();
 extern void arch_vmem_final_init();
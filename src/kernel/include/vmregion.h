@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef _VMREGION_H
+#define _VMREGION_H
+
+#include <types.h>
+
+/**
+ * A reserved range of virtual memory, committed a page at a time as it is
+ * first touched. The caller owns the structure and it must live forever.
+ */
+struct vm_region {
+    vaddr_t base;
+
+    /// End of the region. May be moved while the region is live.
+    volatile vaddr_t end;
+
+    /// If nonzero, the region is a run of slots this many bytes apart...
+    size_t stride;
+
+    /// ... and this many bytes at the bottom of each slot are guard pages,
+    /// which are never committed.
+    size_t guard;
+
+    /// vmem flags for committed pages.
+    size_t flags;
+
+    struct vm_region *next;
+};
+
+/** Adds a region. Its pages are mapped, zero-filled, on first access. */
+extern void vmregion_add(struct vm_region *r);
+
+/**
+ * Called by the architecture once page faults can be handled. Until then,
+ * reserved memory has to be committed up front.
+ */
+extern void vmregion_enable();
+
+/** Can pages be committed on first touch yet? */
+extern int vmregion_ready();
+
+/**
+ * Handles a fault on a page that is not present. Returns 0 if the page is
+ * now mapped, or -1 if the address isn't reserved or is a guard page.
+ */
+extern int vmregion_fault(vaddr_t v);
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _WAITQUEUE_H
+#define _WAITQUEUE_H
+
+#include <types.h>
+#include <sched.h>
+#include <spinlock.h>
+
+/**
+ * Queue of threads blocked waiting for something. Threads are linked through
+ * struct thread, so waiting and waking never allocate memory.
+ */
+typedef struct wait_queue {
+    struct thread_list waiters;
+
+    void *lock;
+    char lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+} wait_queue_t;
+
+/// Initialise a wait queue (no memory allocation is required).
+extern void wait_queue_init(wait_queue_t *wq);
+
+/// Acquire the wait queue's lock, to check a condition before waiting.
+extern void wait_queue_lock(wait_queue_t *wq);
+
+/// Release the wait queue's lock.
+extern void wait_queue_unlock(wait_queue_t *wq);
+
+/**
+ * Put the current thread to sleep on the wait queue. Must be called with the
+ * lock held: it is released once the thread is asleep, so a wakeup issued
+ * after the caller checked its condition can't be lost. Returns unlocked.
+ */
+extern void wait_queue_sleep_locked(wait_queue_t *wq);
+
+/// Put the current thread to sleep on the wait queue.
+extern void wait_queue_sleep(wait_queue_t *wq);
+
+/// Wake the longest waiting thread, if any. Lock must be held.
+extern int wait_queue_wake_one_locked(wait_queue_t *wq);
+
+/// Wake every waiting thread. Lock must be held. Returns the number woken.
+extern size_t wait_queue_wake_all_locked(wait_queue_t *wq);
+
+/// Wake the longest waiting thread, if any. Returns nonzero if one was woken.
+extern int wait_queue_wake_one(wait_queue_t *wq);
+
+/// Wake every waiting thread. Returns the number woken.
+extern size_t wait_queue_wake_all(wait_queue_t *wq);
+
+#endif
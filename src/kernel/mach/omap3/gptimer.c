@@ -142,14 +142,10 @@ int init_omap3_gptimer(size_t n, inthandler_t irqhandler) {
 
 #define DEFINE_OMAP3_GPTIMER(n) \
     static struct timer gp##n = { \
-        ((1 << TIMERRES_SHIFT) | TIMERRES_MILLI), \
-        TIMERFEAT_PERIODIC, \
-        "General Purpose Timer #" #n, \
-        init_omap3_gp##n, \
-        0, \
-        0, \
-        0, \
-        0 \
+        .timer_res = ((1 << TIMERRES_SHIFT) | TIMERRES_MILLI), \
+        .timer_feat = TIMERFEAT_PERIODIC, \
+        .name = "General Purpose Timer #" #n, \
+        .timer_init = init_omap3_gp##n, \
     }; \
     EXPORT_TIMER(gptimer##n, gp##n);
 
@@ -21,6 +21,8 @@
 
 #define KERNEL_BASE		0xC0000000UL
 #define HEAP_BASE		0x60000000UL
+#define SLAB_BASE		0x70000000UL // Heap ends here.
+#define SLAB_LENGTH		0x10000000UL
 #define POOL_BASE       0xB0000000UL
 #define MMIO_BASE       0xD0000000UL
 #define STACK_TOP		0xFFC00000UL
@@ -44,6 +46,10 @@
 
 #define PAGE_SIZE		0x1000UL
 
+/// Section size, and its size as a pmem_alloc_contig order.
+#define LARGE_PAGE_SIZE		0x100000UL
+#define LARGE_PAGE_ORDER	8
+
 /// Mask to be applied against a paddr_t to get a full physical address.
 #define PADDR_MASK      0xFFFFFFFFUL
 
@@ -18,6 +18,7 @@
 #include <kboot.h>
 #include <system.h>
 #include <panic.h>
+#include <assert.h>
 #include <pmem.h>
 #include <io.h>
 
@@ -25,21 +26,33 @@ extern int init, end;
 
 static paddr_t totalKiB = 0;
 
+#define RAM_PAGES       ((RAM_FINISH - RAM_START) / PAGE_SIZE)
+
+/// RAM size is fixed on this board, so the bitmap can just live in .bss.
+static uint32_t ram_meta[(RAM_PAGES / 32) + (RAM_PAGES / 1024) + 1];
+
 paddr_t pmem_size() {
     return totalKiB;
 }
 
 int mach_phys_init(phys_ptr_t tags __unused) {
-	unative_t kernel_start = (unative_t) &init;
-	unative_t kernel_end = (unative_t) &end;
+	unative_t kernel_start = (unative_t) &init & ~(PAGE_SIZE - 1);
+	unative_t kernel_end = ((unative_t) &end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    assert(sizeof(ram_meta) >= pmem_zone_metasize(RAM_PAGES));
+    pmem_zone_init(PMEM_SPECIAL_STANDARD, RAM_START, RAM_PAGES, ram_meta);
 
-	size_t n = 0; unative_t base = 0;
-	for(base = RAM_START; base < RAM_FINISH; base += 0x1000) {
-	    if((base < kernel_end) && (base > kernel_start))
-	        continue;
-        pmem_dealloc(base);
-        n++;
-    }
+    // Free everything except the kernel and the MMU's page directory/tables.
+    size_t n = 0;
+    n += (kernel_start - RAM_START) / PAGE_SIZE;
+    pmem_dealloc_range(RAM_START, n);
+
+    n += (PAGEDIR_PHYS - kernel_end) / PAGE_SIZE;
+    pmem_dealloc_range(kernel_end, (PAGEDIR_PHYS - kernel_end) / PAGE_SIZE);
+
+    unative_t tabs_end = PAGETABS_PHYS + 0x400000UL;
+    n += (RAM_FINISH - tabs_end) / PAGE_SIZE;
+    pmem_dealloc_range(tabs_end, (RAM_FINISH - tabs_end) / PAGE_SIZE);
 
     totalKiB = (n * PAGE_SIZE) / 1024;
 
@@ -51,4 +64,3 @@ int mach_phys_init(phys_ptr_t tags __unused) {
 int mach_phys_deinit() {
 	return 0;
 }
-
@@ -21,6 +21,7 @@
 #include <timer.h>
 #include <vmem.h>
 #include <mmiopool.h>
+#include <clock.h>
 
 #define SYNCTIMER_PHYS  0x48320000
 
@@ -42,14 +43,27 @@ uint64_t omap3_synctimer_ticks() {
 }
 
 static struct timer t = {
-    ((32 << TIMERRES_SHIFT) | TIMERRES_MICRO),
-    TIMERFEAT_COUNTS,
-    "32kHZ Sync Timer",
-    init_omap3_synctimer,
-    0,
-    omap3_synctimer_ticks,
-    0,
-    0
+    .timer_res = ((32 << TIMERRES_SHIFT) | TIMERRES_MICRO),
+    .timer_feat = TIMERFEAT_COUNTS,
+    .name = "32kHZ Sync Timer",
+    .timer_init = init_omap3_synctimer,
+    .timer_ticks = omap3_synctimer_ticks,
 };
 
 EXPORT_TIMER(omap3synctimer, t);
+
+static int omap3_synctimer_clock_init(struct clocksource *cs __unused) {
+    // The timer layer maps the registers in.
+    return synctimer ? 0 : -1;
+}
+
+static struct clocksource cs = {
+    "32kHz Sync Timer",
+    100,
+    32768,
+    0xFFFFFFFFULL,
+    omap3_synctimer_clock_init,
+    omap3_synctimer_ticks
+};
+
+EXPORT_CLOCKSOURCE(omap3synctimer, cs);
@@ -20,7 +20,9 @@
 #include <spinlock.h>
 #include <interrupts.h>
 #include <semaphore.h>
+#include <mutex.h>
 #include <mmiopool.h>
+#include <clock.h>
 #include <compiler.h>
 #include <stdarg.h>
 #include <malloc.h>
@@ -158,24 +160,24 @@ void AcpiOsStall(UINT32 Microseconds) {
 
 ACPI_STATUS AcpiOsCreateMutex(ACPI_MUTEX *OutHandle) {
     dprintf("acpi: create mutex\n");
-    *OutHandle = create_semaphore(1, 1);
+    *OutHandle = create_mutex();
     return AE_OK;
 }
 
 void AcpiOsDeleteMutex(ACPI_MUTEX Handle) {
     dprintf("acpi: delete mutex\n");
-    delete_semaphore(Handle);
+    delete_mutex(Handle);
 }
 
 ACPI_STATUS AcpiOsAcquireMutex(ACPI_MUTEX Handle, UINT16 Timeout) {
     dprintf("acpi: acquire mutex with %d ms timeout\n", Timeout);
-    semaphore_acquire(Handle, 1);
+    mutex_lock(Handle);
     return AE_OK;
 }
 
 void AcpiOsReleaseMutex(ACPI_MUTEX Handle) {
     dprintf("acpi: release mutex\n");
-    semaphore_release(Handle, 1);
+    mutex_unlock(Handle);
 }
 
 ACPI_STATUS AcpiOsCreateSemaphore(UINT32 MaxUnits, UINT32 InitialUnits, ACPI_SEMAPHORE *OutHandle) {
@@ -354,10 +356,8 @@ ACPI_STATUS AcpiOsWritePciConfiguration(ACPI_PCI_ID *PciId, UINT32 Register, UIN
 }
 
 UINT64 AcpiOsGetTimer() {
-    dprintf("acpi: get timer\n");
-    UINT64 ret;
-    __asm__ volatile("rdtsc" : "=A" (ret));
-    return ret;
+    // ACPI wants the time in 100 ns units.
+    return clock_now_ns() / 100;
 }
 
 ACPI_STATUS AcpiOsSignal(UINT32 Function, void *Info __unused) {
@@ -133,7 +133,9 @@
 #define ACPI_CACHE_T                ACPI_MEMORY_LIST
 #define ACPI_USE_LOCAL_CACHE        1
 
-#ifdef X86
+#if defined(X86_64)
+#define ACPI_MACHINE_WIDTH          64
+#elif defined(X86)
 #define ACPI_MACHINE_WIDTH          32
 #else
 #error TODO - 64-bit support
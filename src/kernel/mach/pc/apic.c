@@ -24,6 +24,7 @@
 #include <sched.h>
 #include <multicpu.h>
 #include <spinlock.h>
+#include <ring.h>
 #include <timer.h>
 #include <io.h>
 
@@ -33,10 +34,17 @@
 
 struct lapic;
 
-static void *crosscpu_lock = 0;
+/// Calls waiting in a CPU's mailbox, and how many are run per pop.
+#define CROSSCPU_MAILBOX_SIZE   32
+#define CROSSCPU_BATCH          8
 
-static crosscpu_func_t crosscpu_func = 0;
-static void *crosscpu_param = 0;
+struct crosscpu_call {
+    crosscpu_func_t func;
+    void *param;
+};
+
+/// Set once another CPU has been started, so cross-CPU calls make sense.
+static volatile int crosscpu_ready = 0;
 
 static void *ioapic_list = 0;
 static void *proc_list = 0;
@@ -45,8 +53,15 @@ static struct lapic *lapic = 0;
 
 static uint32_t system_bus_freq = 0;
 
+/// Initial count for one periodic tick of the LAPIC timer.
+static uint32_t lapic_tick_count = 0;
+
 static void *interrupt_override = 0;
 
+/// proc_list and interrupt_override are built privately from the MADT and
+/// published once, complete. They never change after that, so they are read
+/// without locking.
+
 #define IOAPIC_IOREGSEL         0
 #define IOAPIC_IOWIN            0x10
 #define IOAPIC_MMIOSIZE         0x14
@@ -67,10 +82,19 @@ static void *interrupt_override = 0;
 #define LAPIC_TIMER             0x20
 #define LAPIC_CROSSCPU          0x21
 #define LAPIC_ETC               0x22
+#define LAPIC_RESCHED           0x23
+#define LAPIC_TLB               0x24
 
 /// Number of milliseconds between ticks of the LAPIC timer.
 #define LAPIC_TIMER_MS          1
 
+/// Longest interval a tickless CPU may go without a timer interrupt.
+#define LAPIC_TICKLESS_MAX_US   1000000
+
+#define LAPIC_TIMER_PERIODIC    0
+#define LAPIC_TIMER_ARMED       1
+#define LAPIC_TIMER_STOPPED     2
+
 #define OVERRIDE_POLARITY_CONFORMS      0
 #define OVERRIDE_POLARITY_ACTIVEHIGH    1
 #define OVERRIDE_POLARITY_ACTIVELOW     3
@@ -104,6 +128,10 @@ struct processor {
     uint8_t apic_id;
     uint8_t bsp;
     uint8_t started;
+
+    /// Cross-CPU calls for this CPU to run. Any CPU may push, only this one
+    /// pops, and nobody needs a lock.
+    void *mailbox;
 };
 
 struct lapic {
@@ -111,6 +139,20 @@ struct lapic {
     vaddr_t mmioaddr;
 };
 
+/** Per-CPU Local APIC timer, with the state needed for tickless idle. */
+struct lapic_timer {
+    struct timer tmr;
+
+    /// LAPIC_TIMER_PERIODIC, LAPIC_TIMER_ARMED or LAPIC_TIMER_STOPPED.
+    uint32_t mode;
+
+    /// Initial count of the armed one-shot.
+    uint32_t initial;
+
+    /// Counts of the periodic tick that had elapsed when the tick was stopped.
+    uint32_t carry;
+};
+
 struct ioapic {
     uint8_t acpi_id;
 
@@ -200,23 +242,131 @@ static int handle_ioapic_irq(struct intr_stack *s, void *p __unused) {
     return ret;
 }
 
-static int lapic_localint(struct intr_stack *s, void *p __unused) NO_THREAD_SAFETY_ANALYSIS {
+static struct lapic_timer *get_lapic_timer() {
+    return *((struct lapic_timer **) multicpu_percpu_at(MULTICPU_PERCPU_CPUTIMER));
+}
+
+/// Converts LAPIC timer counts (bus clock / 16) to microseconds.
+static uint32_t lapic_count_to_us(uint32_t count) {
+    return (uint32_t) ((((uint64_t) count) * 1000000) / (system_bus_freq / 16));
+}
+
+static void lapic_timer_start_periodic() {
+    write_lapic_reg(lapic->mmioaddr, 0x3E0, 0x3); // Divide clock by 16.
+    write_lapic_reg(lapic->mmioaddr, 0x320, (1 << 17) | LAPIC_TIMER); // Periodic.
+    write_lapic_reg(lapic->mmioaddr, 0x380, lapic_tick_count);
+}
+
+/// Reports time spent without periodic ticks to the timer framework.
+static int lapic_timer_report(struct lapic_timer *lt, uint32_t count) {
+    uint32_t us = lapic_count_to_us(count);
+    if(!us) {
+        return 0;
+    }
+
+    return timer_ticked(&lt->tmr, (us << TIMERRES_SHIFT) | TIMERRES_MICRO);
+}
+
+static uint64_t lapic_timer_oneshot(uint64_t ns) {
+    struct lapic_timer *lt = get_lapic_timer();
+    if(lt->mode != LAPIC_TIMER_PERIODIC) {
+        return 0;
+    }
+
+    uint64_t us = ns / 1000;
+    if(us > LAPIC_TICKLESS_MAX_US) {
+        us = LAPIC_TICKLESS_MAX_US;
+    }
+
+    uint32_t count = (uint32_t) ((us * (system_bus_freq / 16)) / 1000000);
+    if(count < 16) {
+        count = 16;
+    }
+
+    // Keep the part of the current tick that has already passed, so it can be
+    // accounted for when ticking restarts.
+    lt->carry = lapic_tick_count - read_lapic_reg(lapic->mmioaddr, 0x390);
+    lt->initial = count;
+    lt->mode = LAPIC_TIMER_ARMED;
+
+    // One-shot mode; writing the initial count starts the countdown.
+    write_lapic_reg(lapic->mmioaddr, 0x320, LAPIC_TIMER);
+    write_lapic_reg(lapic->mmioaddr, 0x380, count);
+
+    return us * 1000;
+}
+
+static void lapic_timer_periodic() {
+    struct lapic_timer *lt = get_lapic_timer();
+    if(lt->mode == LAPIC_TIMER_PERIODIC) {
+        return;
+    }
+
+    uint32_t elapsed = lt->carry;
+    if(lt->mode == LAPIC_TIMER_ARMED) {
+        elapsed += lt->initial - read_lapic_reg(lapic->mmioaddr, 0x390);
+    }
+
+    lt->carry = 0;
+    lt->mode = LAPIC_TIMER_PERIODIC;
+    lapic_timer_start_periodic();
+
+    lapic_timer_report(lt, elapsed);
+}
+
+static struct processor *find_processor(uint32_t id) {
+    size_t n = 0;
+    struct processor *proc = 0;
+    while((proc = (struct processor *) list_at(proc_list, n++))) {
+        if(proc->id == id) {
+            break;
+        }
+    }
+
+    return proc;
+}
+
+/// Runs every call in this CPU's mailbox. The mailbox has one consumer, so
+/// this needs interrupts off.
+static int crosscpu_drain() {
+    struct processor *proc = find_processor(multicpu_id());
+    struct crosscpu_call calls[CROSSCPU_BATCH];
+    size_t n;
+    int ret = 0;
+    while(proc && (n = ring_pop_batch(proc->mailbox, calls, CROSSCPU_BATCH))) {
+        for(size_t i = 0; i < n; i++) {
+            ret |= calls[i].func(calls[i].param);
+        }
+    }
+
+    return ret;
+}
+
+static int lapic_localint(struct intr_stack *s, void *p __unused) {
     int ret = 0;
     if(s->intnum == LAPIC_SPURIOUS) {
         dprintf("Local APIC: spurious interrupt\n");
     } else {
         if(s->intnum == LAPIC_CROSSCPU) {
-            if(crosscpu_func) {
-                ret = crosscpu_func(crosscpu_param);
-                crosscpu_func = 0;
-
-                spinlock_release(crosscpu_lock);
-            }
+            // Run everything that's queued. A call pushed after we find the
+            // mailbox empty comes with another IPI.
+            ret = crosscpu_drain();
         } else if(s->intnum == LAPIC_TIMER) {
-            struct timer *tim = *((struct timer **) multicpu_percpu_at(MULTICPU_PERCPU_CPUTIMER));
-            if(tim) {
-                ret = timer_ticked(tim, ((LAPIC_TIMER_MS << TIMERRES_SHIFT) | TIMERRES_MILLI));
+            struct lapic_timer *lt = get_lapic_timer();
+            if(lt && (lt->mode == LAPIC_TIMER_ARMED)) {
+                // One-shot expired. The timer stays stopped until the
+                // scheduler restarts the tick.
+                lt->mode = LAPIC_TIMER_STOPPED;
+                ret = lapic_timer_report(lt, lt->carry + lt->initial);
+                lt->carry = 0;
+            } else if(lt && (lt->mode == LAPIC_TIMER_PERIODIC)) {
+                ret = timer_ticked(&lt->tmr, ((LAPIC_TIMER_MS << TIMERRES_SHIFT) | TIMERRES_MILLI));
             }
+        } else if(s->intnum == LAPIC_RESCHED) {
+            // Another CPU queued work for us.
+            ret = 1;
+        } else if(s->intnum == LAPIC_TLB) {
+            vmem_shootdown_recv();
         }
 
         // ACK the interrupt.
@@ -295,12 +445,15 @@ void init_lapic() {
 
     // Configure the timer now.
     uint32_t ticks = system_bus_freq / (1000 / LAPIC_TIMER_MS) / 16;
-    write_lapic_reg(lapic->mmioaddr, 0x380, ticks < 16 ? 16 : ticks);
-    write_lapic_reg(lapic->mmioaddr, 0x320, (1 << 17) | LAPIC_TIMER); // Periodic.
-    write_lapic_reg(lapic->mmioaddr, 0x3E0, 0x3); // Divide clock by 16.
+    lapic_tick_count = ticks < 16 ? 16 : ticks;
+    lapic_timer_start_periodic();
 
     // Register as a timer.
-    struct timer *tmr = (struct timer *) malloc(sizeof(struct timer));
+    struct lapic_timer *lt = (struct lapic_timer *) malloc(sizeof(struct lapic_timer));
+    memset(lt, 0, sizeof(struct lapic_timer));
+    lt->mode = LAPIC_TIMER_PERIODIC;
+
+    struct timer *tmr = &lt->tmr;
 
     size_t namelen = strlen("Local APIC Timer for CPU") + 16;
     char *timer_name = (char *) malloc(namelen);
@@ -309,6 +462,8 @@ void init_lapic() {
     tmr->timer_init = lapic_timer_init;
     tmr->timer_res = (LAPIC_TIMER_MS << TIMERRES_SHIFT) | TIMERRES_MILLI;
     tmr->timer_feat = TIMERFEAT_PERIODIC | TIMERFEAT_PERCPU;
+    tmr->oneshot = lapic_timer_oneshot;
+    tmr->periodic = lapic_timer_periodic;
     sprintf(timer_name, "Local APIC Timer for CPU%d", multicpu_id());
 
     tmr->name = (const char *) timer_name;
@@ -338,7 +493,7 @@ int init_apic() {
 
     // Housekeeping for the various data we're about to pull.
     ioapic_list = create_list();
-    interrupt_override = create_tree();
+    void *overrides = create_tree();
 
     // Enable the LAPIC, if by chance one exists we'll want to use it.
     x86_get_msr(0x1B, &a, &b);
@@ -365,9 +520,11 @@ int init_apic() {
     interrupts_trap_reg(LAPIC_SPURIOUS, lapic_localint);
     interrupts_trap_reg(LAPIC_TIMER, lapic_localint);
     interrupts_trap_reg(LAPIC_CROSSCPU, lapic_localint);
+    interrupts_trap_reg(LAPIC_RESCHED, lapic_localint);
+    interrupts_trap_reg(LAPIC_TLB, lapic_localint);
 
     // Prepare to create the processor list when we enumerate processors soon.
-    proc_list = create_list();
+    void *procs = create_list();
 
     // Parse all structures in the table.
     uintptr_t base = ((uintptr_t) madt) + sizeof(*madt);
@@ -386,6 +543,7 @@ int init_apic() {
                 struct processor *proc = (struct processor *) malloc(sizeof(struct processor));
                 proc->id = lapic_meta->ProcessorId;
                 proc->apic_id = lapic_meta->Id;
+                proc->mailbox = create_ring(CROSSCPU_MAILBOX_SIZE, sizeof(struct crosscpu_call), RING_MPSC);
 
                 // Is this a match for the BSP (ie, the CPU executing right now)
                 if(lapic_meta->Id == apicid) {
@@ -396,7 +554,7 @@ int init_apic() {
                     proc->bsp = proc->started = 0;
                 }
 
-                list_insert(proc_list, proc, 0);
+                list_insert(procs, proc, 0);
             }
         } else if(hdr->Type == ACPI_MADT_TYPE_IO_APIC) {
             ACPI_MADT_IO_APIC *ioapic = (ACPI_MADT_IO_APIC *) base;
@@ -445,7 +603,7 @@ int init_apic() {
                 }
             }
 
-            tree_insert(interrupt_override, (void *) override->SourceIrq, (void *) o);
+            tree_insert(overrides, (void *) override->SourceIrq, (void *) o);
         }
 
         if(hdr->Length > sz) {
@@ -460,14 +618,19 @@ int init_apic() {
     if(list_len(ioapic_list) == 0) {
         dprintf("ioapic: no I/O APIC found!\n");
         delete_list(ioapic_list);
-        delete_list(proc_list);
-        delete_tree(interrupt_override);
         ioapic_list = 0;
-        proc_list= 0;
-        interrupt_override = 0;
+
+        delete_list(procs);
+        delete_tree(overrides);
         return -1;
     }
 
+    // Publish the finished tables. Readers that see the pointers see every
+    // entry.
+    __barrier;
+    interrupt_override = overrides;
+    proc_list = procs;
+
     // Initialise all I/O APICs.
     size_t n = 0;
     struct ioapic *meta = 0;
@@ -595,10 +758,7 @@ int multicpu_start(uint32_t cpu) {
     if(proc->bsp || proc->started)
         return 0;
 
-    // Is there a cross-CPU lock set up already?
-    if(!crosscpu_lock) {
-        crosscpu_lock = create_spinlock();
-    }
+    crosscpu_ready = 1;
 
     int ret = start_processor(proc->apic_id);
     if(ret == 0)
@@ -652,8 +812,24 @@ uint32_t multicpu_count() {
     return list_len(proc_list);
 }
 
-void multicpu_call(uint32_t cpu, crosscpu_func_t func, void *param) NO_THREAD_SAFETY_ANALYSIS {
-    if((multicpu_count() == 1) || (crosscpu_lock == 0)) {
+void multicpu_resched(uint32_t cpu) {
+    if((multicpu_count() == 1) || (!crosscpu_ready) || (multicpu_id() == cpu)) {
+        return;
+    }
+
+    lapic_ipi(cpu, LAPIC_RESCHED, 0, 1, 0);
+}
+
+void multicpu_tlb_flush(uint32_t cpu) {
+    if((multicpu_count() == 1) || (multicpu_id() == cpu)) {
+        return;
+    }
+
+    lapic_ipi(cpu, LAPIC_TLB, 0, 1, 0);
+}
+
+void multicpu_call(uint32_t cpu, crosscpu_func_t func, void *param) {
+    if((multicpu_count() == 1) || (!crosscpu_ready)) {
         dprintf("multicpu_call: uniprocessor system, or no additional processors started\n");
         func(param);
         return;
@@ -665,10 +841,27 @@ void multicpu_call(uint32_t cpu, crosscpu_func_t func, void *param) NO_THREAD_SA
         return;
     }
 
-    spinlock_acquire(crosscpu_lock);
+    struct processor *proc = find_processor(cpu);
+    if(!proc) {
+        dprintf("multicpu_call: no cpu %d\n", cpu);
+        return;
+    }
 
-    crosscpu_func = func;
-    crosscpu_param = param;
+    // Only full if the target has had interrupts off for a long time, which
+    // it may be because it is waiting on our mailbox in here too (eg, both
+    // are handing out timer callbacks). So keep emptying ours while waiting.
+    // A reschedule the calls ask for waits for the next tick.
+    struct crosscpu_call call = {func, param};
+    while(ring_push(proc->mailbox, &call)) {
+        int wasints = interrupts_get();
+        interrupts_disable();
+        crosscpu_drain();
+        if(wasints) {
+            interrupts_enable();
+        }
+
+        spinlock_poll();
+    }
 
     lapic_ipi(cpu, LAPIC_CROSSCPU, 0, 1, 0);
 }
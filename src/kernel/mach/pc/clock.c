@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <types.h>
+#include <system.h>
+#include <clock.h>
+#include <mmiopool.h>
+#include <io.h>
+
+#include <acpi.h>
+
+/// HPET register offsets.
+#define HPET_CAPABILITIES       0x00
+#define HPET_CONFIG             0x10
+#define HPET_COUNTER            0xF0
+
+#define HPET_CAP_COUNT_64       (1 << 13)
+#define HPET_CONFIG_ENABLE      (1 << 0)
+
+/// Femtoseconds per second (HPET reports its period in femtoseconds).
+#define FS_PER_SECOND           1000000000000000ULL
+
+static volatile uint32_t *hpet = 0;
+
+static uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return (((uint64_t) hi) << 32) | lo;
+}
+
+/// Counts TSC cycles across 1/100th of a second, timed by PIT channel 2.
+static uint64_t tsc_calibrate() {
+    outb(0x61, (inb(0x61) & 0xFD) | 1);
+    outb(0x43, 0xb2);
+
+    // 1/100th of a second.
+    outb(0x42, 0x9B);
+    inb(0x60);
+    outb(0x42, 0x2E);
+
+    uint8_t c = inb(0x61) & 0xFE;
+    outb(0x61, c);
+    outb(0x61, c | 1);
+
+    uint64_t start = rdtsc();
+
+    // Wait for the PIT counter to hit zero.
+    while(!(inb(0x61) & 0x20));
+
+    return (rdtsc() - start) * 100;
+}
+
+static int tsc_init(struct clocksource *cs) {
+    // Only an invariant TSC ticks at a constant rate regardless of power
+    // states, which is what we need to use it as a clock.
+    uint32_t a, b, c, d;
+    x86_cpuid(0x80000000, &a, &b, &c, &d);
+    if(a < 0x80000007) {
+        return -1;
+    }
+
+    x86_cpuid(0x80000007, &a, &b, &c, &d);
+    if((d & (1 << 8)) == 0) {
+        dprintf("tsc: not invariant\n");
+        return -1;
+    }
+
+    cs->freq = tsc_calibrate();
+    dprintf("tsc: %d kHz\n", (uint32_t) (cs->freq / 1000));
+
+    return 0;
+}
+
+static struct clocksource tsc_clock = {
+    "Invariant TSC",
+    300,
+    0,
+    (uint64_t) ~0ULL,
+    tsc_init,
+    rdtsc
+};
+
+EXPORT_CLOCKSOURCE(tsc, tsc_clock);
+
+static uint64_t hpet_read() {
+    // The counter may be 64 bits wide, but we can only read 32 bits at a time.
+    // Retry if the low half wrapped between reading the two halves.
+    uint32_t hi, lo;
+    do {
+        hi = hpet[(HPET_COUNTER + 4) / 4];
+        lo = hpet[HPET_COUNTER / 4];
+    } while(hi != hpet[(HPET_COUNTER + 4) / 4]);
+
+    return (((uint64_t) hi) << 32) | lo;
+}
+
+static int hpet_init(struct clocksource *cs) {
+    ACPI_TABLE_HPET *table;
+    ACPI_STATUS status = AcpiGetTable((ACPI_STRING) ACPI_SIG_HPET, 0, ACPI_CAST_INDIRECT_PTR(ACPI_TABLE_HEADER, &table));
+    if(ACPI_FAILURE(status)) {
+        dprintf("hpet: no HPET table\n");
+        return -1;
+    }
+
+    if(table->Address.SpaceId != ACPI_ADR_SPACE_SYSTEM_MEMORY) {
+        dprintf("hpet: not memory mapped\n");
+        return -1;
+    }
+
+    hpet = (volatile uint32_t *) mmiopool_alloc(PAGE_SIZE, (paddr_t) table->Address.Address);
+
+    // Upper half of the capabilities register is the counter period.
+    uint32_t period = hpet[(HPET_CAPABILITIES + 4) / 4];
+    if((period == 0) || (period > 100000000)) {
+        dprintf("hpet: bogus period %d fs\n", period);
+        return -1;
+    }
+
+    cs->freq = FS_PER_SECOND / period;
+    if((hpet[HPET_CAPABILITIES / 4] & HPET_CAP_COUNT_64) == 0) {
+        cs->mask = 0xFFFFFFFFULL;
+    }
+
+    // Start the main counter.
+    hpet[HPET_CONFIG / 4] |= HPET_CONFIG_ENABLE;
+
+    dprintf("hpet: %d kHz, %d-bit counter\n", (uint32_t) (cs->freq / 1000), cs->mask == 0xFFFFFFFFULL ? 32 : 64);
+
+    return 0;
+}
+
+static struct clocksource hpet_clock = {
+    "HPET",
+    200,
+    0,
+    (uint64_t) ~0ULL,
+    hpet_init,
+    hpet_read
+};
+
+EXPORT_CLOCKSOURCE(hpet, hpet_clock);
@@ -27,9 +27,13 @@ extern void vmem_powerman_init();
 // arch/x86/interrupts.c
 extern void ints_powerman_init();
 
+// screen.c
+extern void init_screen();
+
 void mach_init_devices() {
 	init_intc();
 	init_serial();
+	init_screen();
 
     // Make sure the GDTR and IDTR reload can happen.
     vmem_powerman_init();
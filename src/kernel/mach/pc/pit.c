@@ -52,15 +52,10 @@ int init_pit() {
 }
 
 static struct timer t = {
-	((10 << TIMERRES_SHIFT) | TIMERRES_MILLI),
-	TIMERFEAT_PERIODIC,
-	0,
-	"Programmable Interval Timer",
-	init_pit,
-	0,
-	0,
-	0,
-	0
+	.timer_res = ((10 << TIMERRES_SHIFT) | TIMERRES_MILLI),
+	.timer_feat = TIMERFEAT_PERIODIC,
+	.name = "Programmable Interval Timer",
+	.timer_init = init_pit,
 };
 
 EXPORT_TIMER(pit, t);
@@ -17,8 +17,9 @@
 #include <types.h>
 #include <kboot.h>
 #include <system.h>
-#include <malloc.h>
 #include <panic.h>
+#include <assert.h>
+#include <vmem.h>
 #include <util.h>
 #include <pmem.h>
 #include <io.h>
@@ -27,49 +28,125 @@ extern int end;
 
 static paddr_t totalKiB = 0;
 
-static void *firmware_stack = 0;
-
 #define FIRMWARE_END        ((paddr_t) 0x100000)
+#define FIRMWARE_PAGES      (FIRMWARE_END / PAGE_SIZE)
+
+/// Highest physical address the zone metadata may live at - the boot page
+/// table maps 4 MB from the start of the kernel, so we can map the metadata
+/// without needing a physical page allocator.
+#define META_LIMIT          (PHYS_ADDR + 0x400000UL)
+
+static uint32_t firmware_meta[(FIRMWARE_PAGES / 32) + 1];
+
+static paddr_t meta_start = 0, meta_end = 0;
 
 paddr_t pmem_size() {
 	return totalKiB;
 }
 
+/// Frees [base, top) into the standard zone, skipping the zone metadata.
+static size_t free_region(paddr_t base, paddr_t top) {
+    size_t n = 0;
+
+    if((base < meta_end) && (top > meta_start)) {
+        if(base < meta_start)
+            n += free_region(base, meta_start);
+        if(top > meta_end)
+            n += free_region(meta_end, top);
+        return n;
+    }
+
+    if(base >= top)
+        return 0;
+
+    n = (size_t) ((top - base) / PAGE_SIZE);
+    pmem_dealloc_range(base, n);
+    return n;
+}
+
 int mach_phys_init(phys_ptr_t tags) {
-	paddr_t kernel_end = log2phys((uintptr_t) &end);
-	size_t n = 0; phys_ptr_t base = 0;
+	paddr_t kernel_end = (log2phys((uintptr_t) &end) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	size_t n = 0; paddr_t base = 0, top = 0, max_addr = 0;
 
     kboot_tag_t *taglist = (kboot_tag_t *) tags;
     int found = 0;
+
+    // Find the top of usable memory to size the bitmap.
     do {
         if(taglist->type == KBOOT_TAG_MEMORY) {
             kboot_tag_memory_t *memtag = (kboot_tag_memory_t *) taglist;
 
-            if((memtag->type == KBOOT_MEMORY_FREE) && (((paddr_t) memtag->end) > kernel_end)) {
+            if((memtag->type == KBOOT_MEMORY_FREE) && (((paddr_t) memtag->end) > max_addr))
+                max_addr = memtag->end;
+
+            found = 1;
+        }
+        taglist = (kboot_tag_t *) taglist->next;
+    } while(taglist);
+
+    if(!found)
+        panic("No memory map has been provided, cannot continue.");
+
+    if(max_addr > ((paddr_t) PADDR_MASK + 1))
+        max_addr = (paddr_t) PADDR_MASK + 1;
+
+    size_t pages = (size_t) (max_addr / PAGE_SIZE);
+    size_t metasize = (pmem_zone_metasize(pages) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    // Find a home for the metadata in free memory just after the kernel.
+    taglist = (kboot_tag_t *) tags;
+    do {
+        if(taglist->type == KBOOT_TAG_MEMORY) {
+            kboot_tag_memory_t *memtag = (kboot_tag_memory_t *) taglist;
+
+            if((memtag->type == KBOOT_MEMORY_FREE) && !meta_end) {
                 base = memtag->start;
                 if(base < kernel_end)
                     base = kernel_end;
 
-                for(; base < memtag->end; base += PAGE_SIZE) {
-                    pmem_dealloc(base);
-                    n++;
+                if(((base + metasize) <= memtag->end) && ((base + metasize) <= META_LIMIT)) {
+                    meta_start = base;
+                    meta_end = base + metasize;
                 }
             }
-
-            found = 1;
         }
         taglist = (kboot_tag_t *) taglist->next;
     } while(taglist);
 
-    if(!found)
-        panic("No memory map has been provided, cannot continue.");
+    if(!meta_end)
+        panic("pmem: no room for the physical memory bitmap");
+
+    for(base = meta_start; base < meta_end; base += PAGE_SIZE)
+        vmem_map((vaddr_t) phys2log(base), base, VMEM_SUPERVISOR | VMEM_READWRITE | VMEM_GLOBAL);
+
+    pmem_zone_init(PMEM_SPECIAL_STANDARD, 0, pages, (void *) (uintptr_t) phys2log(meta_start));
+
+    taglist = (kboot_tag_t *) tags;
+    do {
+        if(taglist->type == KBOOT_TAG_MEMORY) {
+            kboot_tag_memory_t *memtag = (kboot_tag_memory_t *) taglist;
+
+            if((memtag->type == KBOOT_MEMORY_FREE) && (((paddr_t) memtag->end) > kernel_end)) {
+                base = memtag->start;
+                if(base < kernel_end)
+                    base = kernel_end;
+
+                top = memtag->end;
+                if(top > max_addr)
+                    top = max_addr;
+
+                n += free_region(base, top);
+            }
+        }
+        taglist = (kboot_tag_t *) taglist->next;
+    } while(taglist);
 
 	totalKiB = (n * PAGE_SIZE) / 1024;
-    kprintf("pmem: %d pages ready for use - ~ %d MB\n", n, totalKiB / 1024);
+    kprintf("pmem: %d pages ready for use - ~ %d MB (bitmap is %d KiB)\n", n, totalKiB / 1024, metasize / 1024);
 
-    // Firmware stack for < 1 MB RAM (for things like ACPI and such)
-    firmware_stack = create_stack();
-    stack_flags(firmware_stack, STACK_FLAGS_NOMEMLOCK);
+    // Firmware zone for < 1 MB RAM (for things like ACPI and such)
+    assert(sizeof(firmware_meta) >= pmem_zone_metasize(FIRMWARE_PAGES));
+    pmem_zone_init(PMEM_SPECIAL_FIRMWARE, 0, FIRMWARE_PAGES, firmware_meta);
 
     // Find regions under 1 MB.
     n = 0;
@@ -81,11 +158,13 @@ int mach_phys_init(phys_ptr_t tags) {
             if((memtag->type == KBOOT_MEMORY_FREE) && (((paddr_t) memtag->end) <= FIRMWARE_END)) {
                 dprintf("firmware %llx -> %llx\n", memtag->start, memtag->end);
 
+                base = memtag->start;
+
                 // Don't overwrite the first page of memory.
                 if(base == 0)
                     base += PAGE_SIZE;
 
-                for(base = memtag->start; base < memtag->end; base += PAGE_SIZE) {
+                for(; base < memtag->end; base += PAGE_SIZE) {
                     /// \todo HACK!
                     if(base == 0xB8000)
                         continue;
@@ -104,43 +183,6 @@ int mach_phys_init(phys_ptr_t tags) {
 	return 0;
 }
 
-paddr_t pmem_alloc_special(size_t how) {
-    struct phys_page *page = 0;
-    paddr_t ret = 0;
-
-    if(how == PMEM_SPECIAL_STANDARD) {
-        return pmem_alloc();
-    } else if(how == PMEM_SPECIAL_FIRMWARE) {
-        if(firmware_stack == 0)
-            return 0;
-
-        page = (struct phys_page *) stack_pop(firmware_stack);
-        if(!page)
-            return 0;
-
-        ret = page->addr;
-        free_nolock(page);
-    }
-
-    return ret;
-}
-
-void pmem_dealloc_special(size_t how, paddr_t p) {
-    struct phys_page *page = 0;
-
-    if(how == PMEM_SPECIAL_STANDARD) {
-        pmem_dealloc(p);
-    } else if(how == PMEM_SPECIAL_FIRMWARE) {
-        if(firmware_stack == 0)
-            return;
-
-        page = (struct phys_page *) malloc_nolock(sizeof(struct phys_page));
-        page->addr = p;
-
-        stack_push(firmware_stack, page);
-    }
-}
-
 int mach_phys_deinit() {
 	return 0;
 }
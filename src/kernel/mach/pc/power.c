@@ -40,6 +40,10 @@ extern int pc_acpi_save_state(void *);
 
 extern void *pc_acpi_saveblock_addr;
 
+/// Word in the save block holding EFER bits for the wakeup code to set, just
+/// past the state pc_acpi_save_state itself saves.
+#define PC_SAVEBLOCK_EFER   18
+
 static paddr_t pc_reloc_acpi_wakeup;
 
 static void *pc_wakeup_saveblock;
@@ -113,13 +117,13 @@ static void pc_remap_wakeup_data() {
     // the section, and leaving it mapped means we can also access all the
     // kernel during wakeup.
     paddr_t p = pmem_alloc_special(PMEM_SPECIAL_FIRMWARE);
-    vmem_map((vaddr_t) p, p, VMEM_SUPERVISOR | VMEM_READWRITE);
+    vmem_map((vaddr_t) p, p, VMEM_SUPERVISOR | VMEM_READWRITE | VMEM_EXEC);
     memcpy((void *) p, (void *) begin_lowmem, PAGE_SIZE);
 
     // Unmap the current region and point it to that physical address, now that
     // the copy has completed.
     vmem_unmap(begin_lowmem);
-    vmem_map(begin_lowmem, p, VMEM_SUPERVISOR | VMEM_READWRITE);
+    vmem_map(begin_lowmem, p, VMEM_SUPERVISOR | VMEM_READWRITE | VMEM_EXEC);
 
     pc_reloc_acpi_wakeup = p + (wakeup_virt & (PAGE_SIZE - 1));
 }
@@ -350,8 +354,10 @@ int platform_powerman_enter(int new_state) {
         ACPI_FLUSH_CPU_CACHE();
     }
 
-    // Save state before we enter the new sleep state.
+    // Save state before we enter the new sleep state. The wakeup code also
+    // needs to restore EFER before paging comes back on.
     dprintf("pc: acpi saving state before entering new sleep state\n");
+    x86_paging_state(0, &((uint32_t *) pc_wakeup_saveblock)[PC_SAVEBLOCK_EFER]);
     if(pc_acpi_save_state(pc_wakeup_saveblock) == 0) {
         dprintf("ok!\n");
 
@@ -15,8 +15,10 @@
  */
 
 #include <types.h>
+#include <system.h>
 #include <serial.h>
 #include <util.h>
+#include <mmiopool.h>
 
 /// Maximum width of the text console (regardless of extents)
 #define PC_MAX_W 80
@@ -32,6 +34,13 @@ static uint8_t screenH = 25;
 
 static uint8_t *vmem = (uint8_t *) 0xB8000;
 
+void init_screen() {
+	// The low memory mapping at 0xB8000 is only in the kernel's address space.
+	uint8_t *p = (uint8_t *) mmiopool_alloc(PAGE_SIZE, 0xB8000);
+	if(p)
+		vmem = p;
+}
+
 void machine_clear_screen() {
 	memset(vmem, 0, screenW * screenH * sizeof(uint16_t));
 }
@@ -25,6 +25,7 @@
 #include <vmem.h>
 #include <util.h>
 #include <io.h>
+#include <malloc.h>
 
 #include <apic.h>
 
@@ -47,7 +48,14 @@ extern void *pc_ap_entry;
 static int ap_lowmem_init = 0;
 static uint8_t ap_startup_vec = 0;
 
+/// Per-CPU data for the AP being started. The BSP allocates it, as an AP
+/// can't take a page fault (and so can't touch fresh heap) until its IDT is
+/// loaded.
+static struct percpu_data *ap_percpu = 0;
+
 extern void *pc_ap_pdir;
+extern void *pc_ap_cr4;
+extern void *pc_ap_efer;
 
 #define WARM_RESET_VECTOR       0x0469
 
@@ -65,9 +73,7 @@ void multicpu_cpuinit() {
     extern void ints_multicpu_init();
 
     // Configure per-CPU data storage.
-    struct percpu_data *percpu = (struct percpu_data *) malloc(sizeof(struct percpu_data));
-    memset(percpu, 0, sizeof(struct percpu_data));
-    __asm__ volatile("mov %0, %%dr3" :: "r" ((unative_t) percpu));
+    __asm__ volatile("mov %0, %%dr3" :: "r" ((unative_t) ap_percpu));
 
     // Configure our Local APIC.
     init_lapic();
@@ -90,13 +96,18 @@ int multicpu_init() {
     init_slock = create_spinlock();
 
     // Store the current page directory so APs can pick it up.
-    uint32_t cr3 = 0;
+    // (The trampoline loads it while still in 32-bit mode, so it must be below
+    // 4 GB.)
+    unative_t cr3 = 0;
     __asm__ volatile("mov %%cr3, %0" : "=r" (cr3));
-    *((uint32_t *) &pc_ap_pdir) = cr3;
+    *((uint32_t *) &pc_ap_pdir) = (uint32_t) cr3;
+
+    // And the paging features they need turned on before using it.
+    x86_paging_state((uint32_t *) &pc_ap_cr4, (uint32_t *) &pc_ap_efer);
 
     // Map and copy the low memory region APs boot at.
     paddr_t p = pmem_alloc_special(PMEM_SPECIAL_FIRMWARE);
-    vmem_map((vaddr_t) p, p, VMEM_SUPERVISOR | VMEM_READWRITE);
+    vmem_map((vaddr_t) p, p, VMEM_SUPERVISOR | VMEM_READWRITE | VMEM_EXEC);
     memcpy((void *) p, (void *) &pc_ap_entry, PAGE_SIZE);
 
     // Copied - set the vector so APs are ready to go.
@@ -134,6 +145,9 @@ int start_processor(uint8_t id) NO_THREAD_SAFETY_ANALYSIS {
     // Prepare to start the AP.
     spinlock_acquire(init_slock);
 
+    ap_percpu = (struct percpu_data *) malloc(sizeof(struct percpu_data));
+    memset(ap_percpu, 0, sizeof(struct percpu_data));
+
     /// \todo This is very 'fire and forget' - would be nice to use the ICR
     ///       delivery status bit to verify IPIs have been received.
 
@@ -33,6 +33,8 @@
 #include <test.h>
 #include <malloc.h>
 #include <sleep.h>
+#include <clock.h>
+#include <spinlock.h>
 
 extern void init_serial();
 extern void _start();
@@ -43,12 +45,9 @@ void idle(void *p __unused) {
     interrupts_enable();
 
     while(1) {
-        // Always confirm interrupts are enabled before halting.
-        // The halt should put the CPU into a low power state until an IRQ or
-        // something comes through.
-        if(!interrupts_get())
-            interrupts_enable();
-        __halt;
+        // Puts the CPU into a low power state until an IRQ or something comes
+        // through, without ticking if there's nothing to run.
+        sched_idle();
 
         // sched_yield won't reschedule unless there is a thread to switch to.
         sched_yield();
@@ -69,6 +68,11 @@ void banner(void *p __unused) {
         puts_at(idlebuf, 0, 24);
         interrupts_enable();
 
+#ifdef SPINLOCK_STATS
+        if((n % 10) == 0)
+            spinlock_report();
+#endif
+
         sleep_ms(1000);
     }
 }
@@ -109,6 +113,9 @@ void _kmain(uint32_t magic, phys_ptr_t tags) {
 #ifdef X86 // KBoot is only enabled for X86 at the moment.
 	assert(magic == KBOOT_MAGIC);
 	_start(); // _start() sets up a page directory that isn't KBoot's - known state!
+#ifdef X86_PAE
+	x86_pae_init();
+#endif
 	clrscr();
 #endif
 
@@ -169,6 +176,9 @@ void _kmain(uint32_t magic, phys_ptr_t tags) {
 	kprintf("Initialising timers...\n");
 	timers_init();
 
+	kprintf("Initialising clocks...\n");
+	clock_init();
+
     kprintf("Configuring memory pools...\n");
     init_pool();
 
@@ -193,9 +203,11 @@ void _kmain(uint32_t magic, phys_ptr_t tags) {
     struct thread *init_thread = create_thread(initproc, THREAD_PRIORITY_HIGH, init2, 0, 0, 0);
     struct thread *idle_thread = create_thread(initproc, THREAD_PRIORITY_LOW, idle, 0, 0, 0);
     struct thread *banner_thread = create_thread(initproc, THREAD_PRIORITY_LOW, banner, 0, 0, 0);
+    struct thread *zero_thread = create_thread(initproc, THREAD_PRIORITY_LOW, pmem_zero_thread, 0, 0, 0);
 
     sched_setidle(idle_thread);
     thread_wake(banner_thread);
+    thread_wake(zero_thread);
     thread_wake(init_thread);
     sched_kickstart();  // kick off the first thread
 
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <types.h>
+#include <mutex.h>
+#include <waitqueue.h>
+#include <multicpu.h>
+#include <malloc.h>
+#include <assert.h>
+#include <sched.h>
+#include <spinlock.h>
+#include <util.h>
+
+/// Set in the owner while threads are asleep waiting for the mutex.
+#define MUTEX_WAITERS       1UL
+
+/// Owner before the scheduler is running, when there's no thread to name.
+#define MUTEX_NOTHREAD      2UL
+
+#define OWNER_MASK          (~MUTEX_WAITERS)
+
+/// Most pauses spent waiting on a running holder before sleeping instead.
+#define MUTEX_SPIN_MAX      4096
+
+/// top_priority of a mutex nobody is asleep on.
+#define PRIO_NONE           ((uint32_t) ~0U)
+
+/// Guards every thread's pi_held list and inherited priority. Taken inside a
+/// mutex's wait queue lock. A zeroed spinlock is an unlocked one.
+static char pi_lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+static spinlock_t pi_lock = (spinlock_t) pi_lock_region;
+
+static uintptr_t self() {
+    struct thread *t = sched_current_thread();
+    return t ? (uintptr_t) t : MUTEX_NOTHREAD;
+}
+
+/// Sets a thread's priority to the best of its own and that of the waiters on
+/// the mutexes it holds. pi_lock must be held.
+static void pi_update(struct thread *thr) {
+    uint32_t base = thr->pi_boosted ? thr->pi_base : thr->priority;
+    uint32_t prio = base;
+
+    struct mutex *m;
+    for(m = thr->pi_held; m; m = m->pi_next) {
+        if(m->top_priority < prio)
+            prio = m->top_priority;
+    }
+
+    if(prio < base) {
+        thr->pi_base = base;
+        thr->pi_boosted = 1;
+    } else {
+        thr->pi_boosted = 0;
+    }
+
+    if(prio != thr->priority)
+        thread_set_priority(thr, prio);
+}
+
+void mutex_pi_decay(struct thread *thr, uint32_t target) {
+    spinlock_acquire(pi_lock);
+
+    // A boosted thread's own priority is parked in pi_base.
+    uint32_t *prio = thr->pi_boosted ? &thr->pi_base : &thr->priority;
+    if(*prio < target)
+        (*prio)++;
+    else if(*prio > target)
+        (*prio)--;
+
+    pi_update(thr);
+
+    spinlock_release(pi_lock);
+}
+
+/// Puts a mutex on its holder's pi_held list. pi_lock must be held.
+static void pi_link(mutex_t *m, struct thread *holder) {
+    if(m->pi_holder == holder)
+        return;
+
+    assert(!m->pi_holder);
+    m->pi_holder = holder;
+    m->pi_next = holder->pi_held;
+    holder->pi_held = m;
+}
+
+/// Takes a mutex off its holder's pi_held list. pi_lock must be held.
+static void pi_unlink(mutex_t *m) {
+    struct thread *holder = m->pi_holder;
+    if(!holder)
+        return;
+
+    struct mutex **p;
+    for(p = &holder->pi_held; *p; p = &(*p)->pi_next) {
+        if(*p == m) {
+            *p = m->pi_next;
+            break;
+        }
+    }
+
+    m->pi_holder = 0;
+    m->pi_next = 0;
+}
+
+/// Spins while the holder is running on another CPU, as it may well release
+/// the mutex sooner than we could sleep and be woken.
+static void spin_on_owner(mutex_t *m) {
+    if(multicpu_count() == 1)
+        return;
+
+    for(size_t i = 0; i < MUTEX_SPIN_MAX; i++) {
+        uintptr_t o = m->owner;
+        if(!o)
+            return;
+
+        // Sleepers get the mutex first, so there's no point spinning.
+        if((o & MUTEX_WAITERS) || (o == MUTEX_NOTHREAD))
+            return;
+
+        if(((struct thread *) o)->state != THREAD_STATE_RUNNING)
+            return;
+
+        __spin;
+    }
+}
+
+void mutex_init(mutex_t *m) {
+    m->owner = 0;
+    m->top_priority = PRIO_NONE;
+    m->pi_holder = 0;
+    m->pi_next = 0;
+
+    wait_queue_init(&m->waiters);
+}
+
+mutex_t *create_mutex() {
+    mutex_t *m = (mutex_t *) malloc(sizeof(mutex_t));
+    mutex_init(m);
+    return m;
+}
+
+void delete_mutex(mutex_t *m) {
+    if(!m)
+        return;
+
+    assert(m->owner == 0);
+    free(m);
+}
+
+int mutex_trylock(mutex_t *m) {
+    return atomic_bool_cas_int(&m->owner, 0, self());
+}
+
+void mutex_lock(mutex_t *m) {
+    uintptr_t me = self();
+    if(atomic_bool_cas_int(&m->owner, 0, me))
+        return;
+
+    assert((m->owner & OWNER_MASK) != me);
+
+    if(me == MUTEX_NOTHREAD) {
+        // Nothing to sleep with yet.
+        while(!atomic_bool_cas_int(&m->owner, 0, me))
+            __spin;
+        return;
+    }
+
+    struct thread *thr = (struct thread *) me;
+    while(1) {
+        spin_on_owner(m);
+        if(atomic_bool_cas_int(&m->owner, 0, me))
+            return;
+
+        wait_queue_lock(&m->waiters);
+
+        // Flag that there are sleepers, so the holder's unlock comes looking
+        // for us. Start again if it was released meanwhile.
+        uintptr_t o = m->owner;
+        if((!o) || (!(o & MUTEX_WAITERS) && !atomic_bool_cas_int(&m->owner, o, o | MUTEX_WAITERS))) {
+            wait_queue_unlock(&m->waiters);
+            continue;
+        }
+
+        // Lend the holder our priority, so a less important thread holding
+        // the mutex can't keep us waiting behind everything in between.
+        if(thr->priority < m->top_priority)
+            m->top_priority = thr->priority;
+
+        struct thread *holder = (struct thread *) (o & OWNER_MASK);
+        if((uintptr_t) holder != MUTEX_NOTHREAD) {
+            spinlock_acquire(pi_lock);
+            pi_link(m, holder);
+            pi_update(holder);
+            spinlock_release(pi_lock);
+        }
+
+        wait_queue_sleep_locked(&m->waiters);
+
+        // mutex_unlock hands the mutex over before waking us.
+        if((m->owner & OWNER_MASK) == me)
+            return;
+    }
+}
+
+void mutex_unlock(mutex_t *m) {
+    uintptr_t me = self();
+    if(atomic_bool_cas_int(&m->owner, me, 0))
+        return;
+
+    // Only fails if there are sleepers.
+    assert((m->owner & OWNER_MASK) == me);
+
+    wait_queue_lock(&m->waiters);
+
+    // Hand over to the most important waiter, oldest first among equals.
+    struct thread *next = m->waiters.waiters.head, *t;
+    for(t = next; t; t = t->qnext) {
+        if(t->priority < next->priority)
+            next = t;
+    }
+
+    if(next)
+        thread_list_remove(&m->waiters.waiters, next);
+
+    m->top_priority = PRIO_NONE;
+    for(t = m->waiters.waiters.head; t; t = t->qnext) {
+        if(t->priority < m->top_priority)
+            m->top_priority = t->priority;
+    }
+
+    // Our priority now only answers to the mutexes we still hold, and the
+    // remaining waiters lend theirs to the new holder.
+    spinlock_acquire(pi_lock);
+    pi_unlink(m);
+    if(me != MUTEX_NOTHREAD)
+        pi_update((struct thread *) me);
+    if(next && (m->top_priority != PRIO_NONE)) {
+        pi_link(m, next);
+        pi_update(next);
+    }
+    spinlock_release(pi_lock);
+
+    if(next) {
+        uintptr_t o = (uintptr_t) next;
+        if(!thread_list_empty(&m->waiters.waiters))
+            o |= MUTEX_WAITERS;
+
+        __barrier;
+        m->owner = o;
+
+        thread_wake(next);
+    } else {
+        m->owner = 0;
+    }
+
+    wait_queue_unlock(&m->waiters);
+}
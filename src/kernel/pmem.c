@@ -14,60 +14,536 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+
 #include <types.h>
 #include <system.h>
-#include <malloc.h>
+#include <spinlock.h>
+#include <interrupts.h>
+#include <multicpu.h>
 #include <assert.h>
 #include <util.h>
 #include <pmem.h>
+#include <vmem.h>
+#include <mmiopool.h>
+#include <waitqueue.h>
 #include <io.h>
 
-static void *page_stack = 0;
+#define BITS_PER_WORD		32
+#define WORD_SHIFT			5
+
+#define MAGAZINE_SIZE		32
+#define MAGAZINE_BATCH		(MAGAZINE_SIZE / 2)
+
+#define ZERO_POOL_SIZE		64
+#define ZERO_POOL_LOW		(ZERO_POOL_SIZE / 2)
+
+/// A zone of physical memory, tracked by a bitmap with one bit per page (set
+/// if the page is free). The summary has one bit per bitmap word, set if the
+/// word has at least one free page, so searches can skip fully allocated
+/// runs of 32 pages at a time.
+struct pmem_zone {
+	paddr_t base;
+	size_t pages;
+	size_t words;
+	size_t summary_words;
+
+	uint32_t *bitmap;
+	uint32_t *summary;
+
+	/// Bitmap word where the last allocation was satisfied.
+	size_t rover;
+
+	size_t nfree;
+
+	spinlock_t lock;
+	char lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+};
+
+static struct pmem_zone zones[PMEM_ZONE_COUNT];
+
+/// Per-CPU cache of free standard pages, so single page allocations and frees
+/// don't all contend on the zone lock. Refilled from and drained to the zone
+/// in batches. Only touched by its own CPU, with interrupts disabled. These
+/// can't come from the heap, as growing the heap allocates pages.
+struct pmem_magazine {
+	size_t count;
+	paddr_t pages[MAGAZINE_SIZE];
+};
+
+static struct pmem_magazine magazines[MULTICPU_MAX_CPUS];
+static volatile size_t nmagazines = 0;
+
+/// Pages cleared ahead of time by pmem_zero_thread, so callers that need a
+/// clean page don't have to clear it on their own path. The wait queue's
+/// lock protects the pool, and the zeroing thread sleeps on it while the
+/// pool is full.
+struct pmem_zero_pool {
+	paddr_t pages[ZERO_POOL_SIZE];
+	size_t count;
+
+	/// Virtual pages pages are mapped at to be cleared, one for each CPU,
+	/// indexed as the CPU's magazine is.
+	vaddr_t windows;
+
+	/// Set once the zeroing thread has started, so the wait queue is usable
+	/// and the windows are reserved.
+	int ready;
+
+	wait_queue_t wq;
+};
+
+static struct pmem_zero_pool zero_pool;
+
+static size_t bitcount(uint32_t v) {
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+/// Sets bits in the given bitmap word, keeping the summary and free count
+/// up to date. Returns the number of pages that were already free.
+static size_t zone_set(struct pmem_zone *z, size_t w, uint32_t mask) {
+	uint32_t old = z->bitmap[w];
+	size_t already = bitcount(old & mask);
+
+	z->bitmap[w] = old | mask;
+	z->nfree += bitcount(mask) - already;
+
+	if(!old)
+		z->summary[w >> WORD_SHIFT] |= 1U << (w & (BITS_PER_WORD - 1));
+
+	return already;
+}
+
+/// Clears bits in the given bitmap word (all must be set).
+static void zone_clear(struct pmem_zone *z, size_t w, uint32_t mask) {
+	z->bitmap[w] &= ~mask;
+	z->nfree -= bitcount(mask);
+
+	if(!z->bitmap[w])
+		z->summary[w >> WORD_SHIFT] &= ~(1U << (w & (BITS_PER_WORD - 1)));
+}
+
+static paddr_t zone_page(struct pmem_zone *z, size_t w, size_t bit) {
+	return z->base + (((paddr_t) ((w << WORD_SHIFT) + bit)) * PAGE_SIZE);
+}
+
+static paddr_t zone_alloc_one(struct pmem_zone *z) {
+	size_t i, s = z->rover >> WORD_SHIFT;
+
+	if(!z->nfree)
+		return 0;
+
+	// Walk the summary from the rover, wrapping around to the start.
+	for(i = 0; i < z->summary_words; i++, s++) {
+		if(s >= z->summary_words)
+			s = 0;
+
+		if(!z->summary[s])
+			continue;
+
+		size_t w = (s << WORD_SHIFT) + (size_t) __builtin_ctz(z->summary[s]);
+		size_t bit = (size_t) __builtin_ctz(z->bitmap[w]);
+
+		zone_clear(z, w, 1U << bit);
+		z->rover = w;
+
+		return zone_page(z, w, bit);
+	}
+
+	return 0;
+}
 
-static paddr_t freeKiB = 0;
+static paddr_t zone_alloc_contig(struct pmem_zone *z, size_t order) {
+	size_t n = 1UL << order, w, s, bit;
+
+	if(z->nfree < n)
+		return 0;
+
+	if(n <= BITS_PER_WORD) {
+		// Run fits in a single word: look for an aligned group of free bits.
+		uint32_t mask = (n == BITS_PER_WORD) ? ~0U : ((1U << n) - 1);
+		for(s = 0; s < z->summary_words; s++) {
+			uint32_t summ = z->summary[s];
+			while(summ) {
+				size_t idx = (size_t) __builtin_ctz(summ);
+				summ &= ~(1U << idx);
+
+				w = (s << WORD_SHIFT) + idx;
+				for(bit = 0; bit < BITS_PER_WORD; bit += n) {
+					if((z->bitmap[w] & (mask << bit)) == (mask << bit)) {
+						zone_clear(z, w, mask << bit);
+						return zone_page(z, w, bit);
+					}
+				}
+			}
+		}
+	} else {
+		// Run spans whole words, which must all be completely free.
+		size_t nw = n >> WORD_SHIFT, i;
+		for(w = 0; (w + nw) <= z->words; w += nw) {
+			for(i = 0; i < nw; i++) {
+				if(z->bitmap[w + i] != ~0U)
+					break;
+			}
+
+			if(i < nw)
+				continue;
+
+			for(i = 0; i < nw; i++)
+				zone_clear(z, w + i, ~0U);
+			return zone_page(z, w, 0);
+		}
+	}
+
+	return 0;
+}
+
+/// Marks [first, first + count) (page indices) free, a word at a time where
+/// possible. Returns the number of pages that were already free.
+static size_t zone_free_range(struct pmem_zone *z, size_t first, size_t count) {
+	size_t already = 0;
+
+	while(count) {
+		size_t w = first >> WORD_SHIFT, bit = first & (BITS_PER_WORD - 1);
+		size_t n = BITS_PER_WORD - bit;
+		if(n > count)
+			n = count;
+
+		uint32_t mask = (n == BITS_PER_WORD) ? ~0U : (((1U << n) - 1) << bit);
+		already += zone_set(z, w, mask);
+
+		first += n;
+		count -= n;
+	}
+
+	return already;
+}
+
+/// Gets this CPU's magazine, or null if per-CPU data is not yet available.
+/// Interrupts must be disabled.
+static struct pmem_magazine *get_magazine() {
+	struct pmem_magazine **p = (struct pmem_magazine **) multicpu_percpu_at(MULTICPU_PERCPU_PAGECACHE);
+	if(!p)
+		return 0;
+
+	if(!*p) {
+		size_t idx = multicpu_slot_claim(&nmagazines, MULTICPU_MAX_CPUS);
+		if(idx >= MULTICPU_MAX_CPUS)
+			return 0;
+
+		*p = &magazines[idx];
+	}
+
+	return *p;
+}
+
+static size_t magazine_refill(struct pmem_magazine *m, struct pmem_zone *z) {
+	spinlock_acquire(z->lock);
+	while(m->count < MAGAZINE_BATCH) {
+		paddr_t p = zone_alloc_one(z);
+		if(!p)
+			break;
+
+		m->pages[m->count++] = p;
+	}
+	spinlock_release(z->lock);
+
+	return m->count;
+}
+
+static void magazine_drain(struct pmem_magazine *m, struct pmem_zone *z, size_t n) {
+	spinlock_acquire(z->lock);
+	while(n-- && m->count) {
+		paddr_t p = m->pages[--m->count];
+		zone_free_range(z, (size_t) ((p - z->base) / PAGE_SIZE), 1);
+	}
+	spinlock_release(z->lock);
+}
+
+size_t pmem_zone_metasize(size_t pages) {
+	size_t words = (pages + BITS_PER_WORD - 1) >> WORD_SHIFT;
+	size_t summary_words = (words + BITS_PER_WORD - 1) >> WORD_SHIFT;
+	return (words + summary_words) * sizeof(uint32_t);
+}
+
+void pmem_zone_init(size_t how, paddr_t base, size_t pages, void *meta) {
+	assert(how < PMEM_ZONE_COUNT);
+
+	struct pmem_zone *z = &zones[how];
+
+	z->base = base;
+	z->pages = pages;
+	z->words = (pages + BITS_PER_WORD - 1) >> WORD_SHIFT;
+	z->summary_words = (z->words + BITS_PER_WORD - 1) >> WORD_SHIFT;
+	z->bitmap = (uint32_t *) meta;
+	z->summary = z->bitmap + z->words;
+	z->rover = 0;
+	z->nfree = 0;
+	z->lock = create_spinlock_at(z->lock_region, sizeof(z->lock_region));
+
+	// Everything starts out allocated.
+	memset(meta, 0, pmem_zone_metasize(pages));
+}
 
 paddr_t pmem_freek() {
-	return freeKiB;
+	size_t i, n = zones[PMEM_SPECIAL_STANDARD].nfree;
+
+	// Pages sitting in magazines or the zeroed pool are still free.
+	for(i = 0; i < nmagazines && i < MULTICPU_MAX_CPUS; i++)
+		n += magazines[i].count;
+	n += zero_pool.count;
+
+	return (n * PAGE_SIZE) / 1024;
 }
 
-paddr_t pmem_alloc() {
-	struct phys_page *page = 0;
+paddr_t pmem_alloc_special(size_t how) {
+	if(how >= PMEM_ZONE_COUNT)
+		return 0;
+
+	struct pmem_zone *z = &zones[how];
+	if(!z->bitmap)
+		return 0;
+
+	spinlock_acquire(z->lock);
+	paddr_t ret = zone_alloc_one(z);
+	spinlock_release(z->lock);
+
+	return ret;
+}
+
+/// Takes a page from the zeroed pool, or returns zero if it is empty. Wakes
+/// the zeroing thread once the pool runs low.
+static paddr_t zero_pool_take() {
+	paddr_t ret = 0;
+
+	if(!zero_pool.ready)
+		return 0;
+
+	wait_queue_lock(&zero_pool.wq);
+	if(zero_pool.count)
+		ret = zero_pool.pages[--zero_pool.count];
+	if(zero_pool.count <= ZERO_POOL_LOW)
+		wait_queue_wake_one_locked(&zero_pool.wq);
+	wait_queue_unlock(&zero_pool.wq);
+
+	return ret;
+}
+
+/// Allocates a standard page through this CPU's magazine.
+static paddr_t alloc_page() {
+	struct pmem_zone *z = &zones[PMEM_SPECIAL_STANDARD];
 	paddr_t ret = 0;
 
-	if(page_stack == 0)
+	if(!z->bitmap)
 		return 0;
 
-	page = (struct phys_page *) stack_pop(page_stack);
+	int ints = interrupts_get();
+	interrupts_disable();
+
+	struct pmem_magazine *m = get_magazine();
+	if(m && (m->count || magazine_refill(m, z)))
+		ret = m->pages[--m->count];
+
+	if(ints)
+		interrupts_enable();
+
+	// No magazine yet, or the zone is empty. Other CPUs may still be holding
+	// a few pages in their magazines, but we can't reach in to those.
+	if(!m)
+		ret = pmem_alloc_special(PMEM_SPECIAL_STANDARD);
+
+	return ret;
+}
+
+paddr_t pmem_alloc() {
+	paddr_t ret = alloc_page();
+
+	// Out of memory - the zeroed pool is the last resort.
+	if(!ret)
+		ret = zero_pool_take();
+
+	return ret;
+}
+
+paddr_t pmem_alloc_zeroed(int *zeroed) {
+	paddr_t ret = zero_pool_take();
+
+	*zeroed = ret ? 1 : 0;
+	if(!ret)
+		ret = alloc_page();
+
+	return ret;
+}
+
+/// Clears a page through this CPU's window. Pages zeroed for the pool may sit
+/// there a while, so they can bypass the cache.
+static int zero_page(paddr_t p, int stream __unused) {
+	if(!zero_pool.ready)
+		return -1;
+
+	// Interrupts stay disabled so we can't migrate to a CPU holding a stale
+	// translation for the window.
+	int ints = interrupts_get();
+	interrupts_disable();
+
+	int ret = -1;
+	struct pmem_magazine *m = get_magazine();
+	if(m) {
+		vaddr_t window = zero_pool.windows + ((size_t) (m - magazines) * PAGE_SIZE);
+
+		vmem_map(window, p, VMEM_READWRITE | VMEM_SUPERVISOR);
+#ifdef X86
+		if(stream)
+			arch_memset_stream((void *) window, 0, PAGE_SIZE);
+		else
+#endif
+			memset((void *) window, 0, PAGE_SIZE);
+		vmem_unmap_local(window);
+		ret = 0;
+	}
+
+	if(ints)
+		interrupts_enable();
+
+	return ret;
+}
+
+int pmem_zero_page(paddr_t p) {
+	return zero_page(p, 0);
+}
+
+void pmem_zero_thread(void *p __unused) {
+	interrupts_enable();
+
+	paddr_t page = alloc_page();
 	if(!page)
+		return;
+
+	// Reserve the windows. Mapping them once creates their page tables, so
+	// later mappings of a window never need to allocate. Nothing touches
+	// the frames mapped here before they are unmapped again.
+	zero_pool.windows = (vaddr_t) mmiopool_alloc(MULTICPU_MAX_CPUS * PAGE_SIZE, page);
+	if(!zero_pool.windows) {
+		pmem_dealloc(page);
+		return;
+	}
+	vmem_unmap_range(zero_pool.windows, MULTICPU_MAX_CPUS, 0);
+
+	wait_queue_init(&zero_pool.wq);
+	__barrier;
+	zero_pool.ready = 1;
+
+	while(1) {
+		// A CPU past the last window can't clear pages.
+		if(page && (zero_page(page, 1) < 0)) {
+			pmem_dealloc(page);
+			page = 0;
+		}
+
+		if(page) {
+			wait_queue_lock(&zero_pool.wq);
+			zero_pool.pages[zero_pool.count++] = page;
+			wait_queue_unlock(&zero_pool.wq);
+		}
+
+		// Sleep while the pool is full. If memory ran out, sleep until the
+		// pool runs low - by then some memory may have been freed.
+		wait_queue_lock(&zero_pool.wq);
+		if(!page || zero_pool.count >= ZERO_POOL_SIZE)
+			wait_queue_sleep_locked(&zero_pool.wq);
+		else
+			wait_queue_unlock(&zero_pool.wq);
+
+		page = alloc_page();
+	}
+}
+
+paddr_t pmem_alloc_contig(size_t order) {
+	struct pmem_zone *z = &zones[PMEM_SPECIAL_STANDARD];
+	if(!z->bitmap)
 		return 0;
-	ret = page->addr;
-	free_nolock(page);
 
-	freeKiB -= PAGE_SIZE / 1024;
+	if(!order)
+		return pmem_alloc();
+
+	spinlock_acquire(z->lock);
+	paddr_t ret = zone_alloc_contig(z, order);
+	spinlock_release(z->lock);
 
 	return ret;
 }
 
+static void zone_dealloc(struct pmem_zone *z, paddr_t p, size_t pages) {
+	if(!z->bitmap)
+		return;
+
+	if((p < z->base) || (((p - z->base) / PAGE_SIZE) + pages) > z->pages) {
+		dprintf("pmem: freeing %llx which is outside the zone\n", p);
+		return;
+	}
+
+	size_t first = (size_t) ((p - z->base) / PAGE_SIZE);
+
+	spinlock_acquire(z->lock);
+	size_t already = zone_free_range(z, first, pages);
+	spinlock_release(z->lock);
+
+	if(already)
+		dprintf("pmem: %d page(s) at %llx were already free\n", already, p);
+}
+
+void pmem_dealloc_range(paddr_t p, size_t pages) {
+	zone_dealloc(&zones[PMEM_SPECIAL_STANDARD], p & ~((paddr_t) PAGE_SIZE - 1), pages);
+}
+
 void pmem_dealloc(paddr_t p) {
-	struct phys_page *page = 0;
+	struct pmem_zone *z = &zones[PMEM_SPECIAL_STANDARD];
+	struct pmem_magazine *m = 0;
+
+	p &= ~((paddr_t) PAGE_SIZE - 1);
 
-	// No page stack? Create one, and configure it to use non-locked versions
-	// of malloc and free.
-	if(page_stack == 0) {
-		page_stack = create_stack();
-		stack_flags(page_stack, STACK_FLAGS_NOMEMLOCK);
+	int ints = interrupts_get();
+	interrupts_disable();
+
+	if(z->bitmap && (p >= z->base) && (((p - z->base) / PAGE_SIZE) < z->pages)) {
+		m = get_magazine();
+		if(m) {
+			if(m->count == MAGAZINE_SIZE)
+				magazine_drain(m, z, MAGAZINE_BATCH);
+			m->pages[m->count++] = p;
+		}
 	}
 
-	page = (struct phys_page *) malloc_nolock(sizeof(struct phys_page));
-	page->addr = p;
+	if(ints)
+		interrupts_enable();
 
-	stack_push(page_stack, page);
+	if(!m)
+		pmem_dealloc_range(p, 1);
+}
 
-	freeKiB += PAGE_SIZE / 1024;
+void pmem_dealloc_contig(paddr_t p, size_t order) {
+	pmem_dealloc_range(p, 1UL << order);
 }
 
-void pmem_pin(paddr_t p __unused) {
-	/// \note Do we even need this function?
-	assert(0);
+void pmem_dealloc_special(size_t how, paddr_t p) {
+	if(how >= PMEM_ZONE_COUNT)
+		return;
+
+	zone_dealloc(&zones[how], p & ~((paddr_t) PAGE_SIZE - 1), 1);
 }
 
+void pmem_pin(paddr_t p) {
+	struct pmem_zone *z = &zones[PMEM_SPECIAL_STANDARD];
+	if(!z->bitmap || (p < z->base) || (((p - z->base) / PAGE_SIZE) >= z->pages))
+		return;
+
+	size_t page = (size_t) ((p - z->base) / PAGE_SIZE);
+	size_t w = page >> WORD_SHIFT;
+	uint32_t mask = 1U << (page & (BITS_PER_WORD - 1));
+
+	spinlock_acquire(z->lock);
+	if(z->bitmap[w] & mask)
+		zone_clear(z, w, mask);
+	spinlock_release(z->lock);
+}
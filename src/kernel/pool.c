@@ -22,6 +22,7 @@
 #include <vmem.h>
 #include <pmem.h>
 #include <io.h>
+#include <vmregion.h>
 
 struct pool {
     uintptr_t base;
@@ -29,6 +30,12 @@ struct pool {
     size_t buffer_size;
     size_t buffer_count;
     size_t alloc_count;
+
+    /// Bytes at the bottom of each buffer that are left unmapped.
+    size_t guard;
+
+    /// Set if buffers are committed a page at a time as they're touched.
+    struct vm_region *region;
 };
 
 static uintptr_t pool_base = POOL_BASE;
@@ -51,6 +58,8 @@ void *create_pool_at(size_t buffsz, size_t buffcnt, uintptr_t addr) {
     ret->alloc_count = 0;
     ret->buffer_count = buffcnt;
     ret->buffer_size = buffsz;
+    ret->guard = 0;
+    ret->region = 0;
 
     size_t wordcount = buffcnt / 32;
     if(!wordcount) wordcount = 1;
@@ -62,7 +71,26 @@ void *create_pool_at(size_t buffsz, size_t buffcnt, uintptr_t addr) {
     return (void *) ret;
 }
 
-void *pool_alloc(void *pool) {
+void *create_pool_reserved(size_t buffsz, size_t buffcnt, uintptr_t addr, size_t guard) {
+    struct pool *ret = (struct pool *) create_pool_at(buffsz, buffcnt, addr);
+    ret->guard = guard;
+
+    // Without a page fault handler, buffers have to be mapped in full.
+    if(!vmregion_ready())
+        return (void *) ret;
+
+    ret->region = (struct vm_region *) malloc(sizeof(struct vm_region));
+    ret->region->base = addr;
+    ret->region->end = addr + (buffsz * buffcnt);
+    ret->region->stride = buffsz;
+    ret->region->guard = guard;
+    ret->region->flags = VMEM_READWRITE | VMEM_SUPERVISOR;
+    vmregion_add(ret->region);
+
+    return (void *) ret;
+}
+
+static void *do_pool_alloc(void *pool, int zero) {
     if(!pool)
         return 0;
     struct pool *p = (struct pool *) pool;
@@ -83,12 +111,34 @@ void *pool_alloc(void *pool) {
     }
 
     buffer_idx += word * 32;
-    uintptr_t addr = p->base + (buffer_idx * p->buffer_size);
-
-    if(!vmem_ismapped(addr)) {
-        for(size_t i = 0; i < ((p->buffer_size + 0xFFF) / 0x1000); i++) {
-            vmem_map(addr + (i * 0x1000), (paddr_t) ~0, VMEM_READWRITE | VMEM_SUPERVISOR);
+    uintptr_t addr = p->base + (buffer_idx * p->buffer_size) + p->guard;
+    size_t len = p->buffer_size - p->guard;
+
+    if(p->region) {
+        // Untouched pages will be zero-filled when they're committed, but a
+        // recycled buffer may still have dirty pages mapped.
+        for(size_t i = 0; zero && (i < ((len + 0xFFF) / 0x1000)); i++) {
+            vaddr_t page = addr + (i * 0x1000);
+            if(vmem_ismapped(page))
+                memset((void *) page, 0, 0x1000);
         }
+    } else if(!vmem_ismapped(addr)) {
+        for(size_t i = 0; i < ((len + 0xFFF) / 0x1000); i++) {
+            vaddr_t page = addr + (i * 0x1000);
+            if(!zero) {
+                vmem_map(page, (paddr_t) ~0, VMEM_READWRITE | VMEM_SUPERVISOR);
+                continue;
+            }
+
+            // Pre-zeroed pages only need clearing if the pool ran dry.
+            int zeroed = 0;
+            paddr_t phys = pmem_alloc_zeroed(&zeroed);
+            vmem_map(page, phys ? phys : (paddr_t) ~0, VMEM_READWRITE | VMEM_SUPERVISOR);
+            if(!zeroed)
+                memset((void *) page, 0, 0x1000);
+        }
+    } else if(zero) {
+        memset((void *) addr, 0, len);
     }
 
     p->alloc_count++;
@@ -97,6 +147,14 @@ void *pool_alloc(void *pool) {
     return (void *) addr;
 }
 
+void *pool_alloc(void *pool) {
+    return do_pool_alloc(pool, 0);
+}
+
+void *pool_alloc_zeroed(void *pool) {
+    return do_pool_alloc(pool, 1);
+}
+
 static int do_pool_dealloc(void *pool, void *p) {
     if(!pool)
         return -1;
@@ -121,16 +179,10 @@ void pool_dealloc(void *pool, void *p) {
 void pool_dealloc_and_free(void *pool, void *p) {
     if(do_pool_dealloc(pool, p) >= 0) {
         struct pool *s = (struct pool *) pool;
-        uintptr_t addr = (uintptr_t) p;
-
-        for(size_t i = 0; i < ((s->buffer_size + 0xFFF) / 0x1000); i++) {
-            paddr_t phys = vmem_v2p(addr);
-            vmem_unmap(addr);
+        uintptr_t addr = (uintptr_t) p - s->guard;
 
-            pmem_dealloc(phys);
-
-            addr += (i * 0x1000);
-        }
+        // Unmapped pages, such as the guard, are skipped.
+        vmem_unmap_range(addr, (s->buffer_size + 0xFFF) / 0x1000, 1);
     }
 }
 
@@ -17,11 +17,20 @@
 #include <compiler.h>
 #include <malloc.h>
 
+#ifndef _UNIT_TESTING
+#include <types.h>
+#include <slab.h>
+#include <rcu.h>
+#endif
+
 #define QUEUE_MAGIC		0xDEADBEEF
 
 struct node {
 	void *p;
 	struct node *next;
+#ifndef _UNIT_TESTING
+	struct rcu_head rcu;
+#endif
 };
 
 struct queue {
@@ -31,11 +40,47 @@ struct queue {
 	size_t len __aligned(4);
 };
 
+#ifdef _UNIT_TESTING
+#define node_alloc()	((struct node *) malloc(sizeof(struct node)))
+#define node_free(n)	free(n)
+
+// The unit tests don't have RCU, so nodes are freed immediately.
+#define node_retire(n)	node_free(n)
+#define rcu_read_lock()
+#define rcu_read_unlock()
+
+#define atomic_inc(m)	__sync_fetch_and_add(&(m), 1)
+#define atomic_dec(m)	__sync_fetch_and_sub(&(m), 1)
+#else
+/// Nodes are pushed and popped on every reschedule, so they get their own
+/// cache rather than going through malloc.
+static struct kmem_cache *node_cache = 0;
+
+static struct node *node_alloc() {
+	kmem_cache_get(&node_cache, "queue_node", sizeof(struct node), 0, 0);
+	return (struct node *) kmem_cache_alloc(node_cache);
+}
+
+static void node_free(struct node *n) {
+	kmem_cache_free(node_cache, n);
+}
+
+static void node_reclaim(struct rcu_head *h) {
+	node_free((struct node *) (((uintptr_t) h) - offsetof(struct node, rcu)));
+}
+
+/// Another CPU may still be looking at a popped node (and comparing against
+/// its address), so it can't be reused until every CPU has moved on.
+static void node_retire(struct node *n) {
+	call_rcu(&n->rcu, node_reclaim);
+}
+#endif
+
 void *create_queue() {
 	void *ret = malloc(sizeof(struct queue));
 	struct queue *q = (struct queue *) ret;
 
-	struct node *base = (struct node *) malloc(sizeof(struct node));
+	struct node *base = node_alloc();
 	base->p = (void *) QUEUE_MAGIC;
 	base->next = NULL;
 
@@ -55,14 +100,14 @@ void delete_queue(void *queue) {
 	while(n) {
 		tmp = n;
 		n = n->next;
-		free(tmp);
+		node_free(tmp);
 
 		if(tmp == q->base)
 			q->base = NULL;
 	}
 
 	if(q->base != NULL)
-		free(q->base);
+		node_free(q->base);
 
 	free(q);
 }
@@ -72,10 +117,12 @@ void queue_push(void *queue, void *data) {
 		return;
 
 	struct queue *q = (struct queue *) queue;
-	struct node *n = (struct node *) malloc(sizeof(struct node));
+	struct node *n = node_alloc();
 	n->p = data;
 	n->next = 0;
 
+	rcu_read_lock();
+
 	struct node *tail, *next;
 	while(1) {
 		tail = q->tail;
@@ -93,6 +140,8 @@ void queue_push(void *queue, void *data) {
 
 	(void) atomic_val_compare_and_swap(&q->tail, tail, n);
 	atomic_inc(q->len);
+
+	rcu_read_unlock();
 }
 
 void *queue_pop(void *queue) {
@@ -101,6 +150,8 @@ void *queue_pop(void *queue) {
 
 	struct queue *q = (struct queue *) queue;
 
+	rcu_read_lock();
+
 	void *ret = 0;
 	struct node *head, *tail, *next;
 	while(1) {
@@ -111,6 +162,7 @@ void *queue_pop(void *queue) {
 		if(head == q->head) {
 			if(head == tail) {
 				if(next == NULL) {
+					rcu_read_unlock();
 					return 0;
 				} else {
 					(void) atomic_val_compare_and_swap(&q->tail, tail, next);
@@ -124,7 +176,9 @@ void *queue_pop(void *queue) {
 		}
 	}
 
-	free(head);
+	rcu_read_unlock();
+
+	node_retire(head);
 
 	atomic_dec(q->len);
 	return ret;
@@ -135,9 +189,11 @@ int queue_empty(void *queue) {
 		return 0;
 
 	struct queue *q = (struct queue *) queue;
-	if((q->head == q->tail) && (q->head->next == NULL)) {
-		return 1;
-	} else {
-		return 0;
-	}
+
+	rcu_read_lock();
+	struct node *head = q->head;
+	int ret = (head == q->tail) && (head->next == NULL);
+	rcu_read_unlock();
+
+	return ret;
 }
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <types.h>
+#include <rcu.h>
+#include <interrupts.h>
+#include <multicpu.h>
+#include <malloc.h>
+#include <assert.h>
+#include <util.h>
+
+#define ACCESS_ONCE(x)      (*(volatile __typeof__(x) *) &(x))
+
+/// Wrap-safe comparison of epochs.
+#define EPOCH_BEFORE(a, b)  (((int32_t) ((a) - (b))) < 0)
+
+/**
+ * Epochs work as follows. The global epoch only advances once every
+ * registered CPU has passed a quiescent state in the current one. An object
+ * retired in epoch E may still be held by a reader that started before it was
+ * retired, but every CPU passes a quiescent state during E + 1, which began
+ * after the object was retired - so by E + 2 no reader can hold it.
+ */
+struct rcu_cpu {
+    /// Epoch seen at this CPU's last quiescent state.
+    volatile uint32_t seen;
+
+    /// Epoch in which lagging CPUs were last asked to reschedule.
+    uint32_t kicked;
+
+    uint32_t cpu;
+
+    /// Read-side nesting, and the interrupt state from before the outermost.
+    size_t depth;
+    int wasints;
+
+    /// Retired objects, oldest first.
+    struct rcu_head *head;
+    struct rcu_head *tail;
+};
+
+static volatile uint32_t rcu_epoch = 0;
+
+static struct rcu_cpu *rcu_cpus[MULTICPU_MAX_CPUS] = {0};
+static volatile size_t rcu_ncpus = 0;
+
+/// The boot CPU's state, which is also used before per-CPU data exists.
+static struct rcu_cpu boot_cpu;
+
+static struct rcu_cpu *get_cpu() {
+    struct rcu_cpu **p = (struct rcu_cpu **) multicpu_percpu_at(MULTICPU_PERCPU_RCU);
+    if(p && *p)
+        return *p;
+
+    return &boot_cpu;
+}
+
+/// Advances the global epoch if every CPU has seen the current one, otherwise
+/// nudges the CPUs that haven't (an idle CPU may not reschedule for a while).
+static void try_advance(struct rcu_cpu *c, uint32_t e) {
+    size_t n = rcu_ncpus;
+    __barrier;
+
+    int lagging = 0;
+    for(size_t i = 0; i < n; i++) {
+        // A CPU still registering holds no references yet, so can be skipped.
+        struct rcu_cpu *other = ACCESS_ONCE(rcu_cpus[i]);
+        if(other && EPOCH_BEFORE(other->seen, e)) {
+            if(c->kicked != e)
+                multicpu_resched(other->cpu);
+            lagging = 1;
+        }
+    }
+
+    if(lagging) {
+        c->kicked = e;
+        return;
+    }
+
+    __barrier;
+    atomic_bool_cas_int(&rcu_epoch, e, e + 1);
+}
+
+void rcu_read_lock() {
+    int wasints = interrupts_get();
+    interrupts_disable();
+
+    struct rcu_cpu *c = get_cpu();
+    if(!c->depth++)
+        c->wasints = wasints;
+}
+
+void rcu_read_unlock() {
+    struct rcu_cpu *c = get_cpu();
+    assert(c->depth);
+
+    if(!--c->depth && c->wasints)
+        interrupts_enable();
+}
+
+void call_rcu(struct rcu_head *h, rcu_callback_t func) {
+    int wasints = interrupts_get();
+    interrupts_disable();
+
+    // The object was unlinked before now, so order that before reading the
+    // epoch it is retired in.
+    __barrier;
+
+    h->next = 0;
+    h->func = func;
+    h->epoch = rcu_epoch;
+
+    struct rcu_cpu *c = get_cpu();
+    if(c->tail)
+        c->tail->next = h;
+    else
+        c->head = h;
+    c->tail = h;
+
+    if(wasints)
+        interrupts_enable();
+}
+
+void rcu_quiescent() {
+    struct rcu_cpu *c = get_cpu();
+
+    // Rescheduling inside a read-side critical section is a bug, but at least
+    // don't make it worse by claiming to be quiescent.
+    if(c->depth)
+        return;
+
+    uint32_t e = rcu_epoch;
+    __barrier;
+    c->seen = e;
+
+    if(!c->head)
+        return;
+
+    try_advance(c, e);
+
+    __barrier;
+    e = rcu_epoch;
+
+    while(c->head && !EPOCH_BEFORE(e, c->head->epoch + 2)) {
+        struct rcu_head *h = c->head;
+        c->head = h->next;
+        if(!c->head)
+            c->tail = 0;
+
+        h->func(h);
+    }
+}
+
+void rcu_cpu_init() {
+    struct rcu_cpu **p = (struct rcu_cpu **) multicpu_percpu_at(MULTICPU_PERCPU_RCU);
+    if(p && *p)
+        return;
+
+    // The first CPU to register is the boot CPU, which may already have used
+    // boot_cpu.
+    struct rcu_cpu *c = &boot_cpu;
+    if(rcu_ncpus) {
+        c = (struct rcu_cpu *) malloc(sizeof(struct rcu_cpu));
+        memset(c, 0, sizeof(struct rcu_cpu));
+    }
+
+    c->cpu = multicpu_id();
+    c->seen = rcu_epoch;
+    c->kicked = c->seen - 1;
+
+    size_t idx = multicpu_slot_claim(&rcu_ncpus, MULTICPU_MAX_CPUS);
+    assert(idx < MULTICPU_MAX_CPUS);
+
+    __barrier;
+    rcu_cpus[idx] = c;
+
+    if(p)
+        *p = c;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <compiler.h>
+#include <malloc.h>
+
+#ifdef _UNIT_TESTING
+#include <stdint.h>
+#include <string.h>
+#include "include/ring.h"
+#else
+#include <types.h>
+#include <util.h>
+#include <ring.h>
+#endif
+
+/// Keeps the producer and consumer positions off each other's cache lines.
+#define RING_CACHE_LINE		64
+
+/// A cell's sequence number orders its data against the other side, so it
+/// only needs acquire/release rather than a full barrier.
+#define load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/**
+ * Each cell's sequence number says whose turn it is. A producer at position
+ * pos may fill the cell once its sequence is pos, and then sets it to pos + 1.
+ * A consumer at pos may empty it once its sequence is pos + 1, and then sets it
+ * to pos + capacity - ready for the producer on the next lap.
+ */
+struct cell {
+	size_t seq;
+};
+
+struct ring {
+	char *cells;
+	size_t mask;
+	size_t elemsz;
+	size_t cellsz;
+	uint32_t flags;
+
+	size_t head __aligned(RING_CACHE_LINE);
+	size_t tail __aligned(RING_CACHE_LINE);
+} __aligned(RING_CACHE_LINE);
+
+static struct cell *cell_at(struct ring *r, size_t pos) {
+	return (struct cell *) (r->cells + ((pos & r->mask) * r->cellsz));
+}
+
+static char *cell_data(struct cell *c) {
+	return ((char *) c) + sizeof(struct cell);
+}
+
+void *create_ring(size_t capacity, size_t elemsz, uint32_t flags) {
+	size_t n = 2;
+	while(n < capacity)
+		n <<= 1;
+
+	struct ring *r = (struct ring *) malloc(sizeof(struct ring));
+	r->mask = n - 1;
+	r->elemsz = elemsz;
+	r->cellsz = (sizeof(struct cell) + elemsz + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+	r->flags = flags;
+	r->head = r->tail = 0;
+
+	r->cells = (char *) malloc(n * r->cellsz);
+	for(size_t i = 0; i < n; i++)
+		cell_at(r, i)->seq = i;
+
+	return (void *) r;
+}
+
+void delete_ring(void *ring) {
+	if(!ring)
+		return;
+
+	struct ring *r = (struct ring *) ring;
+	free(r->cells);
+	free(r);
+}
+
+size_t ring_push_batch(void *ring, const void *elems, size_t n) {
+	if(!ring || !n)
+		return 0;
+
+	struct ring *r = (struct ring *) ring;
+
+	// Claim a run of free cells by moving head past them.
+	size_t pos, count;
+	while(1) {
+		pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+		intptr_t dif = 0;
+		for(count = 0; count < n; count++) {
+			dif = (intptr_t) (load_acquire(&cell_at(r, pos + count)->seq) - (pos + count));
+			if(dif)
+				break;
+		}
+
+		if(!count) {
+			// Full, or another producer got in first.
+			if(dif < 0)
+				return 0;
+			continue;
+		}
+
+		if(r->flags & RING_SP) {
+			store_release(&r->head, pos + count);
+			break;
+		}
+
+		if(atomic_bool_cas_int(&r->head, pos, pos + count))
+			break;
+	}
+
+	for(size_t i = 0; i < count; i++)
+		memcpy(cell_data(cell_at(r, pos + i)), ((const char *) elems) + (i * r->elemsz), r->elemsz);
+
+	// Publish the data.
+	for(size_t i = 0; i < count; i++)
+		store_release(&cell_at(r, pos + i)->seq, pos + i + 1);
+
+	return count;
+}
+
+size_t ring_pop_batch(void *ring, void *elems, size_t n) {
+	if(!ring || !n)
+		return 0;
+
+	struct ring *r = (struct ring *) ring;
+
+	size_t pos, count;
+	while(1) {
+		pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+		intptr_t dif = 0;
+		for(count = 0; count < n; count++) {
+			dif = (intptr_t) (load_acquire(&cell_at(r, pos + count)->seq) - (pos + count + 1));
+			if(dif)
+				break;
+		}
+
+		if(!count) {
+			// Empty, or another consumer got in first.
+			if(dif < 0)
+				return 0;
+			continue;
+		}
+
+		if(r->flags & RING_SC) {
+			store_release(&r->tail, pos + count);
+			break;
+		}
+
+		if(atomic_bool_cas_int(&r->tail, pos, pos + count))
+			break;
+	}
+
+	for(size_t i = 0; i < count; i++)
+		memcpy(((char *) elems) + (i * r->elemsz), cell_data(cell_at(r, pos + i)), r->elemsz);
+
+	// Hand the cells back to producers for their next lap.
+	for(size_t i = 0; i < count; i++)
+		store_release(&cell_at(r, pos + i)->seq, pos + i + r->mask + 1);
+
+	return count;
+}
+
+int ring_push(void *ring, const void *elem) {
+	return ring_push_batch(ring, elem, 1) ? 0 : -1;
+}
+
+int ring_pop(void *ring, void *elem) {
+	return ring_pop_batch(ring, elem, 1) ? 0 : -1;
+}
+
+size_t ring_count(void *ring) {
+	if(!ring)
+		return 0;
+
+	struct ring *r = (struct ring *) ring;
+	size_t tail = load_acquire(&r->tail);
+	size_t head = load_acquire(&r->head);
+
+	return (head > tail) ? (head - tail) : 0;
+}
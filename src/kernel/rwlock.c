@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <types.h>
+#include <rwlock.h>
+#include <spinlock.h>
+#include <waitqueue.h>
+#include <interrupts.h>
+#include <multicpu.h>
+#include <malloc.h>
+#include <assert.h>
+#include <sched.h>
+#include <panic.h>
+#include <util.h>
+
+/// Reader counts are spread over this many slots. CPUs beyond this share.
+#define RWLOCK_SLOTS        8
+
+/// Upper bound on pauses between attempts to take a contended write lock.
+#define BACKOFF_MAX         1024
+
+#define ACCESS_ONCE(x)      (*(volatile __typeof__(x) *) &(x))
+
+/// Each CPU's reader state is packed into its per-CPU word: its reader slot
+/// (plus one, so zero means unassigned), the interrupt state from before its
+/// outermost spinning read lock, and how many spinning read locks it holds.
+#define CPU_SLOT_MASK       0xFFUL
+#define CPU_WASINTS         0x100UL
+#define CPU_DEPTH_SHIFT     9
+#define CPU_DEPTH_ONE       (1UL << CPU_DEPTH_SHIFT)
+
+struct rwlock_slot {
+    int32_t readers;
+} __aligned(SPINLOCK_ALIGN);
+
+struct rwlock {
+    struct rwlock_slot slots[RWLOCK_SLOTS];
+
+    /// Set while a writer holds, or is waiting for readers to leave, the lock.
+    uint32_t writer;
+
+    int how;
+    uint8_t wasints;
+
+    /// Sleeping locks only: readers waiting for the writer to finish, and
+    /// writers waiting for the lock or for readers to leave.
+    wait_queue_t readq;
+    wait_queue_t writeq;
+};
+
+/// Per-CPU reader state until per-CPU data exists, when only one CPU runs.
+static unative_t boot_state = 0;
+
+static uint32_t next_slot = 0;
+
+static int32_t atomic_add(int32_t *p, int32_t v) {
+#ifdef ARM
+    int32_t old;
+    do {
+        old = ACCESS_ONCE(*p);
+    } while(!atomic_bool_compare_and_swap((void **) p, (void *) old, (void *) (old + v)));
+    return old;
+#else
+    return __sync_fetch_and_add(p, v);
+#endif
+}
+
+static int try_claim(uint32_t *p) {
+#ifdef ARM
+    return atomic_bool_compare_and_swap((void **) p, (void *) 0, (void *) 1);
+#else
+    return __sync_bool_compare_and_swap(p, 0, 1);
+#endif
+}
+
+static unative_t *cpu_state() {
+    unative_t *p = (unative_t *) multicpu_percpu_at(MULTICPU_PERCPU_RWLOCK);
+    if(!p)
+        p = &boot_state;
+
+    if(!(*p & CPU_SLOT_MASK))
+        *p |= (unative_t) ((uint32_t) atomic_add((int32_t *) &next_slot, 1) % RWLOCK_SLOTS) + 1;
+
+    return p;
+}
+
+static int32_t *cpu_readers(struct rwlock *rw) {
+    return &rw->slots[(*cpu_state() & CPU_SLOT_MASK) - 1].readers;
+}
+
+static int32_t count_readers(struct rwlock *rw) {
+    int32_t ret = 0;
+    for(size_t i = 0; i < RWLOCK_SLOTS; i++)
+        ret += ACCESS_ONCE(rw->slots[i].readers);
+
+    return ret;
+}
+
+rwlock_t create_rwlock(int how) {
+    struct rwlock *rw = (struct rwlock *) malloc(sizeof(struct rwlock));
+    memset(rw, 0, sizeof(struct rwlock));
+
+    rw->how = how;
+    if(how == RWLOCK_SLEEP) {
+        wait_queue_init(&rw->readq);
+        wait_queue_init(&rw->writeq);
+    }
+
+    return (rwlock_t) rw;
+}
+
+void delete_rwlock(rwlock_t l) {
+    if(!l)
+        return;
+
+    struct rwlock *rw = (struct rwlock *) l;
+    assert(!rw->writer && !count_readers(rw));
+    free(rw);
+}
+
+void rwlock_read_acquire(rwlock_t l) {
+    if(!l)
+        return;
+
+    struct rwlock *rw = (struct rwlock *) l;
+
+    if(rw->how == RWLOCK_SPIN) {
+        uint8_t wasints = interrupts_get();
+        interrupts_disable();
+
+        unative_t *st = cpu_state();
+        if(!(*st >> CPU_DEPTH_SHIFT))
+            *st = wasints ? (*st | CPU_WASINTS) : (*st & ~CPU_WASINTS);
+        *st += CPU_DEPTH_ONE;
+    }
+
+    while(1) {
+        // Count ourselves in, then look for a writer. A writer sets its flag,
+        // then counts readers, so one of the two always sees the other.
+        int32_t *readers = cpu_readers(rw);
+        atomic_add(readers, 1);
+        __barrier;
+
+        if(!ACCESS_ONCE(rw->writer))
+            break;
+
+        atomic_add(readers, -1);
+        __barrier;
+
+        if(rw->how == RWLOCK_SPIN) {
+            while(ACCESS_ONCE(rw->writer)) {
+                if(multicpu_count() == 1)
+                    panic("deadlock in rwlock");
+                spinlock_poll();
+            }
+            continue;
+        }
+
+        // The writer may be waiting for our count to drop.
+        wait_queue_wake_all(&rw->writeq);
+
+        wait_queue_lock(&rw->readq);
+        if(ACCESS_ONCE(rw->writer))
+            wait_queue_sleep_locked(&rw->readq);
+        else
+            wait_queue_unlock(&rw->readq);
+    }
+}
+
+void rwlock_read_release(rwlock_t l) {
+    if(!l)
+        return;
+
+    struct rwlock *rw = (struct rwlock *) l;
+
+    // A sleeping reader may have moved CPU since it counted itself in, but
+    // only the total across slots matters.
+    atomic_add(cpu_readers(rw), -1);
+    __barrier;
+
+    if(rw->how == RWLOCK_SPIN) {
+        unative_t *st = cpu_state();
+        assert(*st >> CPU_DEPTH_SHIFT);
+
+        *st -= CPU_DEPTH_ONE;
+        if(!(*st >> CPU_DEPTH_SHIFT) && (*st & CPU_WASINTS))
+            interrupts_enable();
+    } else if(ACCESS_ONCE(rw->writer)) {
+        wait_queue_wake_all(&rw->writeq);
+    }
+}
+
+void rwlock_write_acquire(rwlock_t l) {
+    if(!l)
+        return;
+
+    struct rwlock *rw = (struct rwlock *) l;
+
+    uint8_t wasints = 0;
+    if(rw->how == RWLOCK_SPIN) {
+        wasints = interrupts_get();
+        interrupts_disable();
+    }
+
+    size_t delay = 1;
+    while(!try_claim(&rw->writer)) {
+        if(rw->how == RWLOCK_SPIN) {
+            if(multicpu_count() == 1)
+                panic("deadlock in rwlock");
+
+            spinlock_poll();
+            for(size_t i = 1; i < delay; i++)
+                __spin;
+            if(delay < BACKOFF_MAX)
+                delay <<= 1;
+            continue;
+        }
+
+        wait_queue_lock(&rw->writeq);
+        if(ACCESS_ONCE(rw->writer))
+            wait_queue_sleep_locked(&rw->writeq);
+        else
+            wait_queue_unlock(&rw->writeq);
+    }
+
+    __barrier;
+
+    // New readers now hold off. Wait for the ones already in to leave.
+    while(count_readers(rw)) {
+        if(rw->how == RWLOCK_SPIN) {
+            spinlock_poll();
+            continue;
+        }
+
+        wait_queue_lock(&rw->writeq);
+        if(count_readers(rw))
+            wait_queue_sleep_locked(&rw->writeq);
+        else
+            wait_queue_unlock(&rw->writeq);
+    }
+
+    rw->wasints = wasints;
+}
+
+void rwlock_write_release(rwlock_t l) {
+    if(!l)
+        return;
+
+    struct rwlock *rw = (struct rwlock *) l;
+    assert(rw->writer);
+
+    uint8_t wasints = rw->wasints;
+
+    __barrier;
+    ACCESS_ONCE(rw->writer) = 0;
+
+    if(rw->how == RWLOCK_SPIN) {
+        if(wasints)
+            interrupts_enable();
+        return;
+    }
+
+    wait_queue_wake_one(&rw->writeq);
+    wait_queue_wake_all(&rw->readq);
+}
@@ -21,6 +21,7 @@
 #include <pmem.h>
 #include <util.h>
 #include <io.h>
+#include <vmregion.h>
 
 // #define VERBOSE_SBRK
 
@@ -31,6 +32,34 @@ static char prime_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
 
 #define PAGE_ALIGNED(x) ((x) & (uintptr_t) ~(PAGE_SIZE - 1))
 
+#define HEAP_FLAGS      (VMEM_READWRITE | VMEM_SUPERVISOR | VMEM_GLOBAL)
+
+/// Everything below the break is reserved, and committed as it's touched once
+/// page faults can be handled.
+static struct vm_region heap_region = {HEAP_BASE, HEAP_BASE, 0, 0, HEAP_FLAGS, 0};
+
+/// Once the heap has outgrown its first large page, it grows a large page at
+/// a time while physically contiguous memory lasts. Returns 1 if v is now
+/// backed by a large page's worth of memory.
+static int grow_large(vaddr_t v) {
+	size_t pages = LARGE_PAGE_SIZE / PAGE_SIZE;
+
+	if((v & (LARGE_PAGE_SIZE - 1)) || (v < (HEAP_BASE + LARGE_PAGE_SIZE)) || ((v + LARGE_PAGE_SIZE) > SLAB_BASE))
+		return 0;
+
+	paddr_t p = pmem_alloc_contig(LARGE_PAGE_ORDER);
+	if(p == 0)
+		return 0;
+
+	if(vmem_map_range(v, p, pages, HEAP_FLAGS) < 0) {
+		vmem_unmap_range(v, pages, 0);
+		pmem_dealloc_contig(p, LARGE_PAGE_ORDER);
+		return 0;
+	}
+
+	return 1;
+}
+
 void *dlmalloc_sbrk(intptr_t incr) {
 	uintptr_t old = base;
 
@@ -43,8 +72,11 @@ void *dlmalloc_sbrk(intptr_t incr) {
 		// malloc, so we need a little bit of static space to kick things off.
 		memset(first_page, 0, PAGE_SIZE);
 		vmem_prime(log2phys((paddr_t) prime_page));
-		vmem_map(HEAP_BASE, log2phys((paddr_t) first_page), VMEM_READWRITE | VMEM_SUPERVISOR | VMEM_GLOBAL);
+		vmem_map(HEAP_BASE, log2phys((paddr_t) first_page), HEAP_FLAGS);
 		base = old = HEAP_BASE;
+
+		heap_region.end = HEAP_BASE + PAGE_SIZE;
+		vmregion_add(&heap_region);
 	}
 
 	if(incr == 0)
@@ -54,28 +86,51 @@ void *dlmalloc_sbrk(intptr_t incr) {
 		incr = -incr;
 		base -= (uintptr_t) incr;
 
-		// Unmap.
-		vaddr_t v = old;
-		if(PAGE_ALIGNED(old) != PAGE_ALIGNED(base)) {
-			for(; v > base; v -= PAGE_SIZE) {
-				if(vmem_ismapped(v)) {
-					paddr_t p = vmem_v2p(v);
-					vmem_unmap(v);
-					pmem_dealloc(p);
-				}
-			}
-		}
+		// Stop faults committing anything above the new break first.
+		heap_region.end = PAGE_ALIGNED(base + PAGE_SIZE - 1);
+
+		// Unmap every page now wholly above the heap, in one go.
+		vaddr_t first = PAGE_ALIGNED(base + PAGE_SIZE - 1);
+		vaddr_t last = PAGE_ALIGNED(old + PAGE_SIZE - 1);
+		if(last > first)
+			vmem_unmap_range(first, (last - first) / PAGE_SIZE, 1);
 
 		// Return the new top of the heap.
 		old = base;
 	} else {
+		// The slab allocator's region starts where the heap ends.
+		if((base + (uintptr_t) incr) > SLAB_BASE)
+			return (void *) ~0UL;
+
 		base += (uintptr_t) incr;
-		if(PAGE_ALIGNED(old) != PAGE_ALIGNED(base)) {
-			vaddr_t v = old;
-			for(; v < base; v += PAGE_SIZE) {
+
+		heap_region.end = PAGE_ALIGNED(base + PAGE_SIZE - 1);
+
+		if(vmregion_ready()) {
+			// Only large pages the heap now covers entirely are worth
+			// committing up front. The rest is left for the fault handler.
+			vaddr_t v = (old + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+			while((v + LARGE_PAGE_SIZE) <= base) {
+				if(vmem_ismapped(v) || !grow_large(v))
+					break;
+
+				v += LARGE_PAGE_SIZE;
+			}
+		} else {
+			// Walk whole pages: the page at an old, page-aligned top of heap
+			// isn't mapped yet either.
+			vaddr_t v = PAGE_ALIGNED(old);
+			while(v < base) {
 				if(vmem_ismapped(v) == 0) {
-					vmem_map(v, (paddr_t) ~0, VMEM_READWRITE | VMEM_SUPERVISOR | VMEM_GLOBAL);
+					if(grow_large(v)) {
+						v += LARGE_PAGE_SIZE;
+						continue;
+					}
+
+					vmem_map(v, (paddr_t) ~0, HEAP_FLAGS);
 				}
+
+				v += PAGE_SIZE;
 			}
 		}
 	}
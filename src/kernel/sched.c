@@ -25,6 +25,11 @@
 #include <spinlock.h>
 #include <multicpu.h>
 #include <interrupts.h>
+#include <slab.h>
+#include <waitqueue.h>
+#include <fpu.h>
+#include <rcu.h>
+#include <mutex.h>
 
 // #define VERBOSE_LOGGING
 
@@ -36,46 +41,88 @@ static size_t nextpid = 0;
 
 #define QUEUE_COUNT (THREAD_PRIORITY_LOW + 1)
 
+/**
+ * A woken thread returns to the run queue it last ran on unless that queue is
+ * this many threads longer than the run queue of the waking CPU.
+ */
+#define SCHED_AFFINITY_SLACK            2
+
+/// Number of 32-bit words needed for one bit per priority level.
+#define PRIO_BITMAP_WORDS               ((QUEUE_COUNT + 31) / 32)
+
+/**
+ * Set of queues, one per priority level. A bit is set in the bitmap for each
+ * level that may have threads in its queue, so the highest priority runnable
+ * thread can be found with a find-first-set rather than by walking queues.
+ */
+struct prio_array {
+    struct thread_list queues[QUEUE_COUNT];
+
+    uint32_t bitmap[PRIO_BITMAP_WORDS];
+
+    /// Number of threads in all queues of this array.
+    atomic_t nr;
+};
+
+/** Per-CPU run queue. */
+struct runqueue {
+    /// Threads that still have time to run in this round.
+    struct prio_array *active;
+
+    /// Threads that used up their timeslice, waiting for the next round.
+    struct prio_array *expired;
+
+    struct prio_array arrays[2];
+
+    /// Number of threads in the queue (only a hint, used for balancing).
+    atomic_t len;
+
+    /// Priority of the thread running on this CPU (QUEUE_COUNT when idle).
+    uint32_t curr_priority;
+
+    /// Set when a thread that should pre-empt the running thread is queued.
+    uint32_t need_resched;
+
+    /// Machine-specific ID of the CPU which owns this run queue.
+    uint32_t cpu;
+
+    /// Protects the arrays - threads are pushed by any waking CPU and popped
+    /// by the owner and by thieves.
+    void *lock;
+};
+
+/// A thread and its context, allocated together.
+struct thread_alloc {
+    struct thread t;
+    context_t ctx;
+};
+
+/// Cache of thread_alloc objects.
+static struct kmem_cache *thread_cache = 0;
+
 /// Global scheduler lock - to ensure queue operations are done atomically.
 static void *sched_spinlock = 0;
 
-/// Ready queue, onto which processes are added when they are ready to be run.
-void *ready_queue = 0;
+/// Run queues of every CPU that has come alive, for work stealing.
+static struct runqueue *runqueues[MULTICPU_MAX_CPUS] = {0};
 
-/// Primary priority queues.
-void *prio_queues[QUEUE_COUNT] = {0};
+/// Number of valid entries in runqueues.
+static volatile size_t nrunqueues = 0;
 
-/// Alternate priority queues.
-void *prio_already_queues[QUEUE_COUNT] = {0};
-
-/// Zombie thread queue.
-static void *zombie_queue = 0;
+/// Threads which have been killed, waiting to be reaped.
+static wait_queue_t zombie_queue;
 
 /// Idle thread in the system that we can clone onto new CPUs as they come up.
 static struct thread *g_idle_thread = 0;
 
-/// Number of threads currently ready to run (excluding idle thread).
-static atomic_t numready = 0;
-
-/// Global priority level.
-static atomic_t priolevel = 0;
-
 /** Initialises the architecture-specific context layer (for create_context). */
 extern void init_context();
 
 static void reschedule_internal(size_t action_on_idle, void *lock);
 
-static void **get_prio_queues() {
-    return (void **) prio_queues;
-}
-
-static void **get_prio_already_queues() {
-    return (void **) prio_already_queues;
-}
-
 static struct thread *get_current_thread() {
     struct thread **current_thread = (struct thread **) multicpu_percpu_at(MULTICPU_PERCPU_CURRTHREAD);
-    return *current_thread;
+    return current_thread ? *current_thread : 0;
 }
 
 static void set_current_thread(struct thread *t) {
@@ -93,21 +140,285 @@ static void set_idle_thread(struct thread *t) {
     *idle_thread = t;
 }
 
-static size_t get_current_priolevel() {
-    return priolevel;
+static struct runqueue *get_runqueue() {
+    struct runqueue **rq = (struct runqueue **) multicpu_percpu_at(MULTICPU_PERCPU_RUNQUEUE);
+    return *rq;
+}
+
+static void set_runqueue(struct runqueue *rq) {
+    struct runqueue **p = (struct runqueue **) multicpu_percpu_at(MULTICPU_PERCPU_RUNQUEUE);
+    *p = rq;
+}
+
+static void prio_mark(struct prio_array *arr, size_t level) {
+    uint32_t *word = &arr->bitmap[level / 32];
+    uint32_t bit = 1U << (level % 32), old;
+    do {
+        old = *word;
+        if(old & bit) {
+            return;
+        }
+    } while(!atomic_bool_compare_and_swap(word, old, old | bit));
+}
+
+static void prio_unmark(struct prio_array *arr, size_t level) {
+    uint32_t *word = &arr->bitmap[level / 32];
+    uint32_t bit = 1U << (level % 32), old;
+    do {
+        old = *word;
+        if(!(old & bit)) {
+            return;
+        }
+    } while(!atomic_bool_compare_and_swap(word, old, old & ~bit));
 }
 
-static void set_current_priolevel(size_t new) {
-    priolevel = new;
+/** Finds the highest priority (lowest numbered) marked level, or QUEUE_COUNT. */
+static size_t prio_first(struct prio_array *arr) {
+    size_t i;
+    for(i = 0; i < PRIO_BITMAP_WORDS; i++) {
+        uint32_t word = arr->bitmap[i];
+        if(word) {
+            return (i * 32) + (size_t) __builtin_ctz(word);
+        }
+    }
+
+    return QUEUE_COUNT;
 }
 
-/// Sets the current priority level, but only if it matches a previous value.
-static void set_current_priolevel_if(size_t new, size_t old) {
-    atomic_val_compare_and_swap(&priolevel, old, new);
+static void prio_array_init(struct prio_array *arr) {
+    size_t i;
+    for(i = 0; i < QUEUE_COUNT; i++) {
+        arr->queues[i].head = arr->queues[i].tail = 0;
+    }
+
+    for(i = 0; i < PRIO_BITMAP_WORDS; i++) {
+        arr->bitmap[i] = 0;
+    }
+
+    arr->nr = 0;
 }
 
-static void increment_priolevel() {
-    atomic_inc(priolevel);
+static void prio_array_push(struct prio_array *arr, struct thread *thr) {
+    size_t level = thr->priority;
+    if(level >= QUEUE_COUNT) {
+        level = QUEUE_COUNT - 1;
+    }
+
+    thread_list_push(&arr->queues[level], thr);
+    thr->queued_level = (uint32_t) level;
+    atomic_inc(arr->nr);
+
+    prio_mark(arr, level);
+}
+
+/** Takes the given thread out of the array, if it is there. */
+static int prio_array_remove(struct prio_array *arr, struct thread *thr) {
+    size_t level = thr->queued_level;
+
+    struct thread *t = arr->queues[level].head;
+    while(t && (t != thr)) {
+        t = t->qnext;
+    }
+
+    if(!t) {
+        return 0;
+    }
+
+    thread_list_remove(&arr->queues[level], thr);
+    if(thread_list_empty(&arr->queues[level])) {
+        prio_unmark(arr, level);
+    }
+
+    atomic_dec(arr->nr);
+    return 1;
+}
+
+static struct thread *prio_array_pop(struct prio_array *arr) {
+    size_t level = prio_first(arr);
+    if(level >= QUEUE_COUNT) {
+        return 0;
+    }
+
+    struct thread *thr = thread_list_pop(&arr->queues[level]);
+    if(thread_list_empty(&arr->queues[level])) {
+        prio_unmark(arr, level);
+    }
+
+    atomic_dec(arr->nr);
+    return thr;
+}
+
+static struct runqueue *create_runqueue() {
+    struct runqueue *rq = (struct runqueue *) malloc(sizeof(struct runqueue));
+    prio_array_init(&rq->arrays[0]);
+    prio_array_init(&rq->arrays[1]);
+    rq->active = &rq->arrays[0];
+    rq->expired = &rq->arrays[1];
+    rq->len = 0;
+    rq->curr_priority = QUEUE_COUNT;
+    rq->need_resched = 0;
+    rq->cpu = multicpu_id();
+    rq->lock = create_spinlock();
+
+    size_t idx = multicpu_slot_claim(&nrunqueues, MULTICPU_MAX_CPUS);
+    if(idx < MULTICPU_MAX_CPUS) {
+        runqueues[idx] = rq;
+    } else {
+        dprintf("scheduler: cpu %d has no slot for work stealing\n", rq->cpu);
+    }
+
+    return rq;
+}
+
+/**
+ * Queues a thread on the given run queue. Threads which used up their timeslice
+ * go onto the expired array so everything else in the active array gets a turn
+ * first; realtime threads never expire.
+ */
+static void rq_push(struct runqueue *rq, struct thread *thr, int expired) {
+    spinlock_acquire(rq->lock);
+
+    if(expired && (thr->base_priority != THREAD_PRIORITY_REALTIME)) {
+        prio_array_push(rq->expired, thr);
+    } else {
+        prio_array_push(rq->active, thr);
+    }
+
+    thr->queued_rq = rq;
+    atomic_inc(rq->len);
+
+    spinlock_release(rq->lock);
+}
+
+/**
+ * Takes the highest priority thread from a run queue. Only the owning CPU may
+ * swap the active and expired arrays - other CPUs just look in both.
+ */
+static struct thread *rq_pop(struct runqueue *rq, int owner) {
+    spinlock_acquire(rq->lock);
+
+    struct prio_array *from = rq->active;
+    struct thread *thr = prio_array_pop(from);
+    if(!thr) {
+        if(owner && rq->expired->nr) {
+            struct prio_array *tmp = rq->active;
+            rq->active = rq->expired;
+            rq->expired = tmp;
+
+            thr = prio_array_pop(rq->active);
+        } else if(!owner) {
+            from = rq->expired;
+            thr = prio_array_pop(from);
+        }
+    }
+
+    // The owner queues its outgoing thread before switching away from it, so
+    // leave a thread that is still on a CPU's stack for that CPU to pick up.
+    if(thr && !owner && thr->oncpu) {
+        prio_array_push(from, thr);
+        thr = 0;
+    }
+
+    if(thr) {
+        thr->queued_rq = 0;
+        atomic_dec(rq->len);
+    }
+
+    spinlock_release(rq->lock);
+
+    return thr;
+}
+
+/**
+ * Takes a thread from the busiest run queue other than the given one. Returns
+ * NULL if no other CPU has any threads waiting.
+ */
+static struct thread *rq_steal(struct runqueue *local) {
+    struct thread *thr = 0;
+
+    while(!thr) {
+        struct runqueue *busiest = 0;
+        size_t i, n = nrunqueues;
+        for(i = 0; i < n; i++) {
+            struct runqueue *rq = runqueues[i];
+            if((!rq) || (rq == local) || (rq->len == 0)) {
+                continue;
+            }
+
+            if((!busiest) || (rq->len > busiest->len)) {
+                busiest = rq;
+            }
+        }
+
+        if(!busiest) {
+            break;
+        }
+
+        // May fail if the owner (or another thief) emptied the queue since the
+        // length was read, in which case just look again.
+        thr = rq_pop(busiest, 0);
+    }
+
+#ifdef VERBOSE_LOGGING
+    if(thr) {
+        dprintf("cpu %d stole thread %x\n", multicpu_id(), thr);
+    }
+#endif
+
+    return thr;
+}
+
+/**
+ * Asks an idle CPU (other than the given target and the current CPU) to come
+ * and look for work. Idle CPUs may have stopped their tick, so they won't
+ * notice threads queued elsewhere on their own.
+ */
+static void rq_kick_idle(struct runqueue *target) {
+    struct runqueue *local = get_runqueue();
+    size_t i, n = nrunqueues;
+    for(i = 0; i < n; i++) {
+        struct runqueue *rq = runqueues[i];
+        if((!rq) || (rq == target) || (rq == local) || (rq->curr_priority != QUEUE_COUNT)) {
+            continue;
+        }
+
+        if(atomic_bool_compare_and_swap(&rq->need_resched, 0, 1)) {
+            multicpu_resched(rq->cpu);
+        }
+
+        break;
+    }
+}
+
+/** Checks for threads waiting on any CPU's run queue. */
+static int rq_any_waiting() {
+    size_t i, n = nrunqueues;
+    for(i = 0; i < n; i++) {
+        if(runqueues[i] && runqueues[i]->len) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/** Picks the run queue a woken thread should be placed on. */
+static struct runqueue *rq_for_wake(struct thread *thr) {
+    struct runqueue *local = get_runqueue();
+    struct runqueue *last = thr->rq;
+
+    if(!last) {
+        return local;
+    } else if((!local) || (last == local)) {
+        return last;
+    }
+
+    // Stay with the cache-warm CPU, unless it is noticeably busier than us.
+    if(last->len > (local->len + SCHED_AFFINITY_SLACK)) {
+        return local;
+    }
+
+    return last;
 }
 
 static int sched_timer(uint64_t ticks) {
@@ -116,23 +427,74 @@ static int sched_timer(uint64_t ticks) {
     get_current_thread()->timeslice -= ticks;
 
     int doresched = get_current_thread()->timeslice ? 0 : 1;
+
+    // A higher priority thread was queued for this CPU.
+    struct runqueue *rq = get_runqueue();
+    if(rq && rq->need_resched) {
+        doresched = 1;
+    }
     // dprintf("doresched: %d\n", doresched);
     return doresched;
 }
 
-static int zombie_reaper(uint64_t ticks) {
-    if(zombie_queue == 0)
-        return 0;
+/// Removes an item from a list, if it is there.
+static void list_remove_item(void *list, void *data) {
+    size_t i, len = list_len(list);
+    for(i = 0; i < len; i++) {
+        if(list_at(list, i) == data) {
+            list_remove(list, i);
+            return;
+        }
+    }
+}
 
-    // Clean up ALL the threads.
-    while(!queue_empty(zombie_queue)) {
-        struct thread *thr = (struct thread *) queue_pop(zombie_queue);
+/// Frees a process whose threads have all been reaped. Its children are
+/// handed to its parent.
+static void destroy_process(struct process *p) {
+    struct process *parent = p->parent;
+    assert(parent != 0);
+
+    dprintf("destroying process %p (%s)\n", p, p->name);
+
+    list_remove_item(parent->child_list, p);
+    while(list_len(p->child_list)) {
+        struct process *child = (struct process *) list_at(p->child_list, 0);
+        list_remove(p->child_list, 0);
+
+        child->parent = parent;
+        list_insert(parent->child_list, child, 0);
+    }
+
+    delete_list(p->child_list);
+    delete_list(p->thread_list);
+
+    vmem_destroy(p->vmem);
+
+    free(p);
+}
+
+static int zombie_reaper(uint64_t ticks __unused) {
+    // Take every zombie at once, then clean them up without the lock held.
+    wait_queue_lock(&zombie_queue);
+    struct thread_list zombies = zombie_queue.waiters;
+    zombie_queue.waiters.head = zombie_queue.waiters.tail = 0;
+    wait_queue_unlock(&zombie_queue);
+
+    struct thread *thr;
+    while((thr = thread_list_pop(&zombies)) != NULL) {
         dprintf("reaping zombie thread %p\n", thr);
 
+        struct process *p = thr->parent;
+        list_remove_item(p->thread_list, thr);
+
         destroy_context(thr->ctx);
 
-        free(thr->ctx);
-        free(thr);
+        kmem_cache_free(thread_cache, thr);
+
+        // The root process stays, even with no threads.
+        if(p->parent && !list_len(p->thread_list)) {
+            destroy_process(p);
+        }
     }
 
     return 0;
@@ -150,19 +512,31 @@ void sched_setidle(struct thread *t) {
 
 static void install_sched_timer() {
     // Tick for timeslice completion.
-    if(install_timer(sched_timer, ((THREAD_DEFAULT_TIMESLICE_MS << TIMERRES_SHIFT) | TIMERRES_MILLI), TIMERFEAT_PERIODIC | TIMERFEAT_PERCPU) < 0) {
+    if(install_timer(sched_timer, ((THREAD_DEFAULT_TIMESLICE_MS << TIMERRES_SHIFT) | TIMERRES_MILLI), TIMERFEAT_PERIODIC | TIMERFEAT_PERCPU | TIMERFEAT_DEFERRABLE) < 0) {
         dprintf("scheduler install failed - no useful timer available\n");
         kprintf("scheduler install failed - system will have its usability greatly reduced\n");
     }
 }
 
+/// Allocates a zeroed thread, with its context set up.
+static struct thread *alloc_thread() {
+    kmem_cache_get(&thread_cache, "thread", sizeof(struct thread_alloc), KMEM_CACHE_LINE, 0);
+
+    struct thread_alloc *ta = (struct thread_alloc *) kmem_cache_alloc(thread_cache);
+    memset(ta, 0, sizeof(struct thread_alloc));
+
+    ta->t.ctx = &ta->ctx;
+    return &ta->t;
+}
+
 void sched_cpualive(void *lock) {
     dprintf("scheduler: new cpu (%d) to be registered!\n", multicpu_id());
 
+    rcu_cpu_init();
+
     // If an idle thread has been installed, start up the scheduler on this core
     if(g_idle_thread) {
-        struct thread *t = (struct thread *) malloc(sizeof(struct thread));
-        memset(t, 0, sizeof(struct thread));
+        struct thread *t = alloc_thread();
 
         t->state = THREAD_STATE_READY;
         t->timeslice = THREAD_DEFAULT_TIMESLICE;
@@ -171,7 +545,6 @@ void sched_cpualive(void *lock) {
 
         t->base_priority = g_idle_thread->base_priority;
         t->priority = g_idle_thread->priority;
-        t->ctx = (context_t *) malloc(sizeof(context_t));
         clone_context(g_idle_thread->ctx, t->ctx);
 
         list_insert(t->parent->thread_list, t, 0);
@@ -179,6 +552,10 @@ void sched_cpualive(void *lock) {
         set_idle_thread(t);
         set_current_thread(t);
 
+        if(!get_runqueue()) {
+            set_runqueue(create_runqueue());
+        }
+
         install_sched_timer();
         reschedule_internal(RESCHED_IDLE_RUNTHREAD_RESTORE, lock);
     } else {
@@ -196,6 +573,17 @@ struct process *create_process(const char *name, struct process *parent) {
         strncpy(ret->name, name, PROCESS_NAME_MAX);
 
     ret->pid = nextpid++;
+    ret->parent = parent;
+
+    // The root process runs in the kernel's address space; the rest each get
+    // their own.
+    if(parent != 0) {
+        ret->vmem = vmem_create();
+        if(ret->vmem == 0) {
+            free(ret);
+            return 0;
+        }
+    }
 
     ret->child_list = create_list();
     ret->thread_list = create_list();
@@ -211,8 +599,7 @@ struct process *create_process(const char *name, struct process *parent) {
 }
 
 struct thread *create_thread(struct process *parent, uint32_t prio, thread_entry_t start, uintptr_t stack, size_t stacksz, void *param) {
-    struct thread *t = (struct thread *) malloc(sizeof(struct thread));
-    memset(t, 0, sizeof(struct thread));
+    struct thread *t = alloc_thread();
 
     t->state = THREAD_STATE_SLEEPING;
     t->timeslice = THREAD_DEFAULT_TIMESLICE;
@@ -220,7 +607,6 @@ struct thread *create_thread(struct process *parent, uint32_t prio, thread_entry
 
     t->base_priority = t->priority = prio;
 
-    t->ctx = (context_t *) malloc(sizeof(context_t));
     create_context(t->ctx, start, stack, stacksz, param);
 
     list_insert(parent->thread_list, t, 0);
@@ -237,6 +623,8 @@ void switch_threads(struct thread *old, struct thread *new, void *lock) {
             set_current_thread(new);
         new->state = THREAD_STATE_RUNNING;
     } else {
+        fpu_switch_out(old->ctx);
+
         if (save_thread_context(old->ctx) == 0) {
             // context-restored
             return;
@@ -244,16 +632,17 @@ void switch_threads(struct thread *old, struct thread *new, void *lock) {
     }
 
     dprintf("switch_threads %x -> %x lock=%p\n", old, new, lock);
-    restore_thread_context(new->ctx, lock ? spinlock_getatom(lock) : lock);
+    new->oncpu = 1;
+    restore_thread_context(new->ctx, lock ? spinlock_getatom(lock) : lock, old ? &old->oncpu : 0);
 }
 
 void thread_kill() {
     assert(get_current_thread() != 0);
 
-    // Put the thread into the zombie state and then kill it.
-    get_current_thread()->state = THREAD_STATE_ZOMBIE;
-    queue_push(zombie_queue, get_current_thread());
-    reschedule();
+    // Put the thread into the zombie state and then kill it. The reaper can't
+    // take the thread until it has been switched away from.
+    wait_queue_lock(&zombie_queue);
+    thread_block(&zombie_queue.waiters, THREAD_STATE_ZOMBIE, zombie_queue.lock);
 
     while(1) panic("thread_kill trying to return\n");
 }
@@ -270,70 +659,175 @@ void thread_sleep() {
     reschedule();
 }
 
-void thread_wake(struct thread *thr) {
-    assert(thr != 0);
+void thread_block(struct thread_list *list, uint32_t state, void *lock) {
+    struct thread *curr = get_current_thread();
+    assert(curr != 0);
 
-    dprintf("waking thread %x\n", thr);
+    uint8_t wasints = spinlock_intstate(lock);
 
-    queue_push(ready_queue, thr);
+    curr->state = state;
+    if(list) {
+        thread_list_push(list, curr);
+    }
 
-#if 0
+    reschedule_internal(RESCHED_IDLE_RUNTHREAD, lock);
 
-    void **queues = get_prio_queues();
+    if(wasints) {
+        interrupts_enable();
+    }
+}
 
-    spinlock_acquire(sched_spinlock);
-    if(!queues[thr->priority]) {
-        queues[thr->priority] = create_queue();
+void thread_list_push(struct thread_list *list, struct thread *thr) {
+    thr->qnext = 0;
+    thr->qprev = list->tail;
+    if(list->tail) {
+        list->tail->qnext = thr;
+    } else {
+        list->head = thr;
     }
+    list->tail = thr;
+}
 
-    queue_push(queues[thr->priority], thr);
-    spinlock_release(sched_spinlock);
+struct thread *thread_list_pop(struct thread_list *list) {
+    struct thread *thr = list->head;
+    if(thr) {
+        thread_list_remove(list, thr);
+    }
 
-    atomic_inc(numready);
+    return thr;
+}
 
-#endif
+void thread_list_remove(struct thread_list *list, struct thread *thr) {
+    if(thr->qprev) {
+        thr->qprev->qnext = thr->qnext;
+    } else {
+        list->head = thr->qnext;
+    }
 
-    thr->state = THREAD_STATE_READY;
+    if(thr->qnext) {
+        thr->qnext->qprev = thr->qprev;
+    } else {
+        list->tail = thr->qprev;
+    }
+
+    thr->qnext = thr->qprev = 0;
 }
 
-uint32_t thread_priority(struct thread *prio) {
-    if(prio == NULL) {
-        prio = get_current_thread();
+/**
+ * Moves a thread waiting to run to the level its priority says, if it was
+ * queued at another. Its priority can change without the run queue lock.
+ */
+static void rq_requeue(struct thread *thr) {
+    // Lock whichever run queue the thread is on, if any. Pushing and popping
+    // both happen under that lock, so this pins the thread's position.
+    struct runqueue *rq;
+    while(1) {
+        rq = thr->queued_rq;
+        if(!rq) {
+            return;
+        }
+
+        spinlock_acquire(rq->lock);
+        if(thr->queued_rq == rq) {
+            break;
+        }
+
+        spinlock_release(rq->lock);
     }
 
-    return prio->priority;
-}
+    uint32_t prio = thr->priority;
+    if(prio == thr->queued_level) {
+        spinlock_release(rq->lock);
+        return;
+    }
+
+    int boost = prio < thr->queued_level;
+    if(!prio_array_remove(rq->active, thr)) {
+        prio_array_remove(rq->expired, thr);
+    }
 
-static void go_next_priolevel() {
-    void **queues = get_prio_queues();
-    void **already = get_prio_already_queues();
-    void **q = 0;
+    // A boosted thread goes into the active array so it runs this round.
+    prio_array_push(rq->active, thr);
 
-    size_t level = 0, real = 0;
-    while(((level = get_current_priolevel()) < (QUEUE_COUNT * 2))) {
-        if(level >= QUEUE_COUNT) {
-            real = level % QUEUE_COUNT;
-            q = already;
+    spinlock_release(rq->lock);
+
+    if(boost && (prio < rq->curr_priority)) {
+        if(rq != get_runqueue()) {
+            if(atomic_bool_compare_and_swap(&rq->need_resched, 0, 1)) {
+                multicpu_resched(rq->cpu);
+            }
         } else {
-            q = queues;
+            rq->need_resched = 1;
         }
+    }
+}
 
-        if(q[real]) {
-            int empty = queue_empty(q[real]);
-            if(!empty) {
-                break;
+void thread_wake(struct thread *thr) {
+    assert(thr != 0);
+
+    dprintf("waking thread %x\n", thr);
+
+    // Mark ready before the push so a CPU that pops the thread straight away
+    // doesn't discard it as not ready. Only sleeping threads can be woken -
+    // anything else is already on a queue (or dead).
+    if(!atomic_bool_compare_and_swap(&thr->state, THREAD_STATE_SLEEPING, THREAD_STATE_READY)) {
+        return;
+    }
+
+    struct runqueue *rq = rq_for_wake(thr);
+    assert(rq != 0);
+    rq_push(rq, thr, 0);
+
+    // See thread_set_priority.
+    __barrier;
+    if(thr->queued_level != thr->priority) {
+        rq_requeue(thr);
+    }
+
+    // Ask the target CPU to pre-empt its current thread if the woken thread
+    // outranks it (which is always the case if it is idle).
+    if(thr->priority < rq->curr_priority) {
+        if(rq != get_runqueue()) {
+            if(atomic_bool_compare_and_swap(&rq->need_resched, 0, 1)) {
+                multicpu_resched(rq->cpu);
+            }
+        } else {
+            rq->need_resched = 1;
+
+            // We are the target - if we can be pre-empted right now, do so
+            // instead of waiting for the next scheduler tick.
+            if(interrupts_get()) {
+                sched_yield();
             }
         }
+    } else {
+        // The target CPU is busy with something more important, so let an idle
+        // CPU come and take the thread.
+        rq_kick_idle(rq);
+    }
+}
 
-        // Make sure the priority level is only incremented if another core
-        // didn't increment it already!
-        set_current_priolevel_if(level + 1, level);
+uint32_t thread_priority(struct thread *prio) {
+    if(prio == NULL) {
+        prio = get_current_thread();
     }
+
+    return prio->priority;
 }
 
-static int is_idle(size_t action_on_idle, unative_t intstate, void *lock) {
-    int empty = queue_empty(ready_queue);
+void thread_set_priority(struct thread *thr, uint32_t prio) {
+    assert(thr != 0);
+
+    // A thread_wake racing with us may queue the thread at the old priority.
+    // It checks the priority after publishing queued_rq and we check
+    // queued_rq after storing the priority, so one of us moves it.
+    thr->priority = prio;
+    __barrier;
+
+    rq_requeue(thr);
+}
 
+static int is_idle(int empty, size_t action_on_idle, unative_t intstate, void *lock) {
     // Handle idle.
     if((empty) && ((get_current_thread() == get_idle_thread() && (action_on_idle != RESCHED_IDLE_RUNTHREAD_RESTORE)) || (action_on_idle == RESCHED_IDLE_RETURN))) {
         return 1;
@@ -342,6 +836,7 @@ static int is_idle(size_t action_on_idle, unative_t intstate, void *lock) {
             dprintf("cpu %d became idle\n", multicpu_id());
             get_idle_thread()->state = THREAD_STATE_RUNNING;
             get_idle_thread()->timeslice = THREAD_DEFAULT_TIMESLICE;
+            get_runqueue()->curr_priority = QUEUE_COUNT;
 
             if((action_on_idle == RESCHED_IDLE_RUNTHREAD_RESTORE) || (get_current_thread() != get_idle_thread())) {
                 struct thread *tmp = get_current_thread();
@@ -361,39 +856,13 @@ static int is_idle(size_t action_on_idle, unative_t intstate, void *lock) {
     }
 
     return 0;
-
-#if 0
-    size_t nr_tmp = numready;
-
-    // Handle idle.
-    if((!nr_tmp) && ((get_current_thread() == get_idle_thread()) || (action_on_idle == RESCHED_IDLE_RETURN))) {
-        return 1;
-    } else if(!nr_tmp) {
-        if(action_on_idle == RESCHED_IDLE_RUNTHREAD) {
-            dprintf("cpu %d became idle\n", multicpu_id());
-            get_idle_thread()->state = THREAD_STATE_RUNNING;
-
-            if(get_current_thread() != get_idle_thread()) {
-                struct thread *tmp = get_current_thread();
-                set_current_thread(get_idle_thread());
-                switch_threads(tmp, get_idle_thread(), intstate, 0);
-            }
-
-            return 1;
-        }
-
-        dprintf("action: %d\n", action_on_idle);
-        panic("bad action on idle to scheduler");
-    }
-
-    return 0;
-#endif
 }
 
 static void reschedule_internal(size_t action_on_idle, void *lock) {
-    /// \note Scheduling is performed on each core and refers to the global
-    ///       queues to receive threads to execute. Therefore, if the system
-    ///       has four cores, and four threads in the ready queue, each core
+    /// \note Scheduling is performed on each core and refers to that core's
+    ///       run queue to receive threads to execute. A core with an empty
+    ///       run queue steals from the busiest other core before going idle,
+    ///       so if the system has four cores and four ready threads, each core
     ///       will run a thread each.
     ///       Because queues do not require locking to access, we can simply
     ///       disable interrupts to avoid pre-emption and access core-specific
@@ -412,23 +881,39 @@ static void reschedule_internal(size_t action_on_idle, void *lock) {
     // Must run without interruption for the time being...
     interrupts_disable();
 
-#if 0
-    if(get_current_thread()->timeslice > 0) {
+    struct runqueue *rq = get_runqueue();
+    assert(rq != 0);
+
+    rq->need_resched = 0;
+
+    // Nothing running here is inside a read-side critical section (they can't
+    // be pre-empted), so this is a quiescent state.
+    rcu_quiescent();
+
+    // If the tick was stopped while idle, restart it: the scheduler is about
+    // to pick something to run, so we need pre-emption again.
+    timer_tick_restart();
+
+    // Dynamic priority: threads that give up the CPU early (eg, to wait for
+    // I/O) move back towards their base priority, while threads that burn
+    // through their timeslice drift down towards THREAD_PRIORITY_LOW.
+    int expired = 0;
+    if(get_current_thread() != get_idle_thread()) {
+        struct thread *curr = get_current_thread();
+        if(curr->timeslice > 0) {
 #ifdef VERBOSE_LOGGING
-        dprintf("reschedule before timeslice completes\n");
+            dprintf("reschedule before timeslice completes\n");
 #endif
-        if(get_current_thread()->priority > get_current_thread()->base_priority)
-            atomic_dec(get_current_thread()->priority);
-    } else {
+            mutex_pi_decay(curr, curr->base_priority);
+        } else {
 #ifdef VERBOSE_LOGGING
-        dprintf("reschedule due to completed timeslice\n");
+            dprintf("reschedule due to completed timeslice\n");
 #endif
-        atomic_inc(get_current_thread()->priority);
+            mutex_pi_decay(curr, THREAD_PRIORITY_LOW);
 
-        if(get_current_thread()->priority > THREAD_PRIORITY_LOW)
-            get_current_thread()->priority = THREAD_PRIORITY_LOW;
+            expired = 1;
+        }
     }
-#endif
 
     // RUNNING -> READY transition for the current thread. State could be
     // SLEEPING, in which case this reschedule is to pick a new thread to run,
@@ -438,12 +923,19 @@ static void reschedule_internal(size_t action_on_idle, void *lock) {
         if(get_current_thread()->state == THREAD_STATE_RUNNING) {
             get_current_thread()->state = THREAD_STATE_READY;
 
-            queue_push(ready_queue, get_current_thread());
+            rq_push(rq, get_current_thread(), expired);
         }
     }
 
+    // Run from the local queue first, and only take work from another CPU if
+    // there is nothing local to do.
+    struct thread *thr = rq_pop(rq, 1);
+    if(!thr) {
+        thr = rq_steal(rq);
+    }
+
     // Gone to idle state (ie, no threads ready).
-    if(is_idle(action_on_idle, intstate, lock)) {
+    if(is_idle(thr == 0, action_on_idle, intstate, lock)) {
         if(intstate) {
             interrupts_enable();
         }
@@ -451,9 +943,6 @@ static void reschedule_internal(size_t action_on_idle, void *lock) {
         return;
     }
 
-    struct thread *thr = (struct thread *) queue_pop(ready_queue);
-    assert(thr != 0);
-
     dprintf("new thread %x current %x\n", thr, get_current_thread());
 
     // Thread not actually alive?
@@ -464,7 +953,9 @@ static void reschedule_internal(size_t action_on_idle, void *lock) {
         // They cannot be added to the zombie queue if they are 'remotely' killed
         // by another process (as they are already in the queue).
         if(thr->state == THREAD_STATE_ZOMBIE) {
-            queue_push(zombie_queue, thr);
+            wait_queue_lock(&zombie_queue);
+            thread_list_push(&zombie_queue.waiters, thr);
+            wait_queue_unlock(&zombie_queue);
         }
 
         if(intstate) {
@@ -476,175 +967,60 @@ static void reschedule_internal(size_t action_on_idle, void *lock) {
         return;
     }
 
+    // A thread woken onto this queue may still be on the stack of the CPU it
+    // went to sleep on; that CPU is switching away with interrupts off, so
+    // this doesn't take long.
+    if(thr != get_current_thread()) {
+        while(thr->oncpu) {
+            __spin;
+        }
+    }
+
     // Reset the timeslice and prepare for context switch.
     thr->timeslice = THREAD_DEFAULT_TIMESLICE;
     thr->state = THREAD_STATE_RUNNING;
-
-#ifdef VERBOSE_LOGGING
-    // dprintf("reschedule: queues now run: %sempty / already: %sempty\n", queue_empty(queues[get_current_priolevel()]) ? "" : "not ", queue_empty(already_queues[get_current_priolevel()]) ? "" : "not ");
-#endif
+    thr->rq = rq;
+    rq->curr_priority = thr->priority;
 
     // Perform the context switch if this isn't the already-running thread.
     if(thr != get_current_thread()) {
+        // Kernel mappings are global, so this only drops user mappings (and
+        // does nothing at all if this CPU is in the right address space).
         if(get_current_thread()->parent != thr->parent) {
-            /// \todo Process switch - address space and such.
-            dprintf("TODO: process switch - address space etc %x %x\n", get_current_thread()->parent, thr->parent);
+            vmem_switch(thr->parent->vmem);
         }
 
         struct thread *tmp = get_current_thread();
         set_current_thread(thr);
         switch_threads(tmp, thr, lock);
+    } else if(lock) {
+        // No switch, so nothing else will release the lock we were handed.
+        spinlock_release_atom(lock);
     }
 
     if(intstate) {
         interrupts_enable();
     }
+}
 
-#if 0
-
-    // RUNNING -> READY transition for the current thread. State could be
-    // SLEEPING, in which case this reschedule is to pick a new thread to run,
-    // leaving the current thread off the queue.
-    // Also, the idle thread is handled specially.
-    if(get_current_thread() != get_idle_thread()) {
-        dprintf("old state %d vs %d\n", get_current_thread()->state, THREAD_STATE_RUNNING);
-        if(get_current_thread()->state == THREAD_STATE_RUNNING) {
-            get_current_thread()->state = THREAD_STATE_READY;
-
-            dprintf("running -> ready transition\n");
-
-            // Create an already queue for this priority level, if one doesn't exist yet.
-            if(!already_queues[get_current_thread()->priority]) {
-                spinlock_acquire(sched_spinlock);
-                // Check to see if the already queue got created during the lock acquire.
-                if(!already_queues[get_current_thread()->priority]) {
-                    already_queues[get_current_thread()->priority] = create_queue();
-                }
-                spinlock_release(sched_spinlock);
-            }
-
-            // Push onto the already queue.
-            queue_push(already_queues[get_current_thread()->priority], get_current_thread());
-
-            // This thread is now ready.
-            atomic_inc(numready);
-        }
-    }
-
-    // Gone to idle state?
-    if(is_idle(action_on_idle, intstate)) {
-        if(intstate) {
-            interrupts_enable();
-        }
-
-        return;
-    }
-
-    // We switch back to the first priority level if we were running the idle
-    // thread, as if we don't we won't find any threads to run (we'll switch to
-    // the already queue, and the thread to run is in the already queue!)
-    if(get_current_thread() == get_idle_thread()) {
-        set_current_priolevel(0);
-    }
-
-    // Find the next priority level with items in it.
-    go_next_priolevel();
-
-    if(get_current_priolevel() >= QUEUE_COUNT) {
-        // Swap the already queues to be the ready queues (and vice versa).
-        swap_queues();
-
-        set_current_priolevel(0);
-        go_next_priolevel();
-    }
-
-    // Current priority level, saved until we are ready to continue.
-    size_t level = get_current_priolevel();
-    dprintf("level: %d/%d [%d]\n", level, QUEUE_COUNT, numready);
-
-    assert(level < QUEUE_COUNT);
-
-    // Pop a thread off the run queue.
-    struct thread *thr = (struct thread *) queue_pop(queues[level]);
-    if(thr == 0) {
-        dprintf("queue emptied after selecting priority level!\n");
-
-        // Did we become idle as a result?
-        if(is_idle(action_on_idle, intstate)) {
-            if(intstate) {
-                interrupts_enable();
-            }
-
-            return;
-        }
-
-        // Try the next level, otherwise.
-        level = get_current_priolevel();
-        thr = (struct thread *) queue_pop(queues[level]);
-        if(thr == 0) {
-            // Okay, this is hopeless! Return to the original thread.
-            if(intstate) {
-                interrupts_enable();
-            }
-
-            return;
-        }
-    }
-
-    // Thread not actually alive?
-    if(thr->state != THREAD_STATE_READY) {
-        dprintf("reschedule: thread %p in queue wasn't really ready\n", thr);
-
-        // Threads in the zombie state need to be added to the zombie queue here.
-        // They cannot be added to the zombie queue if they are 'remotely' killed
-        // by another process (as they are already in the queue).
-        if(thr->state == THREAD_STATE_ZOMBIE) {
-            queue_push(zombie_queue, thr);
-        }
-
-        if(intstate) {
-            interrupts_enable();
-        }
-
-        reschedule();
+void sched_idle() {
+    interrupts_disable();
 
+    struct runqueue *rq = get_runqueue();
+    if(rq && (rq->need_resched || rq_any_waiting())) {
+        // Work to do already - don't halt at all.
+        interrupts_enable();
         return;
     }
 
-    // Reset the timeslice and prepare for context switch.
-    thr->timeslice = THREAD_DEFAULT_TIMESLICE;
-    thr->state = THREAD_STATE_RUNNING;
-
-    // Thread no longer ready - being switched to.
-    atomic_dec(numready);
-
-    // Empty run queue?
-    if(queue_empty(queues[level])) {
-        // Only increment the priority level if it wasn't already.
-        set_current_priolevel_if(level + 1, level);
+    // Nothing is runnable anywhere, so stop the periodic tick and sleep until
+    // the next timer deadline. Threads queued for this CPU from now on send it
+    // an IPI, and reschedule_internal restarts the tick.
+    if(rq) {
+        timer_tick_stop();
     }
 
-#ifdef VERBOSE_LOGGING
-    dprintf("reschedule: queues now run: %sempty / already: %sempty\n", queue_empty(queues[get_current_priolevel()]) ? "" : "not ", queue_empty(already_queues[get_current_priolevel()]) ? "" : "not ");
-#endif
-
-    // Perform the context switch if this isn't the already-running thread.
-    if(thr != get_current_thread()) {
-        if(get_current_thread()->parent != thr->parent) {
-            /// \todo Process switch - address space and such.
-            dprintf("TODO: process switch - address space etc %x %x\n", get_current_thread()->parent, thr->parent);
-        }
-
-        struct thread *tmp = get_current_thread();
-        set_current_thread(thr);
-        switch_threads(tmp, thr, intstate, 0);
-    }
-
-    if(intstate) {
-        interrupts_enable();
-    }
-
-#endif
+    __idle_halt;
 }
 
 void sched_yield() {
@@ -656,19 +1032,18 @@ void reschedule() {
 }
 
 void init_scheduler() {
-    zombie_queue = create_queue();
+    wait_queue_init(&zombie_queue);
 
     sched_spinlock = create_spinlock();
 
-    ready_queue = create_queue();
+    // The boot CPU needs a run queue before any threads can be woken.
+    set_runqueue(create_runqueue());
 
     // Set up the current CPU (other CPUs will be enabled as they come alive)
     sched_cpualive(0);
 
     init_context();
 
-    numready = 0;
-
     dprintf("scheduler spinlock is %p\n", sched_spinlock);
 
     // Timer handler for the zombie reaper.
@@ -16,6 +16,7 @@
 
 #include <semaphore.h>
 #include <spinlock.h>
+#include <waitqueue.h>
 #include <malloc.h>
 #include <sched.h>
 #include <util.h>
@@ -25,9 +26,8 @@ struct semaphore {
     size_t count;
     size_t max;
 
-    void *spinlock;
-
-    void *tqueue;
+    /// Threads waiting to acquire. Its lock guards acquire/release.
+    wait_queue_t waiters;
 
     int cleanup;
 };
@@ -38,8 +38,7 @@ void *create_semaphore(size_t max, size_t initial) {
     ret->count = initial;
     ret->max = max;
 
-    ret->spinlock = create_spinlock();
-    ret->tqueue = create_queue();
+    wait_queue_init(&ret->waiters);
 
     ret->cleanup = 0;
 
@@ -53,18 +52,11 @@ void delete_semaphore(void *sem) {
     struct semaphore *s = (struct semaphore *) sem;
 
     // Wait for any threads currently in the acquire/release critical section
-    spinlock_acquire(s->spinlock);
-
-    int was_empty = queue_empty(s->tqueue);
-    struct thread *t = 0;
-    while((t = (struct thread *) queue_pop(s->tqueue)) != NULL) {
-        thread_wake(t);
-    }
+    wait_queue_lock(&s->waiters);
 
-    delete_queue(s->tqueue);
+    int was_empty = !wait_queue_wake_all_locked(&s->waiters);
 
-    spinlock_release(s->spinlock);
-    delete_spinlock(s->spinlock);
+    wait_queue_unlock(&s->waiters);
 
     if(was_empty)
         free(s);
@@ -92,22 +84,17 @@ void semaphore_acquire(void *sem, size_t count) {
 
     while(1) {
         // Enter the acquire critical section.
-        spinlock_acquire(s->spinlock);
+        wait_queue_lock(&s->waiters);
 
         // Can we acquire?
         if(semaphore_tryacquire(sem, count)) {
-            spinlock_release(s->spinlock);
+            wait_queue_unlock(&s->waiters);
             return;
         }
 
-        // Push onto the pending queue...
-        queue_push(s->tqueue, sched_current_thread());
-
-        // Exit the critical section...
-        spinlock_release(s->spinlock);
-
-        // Sleep!
-        thread_sleep();
+        // Sleep! This exits the critical section once we're off the CPU, so a
+        // release can't slip in between queueing and sleeping.
+        wait_queue_sleep_locked(&s->waiters);
 
         // If we were woken up by a cleanup request, clean up.
         if(s->cleanup) {
@@ -157,7 +144,7 @@ void semaphore_release(void *sem, size_t count) {
         count = s->max;
 
     // Enter the acquire critical section.
-    spinlock_acquire(s->spinlock);
+    wait_queue_lock(&s->waiters);
 
     // Release operation.
     s->count += count;
@@ -166,11 +153,8 @@ void semaphore_release(void *sem, size_t count) {
 
     // Wake up threads, they will each check to see if they can now complete
     // their acquire.
-    struct thread *t = 0;
-    while((t = (struct thread *) queue_pop(s->tqueue)) != NULL) {
-        thread_wake(t);
-    }
+    wait_queue_wake_all_locked(&s->waiters);
 
     // Done!
-    spinlock_release(s->spinlock);
+    wait_queue_unlock(&s->waiters);
 }
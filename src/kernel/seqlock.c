@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <types.h>
+#include <seqlock.h>
+#include <spinlock.h>
+
+void seqlock_init(seqlock_t *s) {
+    s->seq = 0;
+    s->lock = create_spinlock_at(s->lock_region, sizeof(s->lock_region));
+}
+
+void seqlock_write_begin(seqlock_t *s) {
+    spinlock_acquire(s->lock);
+
+    s->seq++;
+    __barrier;
+}
+
+void seqlock_write_end(seqlock_t *s) {
+    __barrier;
+    s->seq++;
+
+    spinlock_release(s->lock);
+}
@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <types.h>
+#include <system.h>
+#include <slab.h>
+#include <vmem.h>
+#include <pmem.h>
+#include <util.h>
+#include <string.h>
+#include <spinlock.h>
+#include <multicpu.h>
+#include <interrupts.h>
+#include <assert.h>
+#include <io.h>
+
+/// Size of a single slab. Slabs are aligned to this, so the slab an object
+/// belongs to can be found by masking its address.
+#define SLAB_SIZE           0x4000UL
+#define SLAB_PAGES          (SLAB_SIZE / PAGE_SIZE)
+#define SLAB_SLOTS          (SLAB_LENGTH / SLAB_SIZE)
+
+#define SLAB_MIN_SHIFT      4
+#define SLAB_CLASSES        7 // 16 bytes .. SLAB_MAX_OBJECT
+
+/// Largest object a cache can hold, so each slab has a useful number of them.
+#define KMEM_MAX_OBJECT     (SLAB_SIZE / 8)
+
+/// Number of objects each CPU keeps per cache, and how many move between
+/// the CPU and the shared slabs at once.
+#define MAGAZINE_SIZE       16
+#define MAGAZINE_BATCH      (MAGAZINE_SIZE / 2)
+
+#define ALIGN_UP(x, a)      (((x) + (a) - 1) & ~((a) - 1))
+
+/// Header at the start of each slab.
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *next, *prev;
+
+    /// Free objects, linked through the word at the cache's link offset.
+    void *freelist;
+    size_t inuse;
+};
+
+struct kmem_cache {
+    char name[KMEM_NAME_MAX];
+
+    /// Index into each CPU's magazines, or -1 if this slot is unused.
+    int idx;
+
+    size_t size;
+    size_t align;
+    size_t stride;
+    size_t link;
+    size_t offset;
+    size_t perslab;
+    kmem_ctor_t ctor;
+
+    /// Slabs with at least one free object.
+    struct slab *partial;
+    size_t nslabs;
+
+    /// Number of slabs with no objects in use. One is kept around to avoid
+    /// thrashing pages in and out, the rest are given back.
+    size_t nempty;
+
+    /// Allocations and frees that bypassed the per-CPU magazines.
+    size_t allocs;
+    size_t frees;
+
+    spinlock_t lock;
+    char lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+};
+
+struct magazine {
+    size_t count;
+    size_t allocs;
+    size_t frees;
+    void *objs[MAGAZINE_SIZE];
+};
+
+/// Per-CPU object caches. Only touched by their own CPU, with interrupts
+/// disabled, so the common path takes no locks at all. Aligned so CPUs don't
+/// share cache lines.
+struct slab_cpu {
+    struct magazine mags[KMEM_MAX_CACHES];
+} __aligned(KMEM_CACHE_LINE);
+
+static struct kmem_cache caches[KMEM_MAX_CACHES];
+static spinlock_t caches_lock = 0;
+static char caches_lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+
+/// Size classes backing malloc.
+static struct kmem_cache *classes[SLAB_CLASSES];
+
+static struct slab_cpu cpus[MULTICPU_MAX_CPUS];
+static volatile size_t ncpus = 0;
+
+/// One bit per slab-sized slot in the slab region, set if in use.
+static uint32_t slots[(SLAB_SLOTS + 31) / 32];
+static size_t slot_rover = 0;
+static spinlock_t slot_lock = 0;
+static char slot_lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+
+static int slab_ready = 0;
+
+static size_t size_to_class(size_t sz) {
+    size_t cls = 0;
+    while((1UL << (cls + SLAB_MIN_SHIFT)) < sz)
+        cls++;
+    return cls;
+}
+
+static struct slab *obj_to_slab(void *p) {
+    return (struct slab *) (((uintptr_t) p) & ~(SLAB_SIZE - 1));
+}
+
+static void **obj_link(struct kmem_cache *c, void *p) {
+    return (void **) (((uintptr_t) p) + c->link);
+}
+
+static struct slab_cpu *get_slab_cpu() {
+    struct slab_cpu **p = (struct slab_cpu **) multicpu_percpu_at(MULTICPU_PERCPU_SLAB);
+    if(!p)
+        return 0;
+
+    if(!*p) {
+        size_t idx = multicpu_slot_claim(&ncpus, MULTICPU_MAX_CPUS);
+        if(idx >= MULTICPU_MAX_CPUS)
+            return 0;
+
+        *p = &cpus[idx];
+    }
+
+    return *p;
+}
+
+static uintptr_t slot_alloc() {
+    uintptr_t ret = 0;
+    size_t i, w = slot_rover;
+
+    spinlock_acquire(slot_lock);
+    for(i = 0; i < (sizeof(slots) / sizeof(slots[0])); i++, w++) {
+        if(w >= (sizeof(slots) / sizeof(slots[0])))
+            w = 0;
+
+        if(slots[w] == ~0U)
+            continue;
+
+        size_t bit = (size_t) __builtin_ctz(~slots[w]);
+        slots[w] |= 1U << bit;
+        slot_rover = w;
+
+        ret = SLAB_BASE + (((w * 32) + bit) * SLAB_SIZE);
+        break;
+    }
+    spinlock_release(slot_lock);
+
+    return ret;
+}
+
+static void slot_free(uintptr_t v) {
+    size_t slot = (v - SLAB_BASE) / SLAB_SIZE;
+
+    spinlock_acquire(slot_lock);
+    slots[slot / 32] &= ~(1U << (slot % 32));
+    spinlock_release(slot_lock);
+}
+
+/// Unmaps and frees a slab's pages, with one shootdown for the lot.
+static void slab_unmap(uintptr_t v, size_t pages) {
+    vmem_unmap_range(v, pages, 1);
+}
+
+static void slab_link(struct kmem_cache *c, struct slab *s) {
+    s->prev = 0;
+    s->next = c->partial;
+    if(c->partial)
+        c->partial->prev = s;
+    c->partial = s;
+}
+
+static void slab_unlink(struct kmem_cache *c, struct slab *s) {
+    if(s->prev)
+        s->prev->next = s->next;
+    else
+        c->partial = s->next;
+
+    if(s->next)
+        s->next->prev = s->prev;
+
+    s->next = s->prev = 0;
+}
+
+/// Creates a new slab for the given cache. Called with the cache lock held.
+static struct slab *slab_create(struct kmem_cache *c) {
+    uintptr_t v = slot_alloc();
+    if(!v)
+        return 0;
+
+    size_t i;
+    for(i = 0; i < SLAB_PAGES; i++) {
+        paddr_t p = pmem_alloc();
+        if(!p) {
+            slab_unmap(v, i);
+            slot_free(v);
+            return 0;
+        }
+
+        vmem_map(v + (i * PAGE_SIZE), p, VMEM_READWRITE | VMEM_SUPERVISOR | VMEM_GLOBAL);
+    }
+
+    struct slab *s = (struct slab *) v;
+    s->cache = c;
+    s->inuse = 0;
+    s->freelist = 0;
+
+    // Build the free list backwards so objects are handed out in order.
+    uintptr_t obj = v + c->offset + ((c->perslab - 1) * c->stride);
+    for(i = 0; i < c->perslab; i++, obj -= c->stride) {
+        if(c->ctor)
+            c->ctor((void *) obj);
+
+        *obj_link(c, (void *) obj) = s->freelist;
+        s->freelist = (void *) obj;
+    }
+
+    slab_link(c, s);
+
+    c->nslabs++;
+    c->nempty++;
+
+    return s;
+}
+
+/// Takes one object from the cache's slabs. Called with the cache lock held.
+static void *cache_take(struct kmem_cache *c) {
+    struct slab *s = c->partial;
+    if(!s) {
+        s = slab_create(c);
+        if(!s)
+            return 0;
+    }
+
+    void *ret = s->freelist;
+    s->freelist = *obj_link(c, ret);
+
+    if(!s->inuse++)
+        c->nempty--;
+
+    if(!s->freelist)
+        slab_unlink(c, s);
+
+    return ret;
+}
+
+/// Returns one object to its slab. Called with the cache lock held.
+static void cache_give(struct kmem_cache *c, void *p) {
+    struct slab *s = obj_to_slab(p);
+
+    // A full slab isn't on the partial list.
+    if(!s->freelist)
+        slab_link(c, s);
+
+    *obj_link(c, p) = s->freelist;
+    s->freelist = p;
+
+    if(!--s->inuse) {
+        if(c->nempty) {
+            slab_unlink(c, s);
+            slab_unmap((uintptr_t) s, SLAB_PAGES);
+            slot_free((uintptr_t) s);
+            c->nslabs--;
+        } else {
+            c->nempty++;
+        }
+    }
+}
+
+static size_t magazine_refill(struct kmem_cache *c, struct magazine *m) {
+    spinlock_acquire(c->lock);
+    while(m->count < MAGAZINE_BATCH) {
+        void *p = cache_take(c);
+        if(!p)
+            break;
+
+        m->objs[m->count++] = p;
+    }
+    spinlock_release(c->lock);
+
+    return m->count;
+}
+
+static void magazine_drain(struct kmem_cache *c, struct magazine *m, size_t n) {
+    spinlock_acquire(c->lock);
+    while(n-- && m->count)
+        cache_give(c, m->objs[--m->count]);
+    spinlock_release(c->lock);
+}
+
+static void init_caches_lock() {
+    if(caches_lock)
+        return;
+
+    caches_lock = create_spinlock_at(caches_lock_region, sizeof(caches_lock_region));
+    slot_lock = create_spinlock_at(slot_lock_region, sizeof(slot_lock_region));
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, kmem_ctor_t ctor) {
+    struct kmem_cache *c = 0;
+    size_t i;
+
+    if(!align)
+        align = sizeof(void *);
+    assert((align & (align - 1)) == 0);
+
+    init_caches_lock();
+
+    spinlock_acquire(caches_lock);
+    for(i = 0; i < KMEM_MAX_CACHES; i++) {
+        if(!caches[i].size) {
+            c = &caches[i];
+            c->size = size ? size : 1;
+            break;
+        }
+    }
+    spinlock_release(caches_lock);
+
+    if(!c) {
+        dprintf("kmem: out of caches for '%s'\n", name);
+        return 0;
+    }
+
+    c->idx = (int) i;
+    strncpy(c->name, name, KMEM_NAME_MAX - 1);
+    c->align = align;
+    c->ctor = ctor;
+
+    // Constructed objects keep their state while free, so the free list link
+    // can't overlap the object.
+    if(ctor) {
+        c->link = ALIGN_UP(c->size, sizeof(void *));
+        c->stride = ALIGN_UP(c->link + sizeof(void *), align);
+    } else {
+        c->link = 0;
+        c->stride = ALIGN_UP(ALIGN_UP(c->size, sizeof(void *)), align);
+    }
+
+    assert(c->stride <= KMEM_MAX_OBJECT);
+
+    c->offset = ALIGN_UP(sizeof(struct slab), align);
+    c->perslab = (SLAB_SIZE - c->offset) / c->stride;
+
+    c->lock = create_spinlock_at(c->lock_region, sizeof(c->lock_region));
+
+    return c;
+}
+
+void kmem_cache_destroy(struct kmem_cache *c) {
+    if(!c)
+        return;
+
+    // Only caches that never allocated may be destroyed.
+    assert(!c->nslabs);
+
+    spinlock_acquire(caches_lock);
+    memset(c, 0, sizeof(*c));
+    spinlock_release(caches_lock);
+}
+
+struct kmem_cache *kmem_cache_get(struct kmem_cache **cachep, const char *name, size_t size, size_t align, kmem_ctor_t ctor) {
+    if(*cachep)
+        return *cachep;
+
+    struct kmem_cache *c = kmem_cache_create(name, size, align, ctor);
+    if(!atomic_bool_compare_and_swap(cachep, 0, c))
+        kmem_cache_destroy(c);
+
+    return *cachep;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c) {
+    void *ret = 0;
+
+    int ints = interrupts_get();
+    interrupts_disable();
+
+    struct slab_cpu *cpu = get_slab_cpu();
+    if(cpu) {
+        struct magazine *m = &cpu->mags[c->idx];
+        if(m->count || magazine_refill(c, m)) {
+            ret = m->objs[--m->count];
+            m->allocs++;
+        }
+    }
+
+    if(ints)
+        interrupts_enable();
+
+    // No per-CPU data yet, go straight to the slabs.
+    if(!cpu) {
+        spinlock_acquire(c->lock);
+        ret = cache_take(c);
+        if(ret)
+            c->allocs++;
+        spinlock_release(c->lock);
+    }
+
+    return ret;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *p) {
+    if(!p)
+        return;
+
+    assert(obj_to_slab(p)->cache == c);
+
+    int ints = interrupts_get();
+    interrupts_disable();
+
+    struct slab_cpu *cpu = get_slab_cpu();
+    if(cpu) {
+        struct magazine *m = &cpu->mags[c->idx];
+        if(m->count == MAGAZINE_SIZE)
+            magazine_drain(c, m, MAGAZINE_BATCH);
+        m->objs[m->count++] = p;
+        m->frees++;
+    }
+
+    if(ints)
+        interrupts_enable();
+
+    if(!cpu) {
+        spinlock_acquire(c->lock);
+        cache_give(c, p);
+        c->frees++;
+        spinlock_release(c->lock);
+    }
+}
+
+void kmem_cache_stats(struct kmem_cache *c, struct kmem_cache_stats *st) {
+    size_t i, n = ncpus;
+
+    memset(st, 0, sizeof(*st));
+    st->name = c->name;
+    st->size = c->size;
+    st->stride = c->stride;
+    st->perslab = c->perslab;
+
+    // Per-CPU counters are read without synchronisation, so these are only
+    // approximate while the cache is in use.
+    for(i = 0; (i < n) && (i < MULTICPU_MAX_CPUS); i++) {
+        struct magazine *m = &cpus[i].mags[c->idx];
+        st->allocs += m->allocs;
+        st->frees += m->frees;
+        st->cached += m->count;
+    }
+
+    spinlock_acquire(c->lock);
+    st->allocs += c->allocs;
+    st->frees += c->frees;
+    st->slabs = c->nslabs;
+    spinlock_release(c->lock);
+}
+
+void kmem_cache_dump() {
+    struct kmem_cache_stats st;
+    size_t i;
+
+    kprintf("kmem: %-16s %6s %10s %10s %8s %6s\n", "cache", "size", "allocs", "active", "cached", "slabs");
+    for(i = 0; i < KMEM_MAX_CACHES; i++) {
+        if(!caches[i].size)
+            continue;
+
+        kmem_cache_stats(&caches[i], &st);
+        kprintf("kmem: %-16s %6lu %10lu %10lu %8lu %6lu\n", st.name, (unsigned long) st.size, (unsigned long) st.allocs,
+            (unsigned long) (st.allocs - st.frees), (unsigned long) st.cached, (unsigned long) st.slabs);
+    }
+}
+
+void slab_init() {
+    static const char *names[SLAB_CLASSES] = {
+        "size-16", "size-32", "size-64", "size-128", "size-256", "size-512", "size-1024",
+    };
+
+    size_t i;
+    for(i = 0; i < SLAB_CLASSES; i++) {
+        size_t sz = 1UL << (i + SLAB_MIN_SHIFT);
+        classes[i] = kmem_cache_create(names[i], sz, sz, 0);
+    }
+
+    assert(classes[SLAB_CLASSES - 1]->size == SLAB_MAX_OBJECT);
+
+    slab_ready = 1;
+}
+
+void *slab_alloc(size_t sz) {
+    if(!slab_ready || (sz > SLAB_MAX_OBJECT))
+        return 0;
+
+    return kmem_cache_alloc(classes[size_to_class(sz)]);
+}
+
+void slab_free(void *p) {
+    kmem_cache_free(obj_to_slab(p)->cache, p);
+}
+
+size_t slab_size(void *p) {
+    return obj_to_slab(p)->cache->size;
+}
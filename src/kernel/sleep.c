@@ -18,65 +18,197 @@
 #include <sched.h>
 #include <util.h>
 #include <timer.h>
+#include <clock.h>
 #include <malloc.h>
+#include <multicpu.h>
+#include <interrupts.h>
 #include <io.h>
 
-static void *tlist = 0;
+/// Initial number of entries in a sleep queue.
+#define SLEEPQ_INITIAL_SIZE 16
 
-static int timer_installed = 0;
-
-#define MS_TO_TICKS 1000000
+/// One-shot timers a sleep queue keeps track of at once.
+#define SLEEPQ_MAX_ARMED    4
 
+/// Lives on the stack of the sleeping thread.
 struct sleepinfo {
     struct thread *t;
-    uint64_t tc;
+    uint64_t deadline;
+};
+
+/**
+ * Per-CPU queue of sleeping threads: a binary min-heap ordered by deadline,
+ * so the tick handler only ever looks at threads that are due. Only touched
+ * by its own CPU, with interrupts disabled.
+ */
+struct sleepq {
+    struct sleepinfo **heap;
+    size_t count;
+    size_t size;
+
+    /**
+     * Deadlines of the one-shot timers still to fire, earliest first. A new
+     * earliest sleeper gets a one-shot of its own: remove_timer would take
+     * every CPU's. One-shots fire in deadline order, so each fire is for the
+     * first of these.
+     */
+    uint64_t armed[SLEEPQ_MAX_ARMED];
+    size_t narmed;
 };
 
-int sleep_timer_tick(uint64_t ticks) {
-    if(tlist == NULL)
-        return 0;
+static int sleep_timer_tick(uint64_t ticks);
+
+static struct sleepq *get_sleepq() {
+    struct sleepq **p = (struct sleepq **) multicpu_percpu_at(MULTICPU_PERCPU_SLEEPQ);
+    if(!*p) {
+        struct sleepq *q = (struct sleepq *) malloc(sizeof(struct sleepq));
+        q->heap = (struct sleepinfo **) malloc(sizeof(struct sleepinfo *) * SLEEPQ_INITIAL_SIZE);
+        q->count = 0;
+        q->size = SLEEPQ_INITIAL_SIZE;
+        q->narmed = 0;
+        *p = q;
+    }
+
+    return *p;
+}
+
+static void sleepq_push(struct sleepq *q, struct sleepinfo *s) {
+    if(q->count == q->size) {
+        q->size *= 2;
+        q->heap = (struct sleepinfo **) realloc(q->heap, sizeof(struct sleepinfo *) * q->size);
+    }
+
+    // Sift up.
+    size_t i = q->count++;
+    while(i) {
+        size_t parent = (i - 1) / 2;
+        if(q->heap[parent]->deadline <= s->deadline)
+            break;
+
+        q->heap[i] = q->heap[parent];
+        i = parent;
+    }
 
-    // Test the list.
-    struct sleepinfo *s = 0;
-    size_t n = 0;
+    q->heap[i] = s;
+}
+
+static struct sleepinfo *sleepq_pop(struct sleepq *q) {
+    struct sleepinfo *ret = q->heap[0];
+    struct sleepinfo *last = q->heap[--q->count];
+
+    // Sift down.
+    size_t i = 0;
+    while(1) {
+        size_t child = (i * 2) + 1;
+        if(child >= q->count)
+            break;
+
+        if(((child + 1) < q->count) && (q->heap[child + 1]->deadline < q->heap[child]->deadline))
+            child++;
+
+        if(last->deadline <= q->heap[child]->deadline)
+            break;
+
+        q->heap[i] = q->heap[child];
+        i = child;
+    }
+
+    if(q->count)
+        q->heap[i] = last;
+
+    return ret;
+}
+
+/// Converts nanoseconds into the timer API's tick format, rounding up.
+static uint32_t ns_to_ticks(uint64_t ns) {
+    uint64_t n = (ns + 999) / 1000;
+    if(n < (1U << (32 - TIMERRES_SHIFT)))
+        return (uint32_t) (((n ? n : 1) << TIMERRES_SHIFT) | TIMERRES_MICRO);
+
+    n = (ns + 999999) / 1000000;
+    if(n < (1U << (32 - TIMERRES_SHIFT)))
+        return (uint32_t) ((n << TIMERRES_SHIFT) | TIMERRES_MILLI);
+
+    return (((1U << (32 - TIMERRES_SHIFT)) - 1) << TIMERRES_SHIFT) | TIMERRES_SECONDS;
+}
+
+/// Arms a one-shot for the earliest sleeper, unless one is already due sooner.
+static void sleepq_arm(struct sleepq *q, uint64_t now) {
+    if(!q->count)
+        return;
+
+    uint64_t deadline = q->heap[0]->deadline;
+    if(q->narmed && (deadline >= q->armed[0]))
+        return;
+
+    if(install_timer(sleep_timer_tick, ns_to_ticks(deadline > now ? deadline - now : 0), TIMERFEAT_ONESHOT | TIMERFEAT_PERCPU) != 0)
+        return;
+
+    // Losing track of the latest only costs a spurious re-arm when it fires.
+    if(q->narmed == SLEEPQ_MAX_ARMED)
+        q->narmed--;
+
+    size_t i;
+    for(i = q->narmed; i; i--)
+        q->armed[i] = q->armed[i - 1];
+    q->armed[0] = deadline;
+    q->narmed++;
+}
+
+static int sleep_timer_tick(uint64_t ticks __unused) {
+    struct sleepq *q = get_sleepq();
+    uint64_t now = clock_now_ns();
     int ret = 0;
-    while((s = list_at(tlist, n)) != NULL) {
-        if(s->tc < ticks)
-            s->tc = 0;
-        else
-            s->tc -= ticks;
-
-        if(!s->tc) {
-            thread_wake(s->t);
-
-            free(s);
-            list_remove(tlist, n);
-
-            // Will cause a reschedule to that particular thread.
-            ret = 1;
-        } else {
-            n++;
-        }
+
+    // The earliest one-shot is the one firing, and the rest are still to.
+    if(q->narmed) {
+        size_t i;
+        for(i = 1; i < q->narmed; i++)
+            q->armed[i - 1] = q->armed[i];
+        q->narmed--;
+    }
+
+    while(q->count && (q->heap[0]->deadline <= now)) {
+        struct sleepinfo *s = sleepq_pop(q);
+        thread_wake(s->t);
+
+        // Will cause a reschedule to that particular thread.
+        ret = 1;
     }
 
+    sleepq_arm(q, now);
+
     return ret;
 }
 
-void sleep_ms(uint32_t ms) {
-    if(!tlist)
-        tlist = create_list();
+void sleep_until(uint64_t deadline) {
+    struct sleepinfo s;
+    s.t = sched_current_thread();
+    s.deadline = deadline;
 
-    struct thread *c = sched_current_thread();
-    struct sleepinfo *s = (struct sleepinfo *) malloc(sizeof(struct sleepinfo));
-    s->t = c;
-    s->tc = ms * MS_TO_TICKS;
+    // The queue belongs to this CPU and its timer handler runs on this CPU, so
+    // keeping interrupts off until the thread is asleep means the wakeup can't
+    // come before the thread has actually gone to sleep.
+    int intstate = interrupts_get();
+    interrupts_disable();
 
-    list_insert(tlist, s, 0);
+    uint64_t now = clock_now_ns();
+    if(deadline > now) {
+        struct sleepq *q = get_sleepq();
+        sleepq_push(q, &s);
+        sleepq_arm(q, now);
 
-    if(!timer_installed) {
-        install_timer(sleep_timer_tick, ((1 << TIMERRES_SHIFT) | TIMERRES_MILLI), TIMERFEAT_PERIODIC);
-        timer_installed = 1;
+        thread_sleep();
     }
 
-    thread_sleep();
+    if(intstate)
+        interrupts_enable();
+}
+
+void sleep_ns(uint64_t ns) {
+    sleep_until(clock_now_ns() + ns);
+}
+
+void sleep_ms(uint32_t ms) {
+    sleep_ns(((uint64_t) ms) * 1000000);
 }
@@ -26,11 +26,96 @@
 #include <sched.h>
 #include <io.h>
 
+/// Ticket lock: a CPU takes the next ticket, then waits for it to be served.
 struct spinlock {
-	uint32_t locked;
+	uint32_t next;
+	uint32_t owner;
+
 	uint8_t wasints;
 	uint8_t isstatic;
-};
+
+#ifdef SPINLOCK_STATS
+	uint64_t acquired_at;
+	struct lockstat stats;
+#endif
+} __aligned(SPINLOCK_ALIGN);
+
+/// Upper bound on polls of a ticket lock's owner between pauses.
+#define BACKOFF_MAX		1024
+
+#define ACCESS_ONCE(x)	(*(volatile __typeof__(x) *) &(x))
+
+#ifdef SPINLOCK_STATS
+static struct lockstat *tracked = 0;
+#endif
+
+static uint32_t fetch_inc(uint32_t *p) {
+#ifdef ARM
+	uint32_t old;
+	do {
+		old = ACCESS_ONCE(*p);
+	} while(!atomic_bool_compare_and_swap((void **) p, (void *) old, (void *) (old + 1)));
+	return old;
+#else
+	return __sync_fetch_and_add(p, 1);
+#endif
+}
+
+static struct mcs_node *swap_tail(struct mcs_lock *l, struct mcs_node *n) {
+#ifdef ARM
+	struct mcs_node *old;
+	do {
+		old = ACCESS_ONCE(l->tail);
+	} while(!atomic_bool_compare_and_swap((void **) &l->tail, (void *) old, (void *) n));
+	return old;
+#else
+	// xchg is a full barrier.
+	return __sync_lock_test_and_set(&l->tail, n);
+#endif
+}
+
+void spinlock_poll() {
+	arch_spin_poll();
+	__spin;
+}
+
+static void backoff(size_t n) {
+	spinlock_poll();
+	while(--n)
+		__spin;
+}
+
+#ifdef SPINLOCK_STATS
+/// Hold times use the raw cycle counter: a clock read costs far more than the
+/// short critical sections being measured.
+static void stats_acquired(struct lockstat *st, uint64_t *acquired_at, size_t spins) {
+	st->acquisitions++;
+	if(spins) {
+		st->contended++;
+		st->spins += spins;
+	}
+
+	*acquired_at = arch_cycles();
+}
+
+static void stats_released(struct lockstat *st, uint64_t acquired_at) {
+	uint64_t held = arch_cycles() - acquired_at;
+	if(held > st->max_hold_cycles)
+		st->max_hold_cycles = held;
+}
+
+static void stats_track(struct lockstat *st, const char *name) {
+	st->name = name;
+	do {
+		st->next = tracked;
+	} while(!atomic_bool_compare_and_swap((void **) &tracked, (void *) st->next, (void *) st));
+}
+#endif
+
+static void deadlock(void *s) {
+	dprintf("deadlock in spinlock %p\n", s);
+	panic("deadlock");
+}
 
 spinlock_t create_spinlock() {
 	void *r = malloc(sizeof(struct spinlock));
@@ -49,7 +134,7 @@ void delete_spinlock(spinlock_t s) {
 		return;
 
 	struct spinlock *sl = (struct spinlock *) s;
-	sl->locked = 0;
+	assert(sl->next == sl->owner);
 	free(s);
 }
 
@@ -58,7 +143,7 @@ void *spinlock_getatom(spinlock_t s) {
 		return NULL;
 
 	struct spinlock *sl = (struct spinlock *) s;
-	return (void *) &sl->locked;
+	return (void *) &sl->owner;
 }
 
 uint8_t spinlock_intstate(spinlock_t s) {
@@ -77,11 +162,53 @@ void spinlock_acquire(spinlock_t s) {
 
 	uint8_t wasints = interrupts_get();
 	interrupts_disable();
-	atomic_compare_and_swap(&sl->locked, 1, void * _a __unused, 0, if(multicpu_count() == 1) { dprintf("deadlock in spinlock %p\n", s); panic("deadlock"); } __spin;);
+
+	uint32_t ticket = fetch_inc(&sl->next);
+
+	// Waiters further back in the queue poll the owner less often, and back
+	// off exponentially. The next in line polls as fast as it can.
+	size_t spins = 0, delay = 1;
+	uint32_t owner;
+	while((owner = ACCESS_ONCE(sl->owner)) != ticket) {
+		if(multicpu_count() == 1)
+			deadlock(s);
+
+		if((ticket - owner) > 1) {
+			backoff(delay);
+			if(delay < BACKOFF_MAX)
+				delay <<= 1;
+		} else {
+			spinlock_poll();
+		}
+
+		spins++;
+	}
+
+	__barrier;
 
 	sl->wasints = wasints;
 
-	assert(sl->locked);
+#ifdef SPINLOCK_STATS
+	stats_acquired(&sl->stats, &sl->acquired_at, spins);
+#else
+	(void) spins;
+#endif
+}
+
+void spinlock_release_atom(spinlock_t s) {
+	if(!s)
+		return;
+
+	struct spinlock *sl = (struct spinlock *) s;
+	assert(sl->next != sl->owner);
+
+#ifdef SPINLOCK_STATS
+	stats_released(&sl->stats, sl->acquired_at);
+#endif
+
+	// Only the holder writes the owner, so this needs ordering, not atomicity.
+	__barrier;
+	ACCESS_ONCE(sl->owner) = sl->owner + 1;
 }
 
 void spinlock_release(spinlock_t s) {
@@ -96,13 +223,105 @@ void spinlock_release(spinlock_t s) {
 		panic("spinlock released with interrupts enabled!");
 
 	struct spinlock *sl = (struct spinlock *) s;
-	assert(sl->locked);
 
 	wasints = sl->wasints;
-	atomic_compare_and_swap(&sl->locked, 0, void * _a __unused, 1, if(multicpu_count() == 1) { dprintf("deadlock in spinlock %p\n", s); panic("deadlock"); } __spin;);
+	spinlock_release_atom(s);
 
 	if(wasints)
 		interrupts_enable();
 	else
 		interrupts_disable();
 }
+
+void mcs_acquire(struct mcs_lock *l, struct mcs_node *node) {
+	node->wasints = interrupts_get();
+	interrupts_disable();
+
+	node->next = 0;
+	node->locked = 1;
+
+	size_t spins = 0;
+	struct mcs_node *prev = swap_tail(l, node);
+	if(prev) {
+		if(multicpu_count() == 1)
+			deadlock(l);
+
+		ACCESS_ONCE(prev->next) = node;
+
+		// The previous holder clears our flag when it hands over.
+		while(ACCESS_ONCE(node->locked)) {
+			spinlock_poll();
+			spins++;
+		}
+	}
+
+	__barrier;
+
+#ifdef SPINLOCK_STATS
+	stats_acquired(&l->stats, &l->acquired_at, spins);
+#else
+	(void) spins;
+#endif
+}
+
+void mcs_release(struct mcs_lock *l, struct mcs_node *node) {
+	uint8_t wasints = node->wasints;
+
+#ifdef SPINLOCK_STATS
+	stats_released(&l->stats, l->acquired_at);
+#endif
+
+	struct mcs_node *next = ACCESS_ONCE(node->next);
+	if(!next) {
+		// Nobody queued behind us: try to empty the lock.
+		if(atomic_bool_compare_and_swap((void **) &l->tail, (void *) node, (void *) 0))
+			goto done;
+
+		// Someone is between swapping the tail and linking to us.
+		while(!(next = ACCESS_ONCE(node->next)))
+			spinlock_poll();
+	}
+
+	__barrier;
+	ACCESS_ONCE(next->locked) = 0;
+
+done:
+	if(wasints)
+		interrupts_enable();
+}
+
+void spinlock_track(spinlock_t s __unused, const char *name __unused) {
+#ifdef SPINLOCK_STATS
+	if(s)
+		stats_track(&((struct spinlock *) s)->stats, name);
+#endif
+}
+
+void mcs_track(struct mcs_lock *l __unused, const char *name __unused) {
+#ifdef SPINLOCK_STATS
+	stats_track(&l->stats, name);
+#endif
+}
+
+int spinlock_stats(spinlock_t s __unused, struct lockstat *out __unused) {
+#ifdef SPINLOCK_STATS
+	if(!s)
+		return -1;
+
+	memcpy(out, &((struct spinlock *) s)->stats, sizeof(*out));
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void spinlock_report() {
+#ifdef SPINLOCK_STATS
+	struct lockstat *st = tracked;
+	for(; st; st = st->next) {
+		dprintf("lock %s: %llu acquired, %llu contended (%llu spins), held at most %llu cycles\n",
+			st->name, (unsigned long long) st->acquisitions, (unsigned long long) st->contended,
+			(unsigned long long) st->spins, (unsigned long long) st->max_hold_cycles);
+	}
+#endif
+}
@@ -14,13 +14,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <types.h>
 #include <compiler.h>
 #include <malloc.h>
 #include <util.h>
+#include <rcu.h>
 
 struct node {
 	struct node *next;
 	void *p;
+	struct rcu_head rcu;
 };
 
 struct stack {
@@ -28,6 +31,12 @@ struct stack {
 	uint32_t flags;
 };
 
+/// Runs from the scheduler, where the heap lock is never held, so this can't
+/// use free_nolock even for STACK_FLAGS_NOMEMLOCK stacks.
+static void node_reclaim(struct rcu_head *h) {
+	free((void *) (((uintptr_t) h) - offsetof(struct node, rcu)));
+}
+
 void *create_stack() {
 	void *ret = malloc(sizeof(struct stack));
 	struct stack *s = (struct stack *) ret;
@@ -73,6 +82,7 @@ void stack_push(void *stack, void *data) {
 	else
 		n = (struct node *) malloc(sizeof(struct node));
 	n->p = data;
+	n->next = s->head;
 
 	// Replace the head of the stack with n, but only if our new node next
 	// pointer is still the head of the stack.
@@ -84,18 +94,27 @@ void *stack_pop(void *stack) {
 		return 0;
 
 	struct stack *s = (struct stack *) stack;
-	struct node *top = s->head;
+
+	// Nodes aren't freed while we're in here, so top->next is safe to read even
+	// if another CPU pops top first, and top can't come back at the same
+	// address to fool the compare-and-swap.
+	rcu_read_lock();
 
 	// Remove the first item from the stack by updating the head to point to the
 	// next item from the head. Atomically.
-	atomic_compare_and_swap(&s->head, s->head->next, void * _a __unused, top, top = s->head);
+	struct node *top;
+	do {
+		top = s->head;
+		if(!top) {
+			rcu_read_unlock();
+			return 0;
+		}
+	} while(!atomic_bool_compare_and_swap((void **) &s->head, (void *) top, (void *) top->next));
 
-	void *ret = top->p;
+	rcu_read_unlock();
 
-	if(s->flags & STACK_FLAGS_NOMEMLOCK)
-		free_nolock(top);
-	else
-		free(top);
+	void *ret = top->p;
+	call_rcu(&top->rcu, node_reclaim);
 
 	return ret;
 }
@@ -19,7 +19,11 @@
 #include <timer.h>
 #include <util.h>
 #include <malloc.h>
+#include <slab.h>
 #include <io.h>
+#include <spinlock.h>
+#include <rwlock.h>
+#include <seqlock.h>
 
 #include <multicpu.h>
 
@@ -27,18 +31,86 @@
 
 extern int __begin_timer_table, __end_timer_table;
 
-static void * volatile timer_list = 0;
-
 static void * hwtimer_list = 0;
 
+/// Protects hwtimer_list. Registration is rare, lookups happen on every
+/// install_timer and remove_timer.
+static rwlock_t hwtimer_lock = 0;
+
+/// Global periodic timer that drives the monotonic clock.
+static struct timer *system_timer = 0;
+
+/// Nanoseconds reported by system_timer since it was registered.
+static volatile uint64_t monotonic_ns = 0;
+
+/// Lets readers of monotonic_ns retry torn reads.
+static seqlock_t monotonic_seq;
+
+/// Slots per level of a timer wheel (as a power of two).
+#define WHEEL_BITS			6
+#define WHEEL_SIZE			(1 << WHEEL_BITS)
+#define WHEEL_MASK			(WHEEL_SIZE - 1)
+
+/// Number of levels in a timer wheel. Level n holds handlers due between
+/// WHEEL_SIZE^n and WHEEL_SIZE^(n+1) wheel ticks away.
+#define WHEEL_LEVELS		4
+
+/// Furthest a handler can be placed into the future, in wheel ticks. Later
+/// handlers are parked at the end and re-filed as the wheel turns.
+#define WHEEL_MAX_TICKS		((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/// Buckets in each wheel's handler lookup table (used by remove_timer).
+#define WHEEL_HASH_SIZE		64
+
 struct timer_handler_meta {
 	struct timer *tim;
 	timer_handler th;
-	uint64_t ticks;
+
+	/// Wheel tick at which this handler is due.
+	uint64_t expires;
+
+	/// Period (or one-shot delay) in nanoseconds.
 	uint64_t orig_ticks;
+
+	/// Wheel time (in nanoseconds) at which this handler last ran or was installed.
+	uint64_t last;
+
 	uint32_t feat;
 
 	uint32_t cpu;
+
+	/// Set if removed while running, so the handler is not re-armed.
+	uint32_t dead;
+
+	/// Links within a wheel slot, or within the list of expired handlers.
+	struct timer_handler_meta *next, *prev;
+
+	/// Head of the wheel slot this handler is in (NULL when not in the wheel).
+	struct timer_handler_meta **slot;
+
+	/// Next handler in the same lookup table bucket.
+	struct timer_handler_meta *hnext;
+};
+
+/**
+ * Hierarchical timing wheel. Each registered timer has its own wheel, so
+ * per-CPU timers have per-CPU wheels that only their own CPU ticks.
+ */
+struct timer_wheel {
+	struct timer_handler_meta *slots[WHEEL_LEVELS][WHEEL_SIZE];
+
+	struct timer_handler_meta *hash[WHEEL_HASH_SIZE];
+
+	/// Nanoseconds per wheel tick (the resolution of the timer).
+	uint64_t gran;
+
+	/// Total nanoseconds the timer has reported.
+	uint64_t now;
+
+	/// Next wheel tick to be processed.
+	uint64_t curr;
+
+	spinlock_t lock;
 };
 
 struct crosscpu_th {
@@ -46,6 +118,11 @@ struct crosscpu_th {
 	uint64_t ticks;
 };
 
+/// Caches for handler metadata and cross-CPU calls, made on every install
+/// and on every tick of a handler owned by another CPU respectively.
+static struct kmem_cache *meta_cache = 0;
+static struct kmem_cache *crosscpu_cache = 0;
+
 #define HW_TIMER_COUNT		(list_len(hwtimer_list))
 #define GET_HW_TIMER(n)		((struct timer *) list_at(hwtimer_list, (n)))
 #define GET_TIMER_RES(n)	(GET_HW_TIMER(n)->timer_res & TIMERRES_MASK)
@@ -53,6 +130,109 @@ struct crosscpu_th {
 #define GET_STATIC_TIMER(n) ((struct timer_table_entry *) &__begin_timer_table)[(n)]
 #define STATIC_TIMER_COUNT	((((uintptr_t) &__end_timer_table) - ((uintptr_t) &__begin_timer_table)) / sizeof(struct timer_table_entry))
 
+static uint64_t conv_ticks(uint32_t ticks);
+
+static size_t wheel_hash(timer_handler th) {
+	uintptr_t v = (uintptr_t) th;
+	return (v ^ (v >> 6) ^ (v >> 12)) % WHEEL_HASH_SIZE;
+}
+
+static struct timer_wheel *create_wheel(struct timer *tim) {
+	struct timer_wheel *w = (struct timer_wheel *) malloc(sizeof(struct timer_wheel));
+	memset(w, 0, sizeof(struct timer_wheel));
+
+	w->gran = conv_ticks(tim->timer_res);
+	if(!w->gran)
+		w->gran = 1000000;
+
+	w->lock = create_spinlock();
+
+	return w;
+}
+
+/// Files a handler into the right slot for its expiry. Wheel lock must be held.
+static void wheel_add(struct timer_wheel *w, struct timer_handler_meta *p) {
+	if(p->expires < w->curr)
+		p->expires = w->curr;
+
+	uint64_t expires = p->expires;
+	uint64_t idx = expires - w->curr;
+	if(idx > WHEEL_MAX_TICKS) {
+		idx = WHEEL_MAX_TICKS;
+		expires = w->curr + idx;
+	}
+
+	size_t level = 0;
+	while((level < (WHEEL_LEVELS - 1)) && (idx >= (1ULL << (WHEEL_BITS * (level + 1)))))
+		level++;
+
+	struct timer_handler_meta **slot = &w->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+	p->prev = 0;
+	p->next = *slot;
+	if(*slot)
+		(*slot)->prev = p;
+	*slot = p;
+	p->slot = slot;
+}
+
+/// Takes a handler out of its slot. Wheel lock must be held.
+static void wheel_del(struct timer_handler_meta *p) {
+	if(!p->slot)
+		return;
+
+	if(p->prev)
+		p->prev->next = p->next;
+	else
+		*p->slot = p->next;
+
+	if(p->next)
+		p->next->prev = p->prev;
+
+	p->next = p->prev = 0;
+	p->slot = 0;
+}
+
+static void wheel_unhash(struct timer_wheel *w, struct timer_handler_meta *p) {
+	struct timer_handler_meta **pp = &w->hash[wheel_hash(p->th)];
+	while(*pp) {
+		if(*pp == p) {
+			*pp = p->hnext;
+			break;
+		}
+
+		pp = &(*pp)->hnext;
+	}
+}
+
+/// Re-files every handler in the given slot, now that it is closer to expiry.
+static size_t wheel_cascade(struct timer_wheel *w, size_t level) {
+	size_t index = (w->curr >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	struct timer_handler_meta *p = w->slots[level][index];
+	w->slots[level][index] = 0;
+
+	while(p) {
+		struct timer_handler_meta *next = p->next;
+		p->slot = 0;
+		wheel_add(w, p);
+		p = next;
+	}
+
+	return index;
+}
+
+/// Earliest expiry (in wheel ticks) of a non-deferrable handler in a slot list.
+static uint64_t wheel_slot_earliest(struct timer_handler_meta *p) {
+	uint64_t ret = (uint64_t) ~0ULL;
+	for(; p; p = p->next) {
+		if((p->feat & TIMERFEAT_DEFERRABLE) == 0 && p->expires < ret)
+			ret = p->expires;
+	}
+
+	return ret;
+}
+
 void timers_init() {
 	// Initialise all timers now.
 	size_t i;
@@ -67,6 +247,8 @@ void timers_init() {
 void timer_register(struct timer *tim) {
 	if(!hwtimer_list) {
 		hwtimer_list = create_list();
+		hwtimer_lock = create_rwlock(RWLOCK_SPIN);
+		seqlock_init(&monotonic_seq);
 	}
 
 	if(tim && (tim->timer_init != 0)) {
@@ -76,8 +258,14 @@ void timer_register(struct timer *tim) {
 			kprintf("OK\n");
 
 			tim->cpu = multicpu_id();
+			tim->wheel = create_wheel(tim);
 
+			if((system_timer == 0) && ((tim->timer_feat & (TIMERFEAT_PERIODIC | TIMERFEAT_PERCPU)) == TIMERFEAT_PERIODIC))
+				system_timer = tim;
+
+			rwlock_write_acquire(hwtimer_lock);
 			list_insert(hwtimer_list, tim, 0);
+			rwlock_write_release(hwtimer_lock);
 		} else {
 			kprintf("FAIL\n");
 
@@ -108,7 +296,7 @@ static uint64_t conv_ticks(uint32_t ticks) {
 
 static int timer_crosscpu_stub(struct crosscpu_th *meta) {
 	int ret = meta->th(meta->ticks);
-	free(meta);
+	kmem_cache_free(crosscpu_cache, meta);
 	return ret;
 }
 
@@ -120,7 +308,9 @@ static int do_th(struct timer_handler_meta *p, uint64_t ticks) {
 	if(p->cpu == multicpu_id())
 		return p->th(ticks);
 	else {
-		struct crosscpu_th *crossmeta = (struct crosscpu_th *) malloc(sizeof(struct crosscpu_th));
+		kmem_cache_get(&crosscpu_cache, "timer_crosscpu", sizeof(struct crosscpu_th), 0, 0);
+
+		struct crosscpu_th *crossmeta = (struct crosscpu_th *) kmem_cache_alloc(crosscpu_cache);
 		crossmeta->th = p->th;
 		crossmeta->ticks = ticks;
 		multicpu_call(p->cpu, (crosscpu_func_t) timer_crosscpu_stub, (void *) crossmeta);
@@ -133,8 +323,10 @@ int timer_ticked(struct timer *tim, uint32_t in_ticks) {
 	dprintf("timer %s tick: %x\n", tim->name, in_ticks);
 #endif
 
-	struct timer_handler_meta *p = 0;
-	size_t index = 0;
+	struct timer_wheel *w = (struct timer_wheel *) tim->wheel;
+	if(!w)
+		return 0;
+
 	int ret = 0;
 
 	// Convert the ticks.
@@ -144,64 +336,83 @@ int timer_ticked(struct timer *tim, uint32_t in_ticks) {
 	dprintf("%d %d ns\n", (uint32_t) (ticks >> 32), (uint32_t) ticks);
 #endif
 
-	while((p = (struct timer_handler_meta *) list_at(timer_list, index++))) {
-		// Ignore if not for this timer.
-		if(p->tim != tim)
-			continue;
+	if(tim == system_timer) {
+		seqlock_write_begin(&monotonic_seq);
+		monotonic_ns += ticks;
+		seqlock_write_end(&monotonic_seq);
+	}
 
-		// Expire one-shot timers, if possible.
-		if((tim->timer_feat & TIMERFEAT_ONESHOT) != 0) {
-			if(((p->feat & TIMERFEAT_ONESHOT) != 0) && (p->ticks == ticks)) {
-				ret += do_th(p, ticks);
-				list_remove(timer_list, --index);
-			}
+	// Collect everything that is due. Handlers are run without the lock held,
+	// as they may well install or remove timers themselves.
+	struct timer_handler_meta *expired = 0, *p = 0;
+
+	spinlock_acquire(w->lock);
+
+	w->now += ticks;
+	uint64_t target = w->now / w->gran;
+	while(w->curr <= target) {
+		size_t index = w->curr & WHEEL_MASK;
+
+		// Crossing into a new block of the next level - pull its handlers down.
+		size_t level = 1;
+		if(!index) {
+			while((level < WHEEL_LEVELS) && !wheel_cascade(w, level))
+				level++;
 		}
 
-		// Handle periodic timers.
-		if((tim->timer_feat & TIMERFEAT_PERIODIC) != 0) {
-			if((p->feat & TIMERFEAT_PERIODIC) != 0) {
-				if(p->ticks < ticks)
-					p->ticks = 0;
-				else
-					p->ticks -= ticks;
-
-				if(!p->ticks) {
-					ret += do_th(p, ticks > p->orig_ticks ? ticks : p->orig_ticks);
-					p->ticks = p->orig_ticks; // Reload the timer.
-				}
-			}
+		p = w->slots[0][index];
+		w->slots[0][index] = 0;
+		while(p) {
+			struct timer_handler_meta *next = p->next;
+			p->slot = 0;
+			p->prev = 0;
+			p->next = expired;
+			expired = p;
+			p = next;
 		}
 
-		// One-shot emulation.
-		if(((tim->timer_feat & TIMERFEAT_ONESHOT) == 0) && ((tim->timer_feat & TIMERFEAT_PERIODIC) != 0)) {
-			if((p->feat & TIMERFEAT_ONESHOT) != 0) {
-				if(p->ticks < ticks)
-					p->ticks = 0;
-				else
-					p->ticks -= ticks;
-
-				if(!p->ticks) {
-					ret += do_th(p, ticks > p->orig_ticks ? ticks : p->orig_ticks);
-					list_remove(timer_list, --index);
-				}
-			}
+		w->curr++;
+	}
+
+	uint64_t now = w->now;
+
+	spinlock_release(w->lock);
+
+	while((p = expired)) {
+		expired = p->next;
+		p->next = 0;
+
+		uint64_t elapsed = now - p->last;
+		ret += do_th(p, elapsed > p->orig_ticks ? elapsed : p->orig_ticks);
+
+		spinlock_acquire(w->lock);
+
+		if(((p->feat & TIMERFEAT_PERIODIC) != 0) && !p->dead) {
+			// Reload the timer relative to now, so a long gap between ticks
+			// doesn't leave a backlog of calls to make.
+			p->last = now;
+			p->expires = (now + p->orig_ticks) / w->gran;
+			wheel_add(w, p);
+			p = 0;
+		} else {
+			wheel_unhash(w, p);
 		}
+
+		spinlock_release(w->lock);
+
+		if(p)
+			kmem_cache_free(meta_cache, p);
 	}
 
 	return ret ? 1 : 0;
 }
 
 int install_timer(timer_handler th, uint32_t ticks, uint32_t feat) {
-	if(timer_list == 0) {
-		timer_list = create_list();
-	}
-
-	assert(timer_list != 0);
-
 	dprintf("installing timer handler %x with %x ticks, looking for features %x\n", th, ticks, feat);
 
-	struct timer_handler_meta *p = (struct timer_handler_meta *) malloc(sizeof(struct timer_handler_meta));
-	p->tim = 0;
+	struct timer *tim = 0;
+
+	rwlock_read_acquire(hwtimer_lock);
 
 	// Find a timer that is most effective for these features.
 	// Also, try and match the resolution if at all possible.
@@ -227,7 +438,7 @@ int install_timer(timer_handler th, uint32_t ticks, uint32_t feat) {
 			// want the best possible option!
 			if((ent->timer_res & TIMERRES_MASK) <= (ticks & TIMERRES_MASK)) {
 				dprintf("timer %s is acceptable for this timer handler\n", ent->name);
-				p->tim = ent;
+				tim = ent;
 				break;
 			} else {
 				dprintf("timer %s matches requested features, but does not have an acceptable resolution.\n", ent->name);
@@ -238,8 +449,8 @@ int install_timer(timer_handler th, uint32_t ticks, uint32_t feat) {
 	// If no exact match can be found, we will need to:
 	// a) Do oneshot emulation, or
 	// b) Convert the resolution.
-	if(p->tim == 0) {
-		for(size_t i = 0; (i < HW_TIMER_COUNT) && (p->tim == 0); i++) {
+	if(tim == 0) {
+		for(size_t i = 0; (i < HW_TIMER_COUNT) && (tim == 0); i++) {
 			struct timer *ent = GET_HW_TIMER(i);
 
 			// Ignore per-CPU timers that aren't for this CPU.
@@ -250,47 +461,149 @@ int install_timer(timer_handler th, uint32_t ticks, uint32_t feat) {
 			// Feature match?
 			if((ent->timer_feat & feat) != 0) {
 				dprintf("accepting timer %s because its features match, but the resolution may cause unexpected behaviour.\n", ent->name);
-				p->tim = ent;
+				tim = ent;
 			} else if(((feat & TIMERFEAT_ONESHOT) != 0) && ((ent->timer_feat & TIMERFEAT_PERIODIC) != 0)) {
 				dprintf("accepting timer %s as it can be used for one-shot emulation.\n", ent->name);
-				p->tim = ent; // One-shot emulation.
+				tim = ent; // One-shot emulation.
 			}
 		}
 	}
 
-	if(p->tim == 0) {
+	rwlock_read_release(hwtimer_lock);
+
+	if((tim == 0) || (tim->wheel == 0)) {
 		dprintf("could not find an acceptable timer for this timer handler.\n");
-		free(p);
 		return -1;
 	}
 
+	struct timer_wheel *w = (struct timer_wheel *) tim->wheel;
+
+	kmem_cache_get(&meta_cache, "timer_meta", sizeof(struct timer_handler_meta), 0, 0);
+
+	struct timer_handler_meta *p = (struct timer_handler_meta *) kmem_cache_alloc(meta_cache);
+	memset(p, 0, sizeof(struct timer_handler_meta));
+
+	p->tim = tim;
 	p->th = th;
-	p->ticks = p->orig_ticks = conv_ticks(ticks);
+	p->orig_ticks = conv_ticks(ticks);
 	p->feat = feat;
 	p->cpu = multicpu_id();
 
-	// Insert in order - lowest ticks first, highest last. This allows us to always
-	// handle the closest timer to completion first.
-	size_t i = 0;
-	struct timer_handler_meta *tmp = 0;
-	while((tmp = (struct timer_handler_meta *) list_at(timer_list, i++))) {
-		if(tmp->ticks >= p->ticks)
-			break;
-	}
+	spinlock_acquire(w->lock);
+
+	p->last = w->now;
+	p->expires = (w->now + p->orig_ticks + w->gran - 1) / w->gran;
+	wheel_add(w, p);
 
-	list_insert(timer_list, p, i);
+	size_t bucket = wheel_hash(th);
+	p->hnext = w->hash[bucket];
+	w->hash[bucket] = p;
+
+	spinlock_release(w->lock);
 
 	return 0;
 }
 
 void remove_timer(timer_handler th) {
-	if(timer_list == 0)
-		return;
+	size_t bucket = wheel_hash(th);
 
-	size_t index = 0;
-	struct timer_handler_meta *p = 0;
-	while((p = (struct timer_handler_meta *) list_at(timer_list, index++))) {
-		if(p->th == th)
-			list_remove(timer_list, index--);
+	rwlock_read_acquire(hwtimer_lock);
+
+	for(size_t i = 0; i < HW_TIMER_COUNT; i++) {
+		struct timer_wheel *w = (struct timer_wheel *) GET_HW_TIMER(i)->wheel;
+		if(!w)
+			continue;
+
+		spinlock_acquire(w->lock);
+
+		struct timer_handler_meta **pp = &w->hash[bucket];
+		while(*pp) {
+			struct timer_handler_meta *p = *pp;
+			if(p->th != th) {
+				pp = &p->hnext;
+				continue;
+			}
+
+			if(p->slot) {
+				wheel_del(p);
+				*pp = p->hnext;
+				kmem_cache_free(meta_cache, p);
+			} else {
+				// Currently running - timer_ticked frees it once it returns.
+				p->dead = 1;
+				pp = &p->hnext;
+			}
+		}
+
+		spinlock_release(w->lock);
+	}
+
+	rwlock_read_release(hwtimer_lock);
+}
+
+uint64_t timer_next_deadline(struct timer *tim) {
+	struct timer_wheel *w = (struct timer_wheel *) tim->wheel;
+	if(w == 0)
+		return TIMER_NO_DEADLINE;
+
+	spinlock_acquire(w->lock);
+
+	// The first occupied slot of each level holds that level's earliest
+	// handlers. Lower levels aren't always nearer (they were filed at
+	// different times), so check every level.
+	uint64_t earliest = (uint64_t) ~0ULL;
+	for(size_t level = 0; level < WHEEL_LEVELS; level++) {
+		size_t shift = WHEEL_BITS * level;
+		size_t base = (w->curr >> shift) & WHEEL_MASK;
+		for(size_t n = 0; n < WHEEL_SIZE; n++) {
+			struct timer_handler_meta *slot = w->slots[level][(base + n) & WHEEL_MASK];
+			uint64_t e = wheel_slot_earliest(slot);
+			if(e != (uint64_t) ~0ULL) {
+				if(e < earliest)
+					earliest = e;
+				break;
+			}
+		}
 	}
+
+	uint64_t ret = TIMER_NO_DEADLINE;
+	if(earliest != (uint64_t) ~0ULL) {
+		uint64_t due = earliest * w->gran;
+		ret = (due > w->now) ? (due - w->now) : 0;
+	}
+
+	spinlock_release(w->lock);
+
+	return ret;
+}
+
+uint64_t timer_monotonic_ns() {
+	uint32_t seq;
+	uint64_t ret;
+	do {
+		seq = seqlock_read_begin(&monotonic_seq);
+		ret = monotonic_ns;
+	} while(seqlock_read_retry(&monotonic_seq, seq));
+
+	return ret;
+}
+
+static struct timer *get_cpu_timer() {
+	struct timer **tim = (struct timer **) multicpu_percpu_at(MULTICPU_PERCPU_CPUTIMER);
+	return tim ? *tim : 0;
+}
+
+int timer_tick_stop() {
+	struct timer *tim = get_cpu_timer();
+	if((tim == 0) || (tim->oneshot == 0))
+		return 0;
+
+	tim->oneshot(timer_next_deadline(tim));
+	return 1;
+}
+
+void timer_tick_restart() {
+	struct timer *tim = get_cpu_timer();
+	if(tim && tim->periodic)
+		tim->periodic();
 }
@@ -17,6 +17,8 @@
 #include <types.h>
 #include <test.h>
 #include <spinlock.h>
+#include <slab.h>
+#include <util.h>
 
 #ifdef memset
 #undef memset
@@ -26,25 +28,102 @@
 #undef memcpy
 #endif
 
-/// Define a basic, naive, memset that can be used if __builtin_memset is not usable.
-void memset(void *p, char c, size_t len)
+/// Generic routines work a word at a time once the pointers are aligned.
+typedef unative_t __attribute__((may_alias)) memword_t;
+
+#define WORD_SIZE		sizeof(memword_t)
+#define WORD_MASK		(WORD_SIZE - 1)
+
+/// Below this, the architecture routines aren't worth their setup.
+#define ARCH_MEMFUNC_MIN	64
+
+void *memset(void *p, int c, size_t len)
 {
-	char *s = (char *) p;
-	size_t i = 0;
-	for(; i < len; i++)
-		s[i] = c;
+	unsigned char *s = (unsigned char *) p;
+
+#ifdef X86
+	if(len >= ARCH_MEMFUNC_MIN)
+		return arch_memset(p, c, len);
+#endif
+
+	if(len >= WORD_SIZE * 2) {
+		while((uintptr_t) s & WORD_MASK) {
+			*s++ = (unsigned char) c;
+			len--;
+		}
+
+		// Replicate the byte across the whole word.
+		memword_t w = (unsigned char) c;
+		w *= ((memword_t) ~0UL) / 0xFF;
+
+		memword_t *ws = (memword_t *) s;
+		for(; len >= WORD_SIZE; len -= WORD_SIZE)
+			*ws++ = w;
+		s = (unsigned char *) ws;
+	}
+
+	while(len--)
+		*s++ = (unsigned char) c;
+
+	return p;
 }
 
-/// Define a basic, naive, memcpy that can be used if __builtin_memcpy is not usable.
+/// Copies forwards, so overlapping buffers are fine if dest is below src.
 void *memcpy(void *dest, void *src, size_t len) {
-	char *s1 = (char *) src, *s2 = (char *) dest;
-	while(len--) *s2++ = *s1++;
+	const unsigned char *s = (const unsigned char *) src;
+	unsigned char *d = (unsigned char *) dest;
+
+#ifdef X86
+	if(len >= ARCH_MEMFUNC_MIN)
+		return arch_memcpy(dest, src, len);
+#endif
+
+	// Word copies need both sides to share an alignment.
+	if(len >= WORD_SIZE * 2 && !(((uintptr_t) s ^ (uintptr_t) d) & WORD_MASK)) {
+		while((uintptr_t) d & WORD_MASK) {
+			*d++ = *s++;
+			len--;
+		}
+
+		const memword_t *ws = (const memword_t *) s;
+		memword_t *wd = (memword_t *) d;
+		for(; len >= WORD_SIZE; len -= WORD_SIZE)
+			*wd++ = *ws++;
+
+		s = (const unsigned char *) ws;
+		d = (unsigned char *) wd;
+	}
+
+	while(len--)
+		*d++ = *s++;
+
 	return dest;
 }
 
 int memcmp(const void *a, const void *b, size_t len) {
 	const unsigned char *ac = (const unsigned char *) a;
 	const unsigned char *bc = (const unsigned char *) b;
+
+	// Skip equal words; the byte loop below finds the first difference.
+	if(len >= WORD_SIZE * 2 && !(((uintptr_t) ac ^ (uintptr_t) bc) & WORD_MASK)) {
+		while(len && ((uintptr_t) ac & WORD_MASK)) {
+			if(*ac != *bc)
+				return (*ac > *bc) ? 1 : -1;
+
+			ac++; bc++; len--;
+		}
+
+		const memword_t *wa = (const memword_t *) ac;
+		const memword_t *wb = (const memword_t *) bc;
+		while(len >= WORD_SIZE && *wa == *wb) {
+			wa++; wb++;
+			len -= WORD_SIZE;
+		}
+
+		ac = (const unsigned char *) wa;
+		bc = (const unsigned char *) wb;
+	}
+
 	while(len--) {
 		if(*ac > *bc)
 			return 1;
@@ -61,52 +140,75 @@ extern void *dlmalloc(size_t);
 extern void *dlrealloc(void *, size_t);
 extern void dlfree(void *);
 
-static void *alloc_spinlock = 0;
-static char alloc_spinlock_region[16] = {0};
+/// Every CPU contends for the heap when the slab caches can't help, so this
+/// is a queued lock.
+static struct mcs_lock alloc_lock;
 
 void init_malloc() {
-}
+	mcs_track(&alloc_lock, "malloc");
 
-static void init_malloc_lock() {
-	if (alloc_spinlock) {
-		return;
-	}
-
-	alloc_spinlock = create_spinlock_at(alloc_spinlock_region, sizeof(alloc_spinlock_region));
+	slab_init();
 }
 
 void *malloc(size_t s) {
-	init_malloc_lock();
+	// Small allocations come from the per-CPU slab caches.
+	if(s <= SLAB_MAX_OBJECT) {
+		void *p = slab_alloc(s);
+		if(p)
+			return p;
+	}
 
-	spinlock_acquire(alloc_spinlock);
+	struct mcs_node node;
+	mcs_acquire(&alloc_lock, &node);
 
 	void *ret = dlmalloc(s);
 
-	spinlock_release(alloc_spinlock);
+	mcs_release(&alloc_lock, &node);
+
+	return ret;
+}
+
+/// Moves a slab object to a new allocation if it no longer fits.
+static void *slab_realloc(void *p, size_t s) {
+	size_t old = slab_size(p);
+	if(s <= old)
+		return p;
+
+	void *ret = malloc(s);
+	if(ret) {
+		memcpy(ret, p, old);
+		slab_free(p);
+	}
 
 	return ret;
 }
 
 void *realloc(void *p, size_t s) {
-	init_malloc_lock();
+	if(slab_owns(p))
+		return slab_realloc(p, s);
 
-	spinlock_acquire(alloc_spinlock);
+	struct mcs_node node;
+	mcs_acquire(&alloc_lock, &node);
 
 	void *ret = dlrealloc(p, s);
 
-	spinlock_release(alloc_spinlock);
+	mcs_release(&alloc_lock, &node);
 
 	return ret;
 }
 
 void free(void *p) {
-	init_malloc_lock();
+	if(slab_owns(p)) {
+		slab_free(p);
+		return;
+	}
 
-	spinlock_acquire(alloc_spinlock);
+	struct mcs_node node;
+	mcs_acquire(&alloc_lock, &node);
 
 	dlfree(p);
 
-	spinlock_release(alloc_spinlock);
+	mcs_release(&alloc_lock, &node);
 }
 
 void *malloc_nolock(size_t sz) {
@@ -114,10 +216,18 @@ void *malloc_nolock(size_t sz) {
 }
 
 void *realloc_nolock(void *p, size_t newsz) {
+	if(slab_owns(p))
+		return slab_realloc(p, newsz);
+
 	return dlrealloc(p, newsz);
 }
 
 void free_nolock(void *m) {
+	if(slab_owns(m)) {
+		slab_free(m);
+		return;
+	}
+
 	dlfree(m);
 }
 
@@ -144,3 +254,13 @@ DEFINE_TEST(memset_empty, ORDER_PRIMARY, 1,
 			memset(buf, 0, 0),
 			(buf[0] == 1 && buf[1] == 2 &&
 			 buf[2] == 3 && buf[3] == 4) ? 1 : 0)
+
+DEFINE_TEST(memcpy_unaligned, ORDER_PRIMARY, 0,
+			TEST_INIT_VAR(char, buf[16], "0123456789abcdef"),
+			memcpy(&buf[1], &buf[10], 5),
+			memcmp(buf, "0abcde6789abcdef", 16))
+
+DEFINE_TEST(memcmp_order, ORDER_PRIMARY, -1,
+			TEST_INIT_VAR(char, buf[10], "abcdefgh1"),
+			NOP,
+			memcmp(buf, "abcdefgh2", 9))
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <types.h>
+#include <system.h>
+#include <vmregion.h>
+#include <spinlock.h>
+#include <vmem.h>
+#include <pmem.h>
+#include <util.h>
+#include <io.h>
+
+static struct vm_region *regions = 0;
+
+static int enabled = 0;
+
+/// Serialises adding regions. Faults walk the list without it: regions are
+/// only ever pushed on the front, once filled in.
+static spinlock_t lock = 0;
+static char lock_region[SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+
+/// Commits hash onto these by page, so two CPUs faulting on one page don't
+/// both map it. A zeroed spinlock is an unlocked one.
+#define COMMIT_LOCKS    16
+static char commit_locks[COMMIT_LOCKS][SPINLOCK_SIZE] __aligned(SPINLOCK_ALIGN);
+
+void vmregion_add(struct vm_region *r) {
+    if(!lock)
+        lock = create_spinlock_at(lock_region, sizeof(lock_region));
+
+    spinlock_acquire(lock);
+    r->next = regions;
+    __barrier;
+    regions = r;
+    spinlock_release(lock);
+}
+
+void vmregion_enable() {
+    enabled = 1;
+}
+
+int vmregion_ready() {
+    return enabled;
+}
+
+int vmregion_fault(vaddr_t v) {
+    vaddr_t page = v & ~(PAGE_SIZE - 1);
+
+    struct vm_region *r = regions;
+    for(; r; r = r->next) {
+        if((v >= r->base) && (v < r->end))
+            break;
+    }
+
+    if(!r)
+        return -1;
+
+    if(r->stride && (((v - r->base) % r->stride) < r->guard)) {
+        dprintf("vmregion: fault at %x is in a guard page\n", v);
+        return -1;
+    }
+
+    // Another CPU may have committed it already.
+    if(vmem_ismapped(page))
+        return 0;
+
+    // Clear the page before it is mapped, so nobody can see what was in it.
+    int zeroed = 0;
+    paddr_t p = pmem_alloc_zeroed(&zeroed);
+    if(!p)
+        return -1;
+
+    if(!zeroed)
+        zeroed = pmem_zero_page(p) == 0;
+
+    spinlock_t l = (spinlock_t) commit_locks[(page / PAGE_SIZE) % COMMIT_LOCKS];
+    spinlock_acquire(l);
+
+    int ret = 0, used = 0;
+    if(!vmem_ismapped(page)) {
+        if(vmem_map(page, p, r->flags) < 0) {
+            ret = -1;
+        } else {
+            used = 1;
+
+            // Early on, before the zeroing thread reserves its windows, the
+            // page can only be cleared where it is mapped.
+            if(!zeroed)
+                memset((void *) page, 0, PAGE_SIZE);
+        }
+    }
+
+    spinlock_release(l);
+
+    if(!used)
+        pmem_dealloc(p);
+
+    return ret;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2012 Matthew Iselin, Rich Edelman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <types.h>
+#include <waitqueue.h>
+#include <spinlock.h>
+#include <sched.h>
+
+void wait_queue_init(wait_queue_t *wq) {
+    wq->waiters.head = wq->waiters.tail = 0;
+    wq->lock = create_spinlock_at(wq->lock_region, sizeof(wq->lock_region));
+}
+
+void wait_queue_lock(wait_queue_t *wq) {
+    spinlock_acquire(wq->lock);
+}
+
+void wait_queue_unlock(wait_queue_t *wq) {
+    spinlock_release(wq->lock);
+}
+
+void wait_queue_sleep_locked(wait_queue_t *wq) {
+    thread_block(&wq->waiters, THREAD_STATE_SLEEPING, wq->lock);
+}
+
+void wait_queue_sleep(wait_queue_t *wq) {
+    spinlock_acquire(wq->lock);
+    wait_queue_sleep_locked(wq);
+}
+
+int wait_queue_wake_one_locked(wait_queue_t *wq) {
+    struct thread *t = thread_list_pop(&wq->waiters);
+    if(!t)
+        return 0;
+
+    thread_wake(t);
+    return 1;
+}
+
+size_t wait_queue_wake_all_locked(wait_queue_t *wq) {
+    size_t n = 0;
+    while(wait_queue_wake_one_locked(wq))
+        n++;
+
+    return n;
+}
+
+int wait_queue_wake_one(wait_queue_t *wq) {
+    spinlock_acquire(wq->lock);
+    int ret = wait_queue_wake_one_locked(wq);
+    spinlock_release(wq->lock);
+
+    return ret;
+}
+
+size_t wait_queue_wake_all(wait_queue_t *wq) {
+    spinlock_acquire(wq->lock);
+    size_t ret = wait_queue_wake_all_locked(wq);
+    spinlock_release(wq->lock);
+
+    return ret;
+}
@@ -0,0 +1,190 @@
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+#include "../kernel/include/ring.h"
+
+TEST(RingTest, CreateDelete) {
+    void *r = create_ring(16, sizeof(int), RING_MPMC);
+    delete_ring(r);
+}
+
+TEST(RingTest, PushPopInOrder) {
+    void *r = create_ring(4, sizeof(int), RING_MPMC);
+
+    for(int i = 0; i < 4; i++) {
+        EXPECT_EQ(ring_push(r, &i), 0);
+    }
+
+    for(int i = 0; i < 4; i++) {
+        int v = -1;
+        EXPECT_EQ(ring_pop(r, &v), 0);
+        EXPECT_EQ(v, i);
+    }
+
+    delete_ring(r);
+}
+
+TEST(RingTest, FullAndEmpty) {
+    void *r = create_ring(4, sizeof(int), RING_MPMC);
+
+    int v = 0;
+    EXPECT_EQ(ring_pop(r, &v), -1);
+
+    for(int i = 0; i < 4; i++) {
+        EXPECT_EQ(ring_push(r, &i), 0);
+    }
+    EXPECT_EQ(ring_push(r, &v), -1);
+    EXPECT_EQ(ring_count(r), 4u);
+
+    delete_ring(r);
+}
+
+TEST(RingTest, CapacityRoundsUp) {
+    void *r = create_ring(5, sizeof(int), RING_SPSC);
+
+    int v = 0;
+    for(int i = 0; i < 8; i++) {
+        EXPECT_EQ(ring_push(r, &i), 0);
+    }
+    EXPECT_EQ(ring_push(r, &v), -1);
+
+    delete_ring(r);
+}
+
+TEST(RingTest, WrapsAround) {
+    void *r = create_ring(4, sizeof(int), RING_MPSC);
+
+    for(int i = 0; i < 100; i++) {
+        int v = -1;
+        EXPECT_EQ(ring_push(r, &i), 0);
+        EXPECT_EQ(ring_pop(r, &v), 0);
+        EXPECT_EQ(v, i);
+    }
+
+    delete_ring(r);
+}
+
+TEST(RingTest, LargeElements) {
+    struct elem {
+        void *a;
+        void *b;
+        char c;
+    };
+
+    void *r = create_ring(4, sizeof(struct elem), RING_MPMC);
+
+    struct elem in = {&in, r, 'x'}, out;
+    memset(&out, 0, sizeof(out));
+    EXPECT_EQ(ring_push(r, &in), 0);
+    EXPECT_EQ(ring_pop(r, &out), 0);
+    EXPECT_EQ(out.a, in.a);
+    EXPECT_EQ(out.b, in.b);
+    EXPECT_EQ(out.c, in.c);
+
+    delete_ring(r);
+}
+
+TEST(RingTest, BatchIsPartialWhenFull) {
+    void *r = create_ring(8, sizeof(int), RING_MPMC);
+
+    int in[12], out[12];
+    for(int i = 0; i < 12; i++) {
+        in[i] = i;
+    }
+
+    EXPECT_EQ(ring_push_batch(r, in, 5), 5u);
+    EXPECT_EQ(ring_push_batch(r, in + 5, 7), 3u);
+    EXPECT_EQ(ring_push_batch(r, in, 1), 0u);
+
+    EXPECT_EQ(ring_pop_batch(r, out, 3), 3u);
+    EXPECT_EQ(ring_pop_batch(r, out + 3, 12), 5u);
+    EXPECT_EQ(ring_pop_batch(r, out, 1), 0u);
+
+    for(int i = 0; i < 8; i++) {
+        EXPECT_EQ(out[i], i);
+    }
+
+    delete_ring(r);
+}
+
+TEST(RingTest, SingleProducerSingleConsumer) {
+    const int count = 100000;
+    void *r = create_ring(64, sizeof(int), RING_SPSC);
+
+    std::thread producer([r, count]() {
+        for(int i = 0; i < count; i++) {
+            while(ring_push(r, &i)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    for(int i = 0; i < count; i++) {
+        int v = -1;
+        while(ring_pop(r, &v)) {
+            std::this_thread::yield();
+        }
+        ASSERT_EQ(v, i);
+    }
+
+    producer.join();
+    delete_ring(r);
+}
+
+TEST(RingTest, MultipleProducersMultipleConsumers) {
+    const int threads = 4;
+    const int count = 50000;
+    void *r = create_ring(64, sizeof(int), RING_MPMC);
+
+    std::vector<std::thread> workers;
+    std::vector<long> sums(threads, 0);
+
+    for(int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([r, count]() {
+            int batch[4];
+            for(int i = 0; i < count; i += 4) {
+                for(int j = 0; j < 4; j++) {
+                    batch[j] = i + j + 1;
+                }
+
+                size_t done = 0;
+                while(done < 4) {
+                    done += ring_push_batch(r, batch + done, 4 - done);
+                    std::this_thread::yield();
+                }
+            }
+        }));
+
+        workers.push_back(std::thread([r, count, t, &sums]() {
+            int batch[3];
+            int got = 0;
+            while(got < count) {
+                size_t n = ring_pop_batch(r, batch, ((count - got) < 3) ? (count - got) : 3);
+                for(size_t j = 0; j < n; j++) {
+                    sums[t] += batch[j];
+                }
+                got += n;
+                if(!n) {
+                    std::this_thread::yield();
+                }
+            }
+        }));
+    }
+
+    for(auto &w : workers) {
+        w.join();
+    }
+
+    long total = 0;
+    for(int t = 0; t < threads; t++) {
+        total += sums[t];
+    }
+
+    long expected = (long) threads * ((long) count * (count + 1) / 2);
+    EXPECT_EQ(total, expected);
+    EXPECT_EQ(ring_count(r), 0u);
+
+    delete_ring(r);
+}